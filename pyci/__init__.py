@@ -17,8 +17,9 @@ r"""PyCI module."""
 
 from pyci._pyci import __version__, c_long, c_ulong, c_double
 from pyci._pyci import secondquant_op, wavefunction, one_spin_wfn, two_spin_wfn
-from pyci._pyci import doci_wfn, fullci_wfn, genci_wfn, sparse_op
-from pyci._pyci import get_num_threads, set_num_threads, popcnt, ctz
+from pyci._pyci import doci_wfn, fullci_wfn, genci_wfn, sparse_op, direct_op
+from pyci._pyci import get_num_threads, set_num_threads, set_out_of_core, popcnt, ctz
+from pyci._pyci import get_busy_times, reset_busy_times
 from pyci._pyci import compute_overlap, compute_rdms, compute_transition_rdms,compute_rdms_1234
 from pyci._pyci import add_hci, compute_enpt2
 
@@ -45,8 +46,12 @@ __all__ = [
     "fullci_wfn",
     "genci_wfn",
     "sparse_op",
+    "direct_op",
     "get_num_threads",
     "set_num_threads",
+    "get_busy_times",
+    "reset_busy_times",
+    "set_out_of_core",
     "popcnt",
     "ctz",
     "add_hci",
@@ -498,20 +498,14 @@ class FanCI(metaclass=ABCMeta):
         #
         jac_proj = jac_proj[:, :-1]
 
-        # Iterate over remaining columns of Jacobian and d_ovlp
-        for jac_col, d_ovlp_col in zip(jac_proj.transpose(), d_ovlp.transpose()):
-            #
-            # Compute each column of the Jacobian:
-            #
-            #   d(<n|H|\Psi>)/d(p_k) = <m|H|n> d(c_m)/d(p_k)
-            #
-            #   E d(<n|\Psi>)/d(p_k) = E \delta_{nk} d(c_n)/d(p_k)
-            #
-            # Note: we update d_ovlp in-place here
-            self._ci_op(d_ovlp_col, out=jac_col)
-            d_ovlp_proj = d_ovlp_col[: self._nproj]
-            d_ovlp_proj *= energy
-            jac_col -= d_ovlp_proj
+        # Compute the remaining columns of the Jacobian in one pass over the operator:
+        #
+        #   d(<n|H|\Psi>)/d(p_k) = <m|H|n> d(c_m)/d(p_k)
+        #
+        #   E d(<n|\Psi>)/d(p_k) = E \delta_{nk} d(c_n)/d(p_k)
+        #
+        jac_proj[:] = self._ci_op.matmat(d_ovlp)
+        jac_proj -= energy * d_ovlp[: self._nproj]
 
         # Compute Jacobian of constraint functions
         for i, constraint in enumerate(self._constraints.values()):
@@ -15,22 +15,39 @@
 
 #pragma once
 
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <ios>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 #define EIGEN_DEFAULT_DENSE_INDEX_TYPE long
 #include <Eigen/Core>
+#include <Eigen/Eigenvalues>
 #include <Eigen/SparseCore>
 
 #include <Spectra/MatOp/SparseSymMatProd.h>
@@ -57,18 +74,30 @@
 #define BUILD_TIME STRINGIZE(_BUILD_TIME)
 #define COMPILER_VERSION STRINGIZE(_COMPILER_VERSION)
 
-/* Dynamic resize factor for SparseOp vectors. */
-
-#ifndef PYCI_SPARSEOP_RESIZE_FACTOR
-#define PYCI_SPARSEOP_RESIZE_FACTOR 1.5
-#endif
-
 /* Minimum number of individual jobs per thread. */
 
 #ifndef PYCI_CHUNKSIZE_MIN
 #define PYCI_CHUNKSIZE_MIN 1024
 #endif
 
+/* Number of individual jobs per chunk of a dynamically scheduled loop. */
+
+#ifndef PYCI_CHUNKSIZE_DYNAMIC
+#define PYCI_CHUNKSIZE_DYNAMIC 32
+#endif
+
+/* Maximum size in bytes of the private copies of the RDMs held by the threads. */
+
+#ifndef PYCI_RDM_BUFFER_MAX
+#define PYCI_RDM_BUFFER_MAX (1L << 30)
+#endif
+
+/* Number of determinant lookups in flight per batch. */
+
+#ifndef PYCI_BATCH_SIZE
+#define PYCI_BATCH_SIZE 16
+#endif
+
 namespace pyci {
 
 /* Integer types, popcnt and ctz functions. */
@@ -167,6 +196,7 @@ using ColMajorArray = pybind11::array_t<Scalar, pybind11::array::f_style | pybin
 /* Forward-declare classes. */
 
 struct SQuantOp;
+struct HeatBath;
 struct Wfn;
 struct OneSpinWfn;
 struct TwoSpinWfn;
@@ -174,18 +204,55 @@ struct DOCIWfn;
 struct FullCIWfn;
 struct GenCIWfn;
 struct SparseOp;
+struct ConnectedDets;
+struct DirectOp;
 
-/* Number of threads global variable. */
+/* Number of threads global variables. */
 
 extern long g_number_threads;
 
+extern bool g_pin_threads;
+
+/* Out-of-core sparse operator global variables. */
+
+extern std::string g_scratch_dir;
+
+extern long g_incore_max;
+
 /* PyCI routines. */
 
 long get_num_threads(void);
 
 long end_chunk_idx(const long, const long, const long);
 
-void set_num_threads(const long);
+void set_num_threads(const long, const bool = false);
+
+void parallel_run(const long, const std::function<void(long)> &);
+
+/* Run fn(slot, start, end) over [0, n) in chunks of chunksize, scheduled dynamically on nslot
+ * slots. Each slot is dealt an even share of the chunks and runs them in order, then steals half of
+ * the chunks left to another slot, so that elements of uneven cost are balanced. A slot runs on one
+ * thread at a time, so state indexed by slot needs no locks. */
+
+void parallel_for(const long, const long, const long,
+                  const std::function<void(long, long, long)> &);
+
+Vector<double> get_busy_times(void);
+
+void reset_busy_times(void);
+
+/* Scratch buffer of the calling thread, kept across calls so that the pool's workers reuse their
+ * allocations. Its contents are unspecified, and Slot tells apart the buffers of one kernel. */
+
+template<class T, int Slot>
+inline T *thread_scratch(const long n) {
+    thread_local AlignedVector<T> buffer;
+    if (static_cast<long>(buffer.size()) < n)
+        buffer.resize(n);
+    return buffer.data();
+}
+
+void set_out_of_core(const std::string &, const long);
 
 long binomial(long, long);
 
@@ -211,6 +278,8 @@ long popcnt_det(const long, const ulong *);
 
 long ctz_det(const long, const ulong *);
 
+long diff_det(const long, const ulong *, const ulong *, long *, long *);
+
 long nword_det(const long);
 
 void excite_det(const long, const long, ulong *);
@@ -219,6 +288,135 @@ void setbit_det(const long, ulong *);
 
 void clearbit_det(const long, ulong *);
 
+/* Determinant bit kernels specialized on the number of words per spin string, so that their word
+ * loops are unrolled (NW = 1, 2 or 4); NW = 0 takes the number of words at runtime. Callers
+ * select the instance once with select_nword. */
+
+template<class Fn>
+inline Fn select_nword(const long nword, Fn fn1, Fn fn2, Fn fn4, Fn fn0) {
+    switch (nword) {
+    case 1:
+        return fn1;
+    case 2:
+        return fn2;
+    case 4:
+        return fn4;
+    default:
+        return fn0;
+    }
+}
+
+template<long NW>
+inline void fill_occs(const long nword, const ulong *det, long *occs) {
+    long j = 0;
+    for (long i = 0; i < (NW ? NW : nword); ++i)
+        for (ulong word = det[i]; word; word &= word - 1)
+            occs[j++] = Ctz(word) + i * Size<ulong>();
+}
+
+template<long NW>
+inline void fill_virs(const long nword, long nbasis, const ulong *det, long *virs) {
+    long j = 0;
+    for (long i = 0; i < (NW ? NW : nword); ++i, nbasis -= Size<ulong>()) {
+        ulong word = ~det[i];
+        if (nbasis < Size<ulong>())
+            word &= (1UL << nbasis) - 1;
+        for (; word; word &= word - 1)
+            virs[j++] = Ctz(word) + i * Size<ulong>();
+    }
+}
+
+template<long NW>
+inline long popcnt_det(const long nword, const ulong *det) {
+    long popcnt = 0;
+    for (long i = 0; i < (NW ? NW : nword); ++i)
+        popcnt += Pop(det[i]);
+    return popcnt;
+}
+
+template<long NW>
+inline long nperm_det(const long low, const long high, const ulong *det) {
+    // number of occupied orbitals strictly between low and high
+    long j = low / Size<ulong>(), k = high / Size<ulong>();
+    ulong lmask = ~((2UL << (low % Size<ulong>())) - 1);
+    ulong hmask = (1UL << (high % Size<ulong>())) - 1;
+    if (j == k)
+        return Pop(det[j] & lmask & hmask);
+    long nperm = Pop(det[j] & lmask) + Pop(det[k] & hmask);
+    for (long l = j + 1; l < k; ++l)
+        nperm += Pop(det[l]);
+    return nperm;
+}
+
+template<>
+inline long nperm_det<1>(const long low, const long high, const ulong *det) {
+    return Pop(det[0] & ~((2UL << low) - 1) & ((1UL << high) - 1));
+}
+
+template<>
+inline long nperm_det<2>(const long low, const long high, const ulong *det) {
+    typedef unsigned __int128 uint128;
+    uint128 mask = ~((static_cast<uint128>(2) << low) - 1);
+    mask &= (static_cast<uint128>(1) << high) - 1;
+    return Pop(det[0] & static_cast<ulong>(mask)) +
+           Pop(det[1] & static_cast<ulong>(mask >> Size<ulong>()));
+}
+
+template<long NW>
+inline long phase_single_det(const long, const long i, const long a, const ulong *det) {
+    return (nperm_det<NW>(std::min(i, a), std::max(i, a), det) % 2) ? -1 : 1;
+}
+
+template<long NW>
+inline long phase_double_det(const long, const long i1, const long i2, const long a1,
+                             const long a2, const ulong *det) {
+    long nperm = nperm_det<NW>(std::min(i1, a1), std::max(i1, a1), det) +
+                 nperm_det<NW>(std::min(i2, a2), std::max(i2, a2), det);
+    // order excitations properly
+    if ((i2 < a1) || (i1 > a2))
+        ++nperm;
+    return (nperm % 2) ? -1 : 1;
+}
+
+inline bool testbit_det(const long i, const ulong *det) {
+    return (det[i / Size<ulong>()] >> (i % Size<ulong>())) & 1UL;
+}
+
+/* Prefix parities of a determinant's occupations: parity[p] is the parity of the number of its
+ * occupied orbitals below p, for p = 0, ..., nbasis. The table is filled once per reference
+ * determinant, with its occs and virs, and the phase of each of its (distinct-index) excitations
+ * is then a few table lookups and XORs instead of masked popcounts over its words. */
+
+template<long NW>
+inline void fill_parity(const long nword, const long nbasis, const ulong *det, long *parity) {
+    long p = 0, q = 0;
+    for (long i = 0; i < (NW ? NW : nword); ++i) {
+        ulong word = det[i];
+        for (long b = 0; b < Size<ulong>() && q < nbasis; ++b, ++q) {
+            parity[q] = p;
+            p ^= (word >> b) & 1UL;
+        }
+    }
+    parity[nbasis] = p;
+}
+
+inline long nperm_parity(const long *parity, const long i, const long a) {
+    // parity of the number of occupied orbitals strictly between i and a
+    return parity[std::max(i, a)] ^ parity[std::min(i, a) + 1];
+}
+
+inline long phase_single_det(const long *parity, const long i, const long a) {
+    return 1 - (nperm_parity(parity, i, a) << 1);
+}
+
+inline long phase_double_det(const long *parity, const long i1, const long i2, const long a1,
+                             const long a2) {
+    // order excitations properly
+    long nperm = nperm_parity(parity, i1, a1) ^ nperm_parity(parity, i2, a2) ^
+                 static_cast<long>((i2 < a1) || (i1 > a2));
+    return 1 - (nperm << 1);
+}
+
 void compute_rdms(const DOCIWfn &, const double *, double *, double *);
 
 void compute_rdms_1234(const DOCIWfn &, const double *, double *, double *, double *, double *);
@@ -244,7 +442,14 @@ long add_hci(const SQuantOp &, WfnType &, const double *, const double, const lo
 
 template<class WfnType>
 double compute_enpt2(const SQuantOp &, const WfnType &, const double *, const double, const double,
-                     const long = -1);
+                     const long = -1, const long = 1);
+
+template<class WfnType>
+std::pair<double, double> compute_enpt2_semistochastic(const SQuantOp &, const WfnType &,
+                                                       const double *, const double, const double,
+                                                       const double, const long, const long,
+                                                       const ulong, const long = -1,
+                                                       const long = 1);
 
 /* Free Python interface functions. */
 
@@ -252,6 +457,8 @@ long py_popcnt(const Array<ulong>);
 
 long py_ctz(const Array<ulong>);
 
+Array<double> py_get_busy_times(void);
+
 pybind11::tuple py_compute_rdms_doci(const DOCIWfn &, const Array<double>);
 
 pybind11::tuple py_compute_rdms_1234_doci(const DOCIWfn &, const Array<double>);
@@ -277,8 +484,10 @@ template<class WfnType>
 long py_add_hci(const SQuantOp &, WfnType &, const Array<double>, const double, const long = -1);
 
 template<class WfnType>
-double py_compute_enpt2(const SQuantOp &, const WfnType &, const Array<double>, const double,
-                        const double, const long = -1);
+pybind11::object py_compute_enpt2(const SQuantOp &, const WfnType &, const Array<double>,
+                                  const double, const double, const long, const long,
+                                  const std::string &, const double, const long, const long,
+                                  const ulong);
 
 /* Second quantized operator class. */
 
@@ -299,6 +508,40 @@ public:
     SQuantOp(const double, const Array<double>, const Array<double>);
 
     void to_file(const std::string &, const long, const long, const double) const;
+
+    const HeatBath &heatbath_pairs(const double = 0.0) const;
+
+    const HeatBath &heatbath_same(const double = 0.0) const;
+
+    const HeatBath &heatbath_opposite(const double = 0.0) const;
+
+private:
+    mutable std::shared_ptr<const HeatBath> hb_pairs, hb_same, hb_opposite;
+};
+
+/* Heat-bath table of an SQuantOp: for each key (an occupied orbital or pair of orbitals), the
+ * targets (an orbital or pair of orbitals it can be excited to) with a coupling above the cutoff,
+ * sorted by decreasing magnitude of the coupling, so that HCI screening can stop at the first
+ * coupling below its threshold. The tables are
+ *
+ *     pairs:    k -> l,             coupling v[k, l],                              key k,
+ *     same:     (p, q) -> (r, s),   coupling <pq|rs> - <pq|sr>, p < q and r < s,   key pair_key,
+ *     opposite: (p, q) -> (r, s),   coupling <pq|rs>, p, r alpha and q, s beta,    key p * n + q,
+ *
+ * with targets numbered r * n + s. Only the entries above the cutoff are stored, so a table takes
+ * 16 bytes per entry and 8 per key; with a zero cutoff the opposite-spin table holds up to n**4
+ * entries. They are built on first use, and rebuilt when a lower cutoff is asked for, which must
+ * not race with their readers; they are shared by copies of the SQuantOp. */
+
+struct HeatBath final {
+public:
+    double cutoff;
+    AlignedVector<long> ptr, ind;
+    AlignedVector<double> val;
+
+    static long pair_key(const long n, const long p, const long q) {
+        return p * (2 * n - p - 1) / 2 + q - p - 1;
+    }
 };
 
 /* Wave function classes. */
@@ -307,15 +550,83 @@ struct Wfn {
 public:
     long nbasis, nocc, nocc_up, nocc_dn, nvir, nvir_up, nvir_dn;
     long ndet, nword, nword2, maxrank_up, maxrank_dn;
+    bool complete, addressed, zobrist, bloom;
 
 protected:
+    /* The hash index stores only the indices of the determinants, and hashes and compares them
+     * through dets; it is searched by a determinant and its rank (DetKey) or by a rank alone. */
+
+    struct DetKey {
+        const ulong *det;
+        Hash rank;
+    };
+
+    struct IndexHash {
+        using is_transparent = void;
+
+        const Wfn *wfn;
+
+        explicit IndexHash(const Wfn *w = nullptr) : wfn(w) {
+        }
+
+        inline std::size_t operator()(const long i) const {
+            return wfn->rank_index(i).first;
+        }
+
+        inline std::size_t operator()(const DetKey &key) const {
+            return key.rank.first;
+        }
+
+        inline std::size_t operator()(const Hash &rank) const {
+            return rank.first;
+        }
+    };
+
+    struct IndexEq {
+        using is_transparent = void;
+
+        const Wfn *wfn;
+
+        explicit IndexEq(const Wfn *w = nullptr) : wfn(w) {
+        }
+
+        inline bool operator()(const long i, const long j) const {
+            return (i == j) || std::equal(wfn->index_ptr(i), wfn->index_ptr(i + 1), wfn->index_ptr(j));
+        }
+
+        inline bool operator()(const long i, const DetKey &key) const {
+            return std::equal(wfn->index_ptr(i), wfn->index_ptr(i + 1), key.det);
+        }
+
+        inline bool operator()(const DetKey &key, const long i) const {
+            return operator()(i, key);
+        }
+
+        inline bool operator()(const long i, const Hash &rank) const {
+            return wfn->rank_index(i) == rank;
+        }
+
+        inline bool operator()(const Hash &rank, const long i) const {
+            return operator()(i, rank);
+        }
+    };
+
+    using DetIndex = phmap::flat_hash_set<long, IndexHash, IndexEq>;
+
+    long nspin;
     AlignedVector<ulong> dets;
-    HashMap<Hash, long> dict;
+    DetIndex dict;
+    Vector<ulong> filter;
+    long nfilter, filter_off;
+    AlignedVector<long> binoms;
+    AlignedVector<ulong> ref;
+    AlignedVector<long> refpos, offsets;
+    Vector<Hash> zkeys;
 
 public:
     Wfn(const Wfn &);
 
-    Wfn(Wfn &&) noexcept;
+    Wfn(Wfn &&);
 
     Wfn(const long, const long, const long);
 
@@ -323,10 +634,52 @@ public:
 
     void squeeze(void);
 
+    Hash excite_rank(Hash, const long, const long) const;
+
+    void set_bloom(const bool);
+
 protected:
     Wfn(void);
 
     void init(const long, const long, const long);
+
+    void set_binoms(void);
+
+    void set_complete(void);
+
+    void set_addressed(const ulong *, const long, const long);
+
+    long rank_complete(const long, const ulong *) const;
+
+    long rank_excited(const long, const long, const ulong *, long &) const;
+
+    long nexcited(const long, const long) const;
+
+    void set_zkeys(void);
+
+    Hash rank_zobrist(const long, const ulong *) const;
+
+    const ulong *index_ptr(const long i) const {
+        return dets.data() + i * nspin * nword;
+    }
+
+    Hash rank_index(const long) const;
+
+    void clear_index(void);
+
+    void hash_dets(void);
+
+    long find_det(const ulong *, const Hash) const;
+
+    void fill_filter(void);
+
+    void add_filter(const Hash);
+
+    long filter_pos(const Hash &rank) const {
+        return filter_off + (rank.second & (nfilter - 1)) * 8;
+    }
+
+    bool test_filter(const Hash) const;
 };
 
 struct OneSpinWfn : public Wfn {
@@ -348,10 +701,12 @@ protected:
     using Wfn::dets;
     using Wfn::dict;
 
+    long insert_det(const ulong *, const Hash);
+
 public:
     OneSpinWfn(const OneSpinWfn &);
 
-    OneSpinWfn(OneSpinWfn &&) noexcept;
+    OneSpinWfn(OneSpinWfn &&);
 
     OneSpinWfn(const std::string &);
 
@@ -375,8 +730,16 @@ public:
 
     long index_det(const ulong *) const;
 
+    long index_det(const ulong *, Hash &) const;
+
+    long index_excited(const ulong *, const Hash) const;
+
     long index_det_from_rank(const Hash) const;
 
+    long index_det_with_rank(const ulong *, const Hash) const;
+
+    Hash prefetch_det(const ulong *, const Hash) const;
+
     void copy_det(const long, ulong *) const;
 
     Hash rank_det(const ulong *) const;
@@ -397,6 +760,8 @@ public:
 
     void reserve(const long);
 
+    void set_zobrist(const bool);
+
     Array<ulong> py_getitem(const long) const;
 
     Array<ulong> py_to_det_array(long, long) const;
@@ -433,10 +798,12 @@ protected:
     using Wfn::dets;
     using Wfn::dict;
 
+    long insert_det(const ulong *, const Hash);
+
 public:
     TwoSpinWfn(const TwoSpinWfn &);
 
-    TwoSpinWfn(TwoSpinWfn &&) noexcept;
+    TwoSpinWfn(TwoSpinWfn &&);
 
     TwoSpinWfn(const std::string &);
 
@@ -460,8 +827,16 @@ public:
 
     long index_det(const ulong *) const;
 
+    long index_det(const ulong *, Hash &) const;
+
+    long index_excited(const ulong *, const Hash) const;
+
     long index_det_from_rank(const Hash) const;
 
+    long index_det_with_rank(const ulong *, const Hash) const;
+
+    Hash prefetch_det(const ulong *, const Hash) const;
+
     void copy_det(const long, ulong *) const;
 
     Hash rank_det(const ulong *) const;
@@ -482,6 +857,8 @@ public:
 
     void reserve(const long);
 
+    void set_zobrist(const bool);
+
     Array<ulong> py_getitem(const long) const;
 
     Array<ulong> py_to_det_array(long, long) const;
@@ -521,7 +898,7 @@ protected:
 public:
     DOCIWfn(const DOCIWfn &);
 
-    DOCIWfn(DOCIWfn &&) noexcept;
+    DOCIWfn(DOCIWfn &&);
 
     DOCIWfn(const std::string &);
 
@@ -558,7 +935,7 @@ protected:
 public:
     FullCIWfn(const FullCIWfn &);
 
-    FullCIWfn(FullCIWfn &&) noexcept;
+    FullCIWfn(FullCIWfn &&);
 
     FullCIWfn(const DOCIWfn &);
 
@@ -597,7 +974,7 @@ protected:
 public:
     GenCIWfn(const GenCIWfn &);
 
-    GenCIWfn(GenCIWfn &&) noexcept;
+    GenCIWfn(GenCIWfn &&);
 
     GenCIWfn(const DOCIWfn &);
 
@@ -616,24 +993,146 @@ public:
     GenCIWfn(const long, const long, const long, const Array<long>);
 };
 
+/* A batch of excited determinants to be looked up in a wave function. The hash index bucket of
+ * each determinant is prefetched as it is pushed, and the lookups are resolved together once the
+ * batch is full or when the caller resolves it, so that their cache misses overlap instead of
+ * stalling the excitation loop one at a time. Wave functions that are indexed directly (complete
+ * or addressed) are looked up as the determinants are pushed.
+ *
+ * push takes a determinant, its Zobrist rank from excite_rank (unused otherwise), and an item that
+ * is passed back to fn(jdet, det, rank, item). The rank passed back is the full rank of det if det
+ * is not found and ranked is set, e.g. to add det to another wave function. The batch is kept in
+ * the thread's scratch, so a thread holds one batch at a time. */
+
+template<class WfnType, class Item>
+class DetBatch final {
+private:
+    const WfnType &wfn;
+    bool ranked, batched;
+    long stride, nbatch;
+    ulong *dets;
+    Hash ranks[PYCI_BATCH_SIZE];
+    Item items[PYCI_BATCH_SIZE];
+
+public:
+    explicit DetBatch(const WfnType &w, const bool r = false)
+        : wfn(w), ranked(r), batched(!(w.complete || w.addressed)),
+          stride(std::is_base_of<TwoSpinWfn, WfnType>::value ? w.nword2 : w.nword), nbatch(0),
+          dets(thread_scratch<ulong, 1>(batched ? PYCI_BATCH_SIZE * stride : 0)) {
+    }
+
+    template<class Fn>
+    inline void push(const ulong *det, Hash rank, const Item &item, Fn &&fn) {
+        if (!batched) {
+            fn(ranked ? wfn.index_det(det, rank) : wfn.index_excited(det, rank), det, rank, item);
+            return;
+        }
+        std::memcpy(&dets[nbatch * stride], det, sizeof(ulong) * stride);
+        ranks[nbatch] = wfn.prefetch_det(det, rank);
+        items[nbatch] = item;
+        if (++nbatch == PYCI_BATCH_SIZE)
+            resolve(fn);
+    }
+
+    template<class Fn>
+    inline void resolve(Fn &&fn) {
+        for (long k = 0; k < nbatch; ++k)
+            fn(wfn.index_det_with_rank(&dets[k * stride], ranks[k]), &dets[k * stride], ranks[k],
+               items[k]);
+        nbatch = 0;
+    }
+};
+
+/* Matrix element sinks for SparseOp::add_row. */
+
+struct SparseOpCounter {
+    long nnz = 0;
+
+    inline void operator()(const double, const long) {
+        ++nnz;
+    }
+};
+
+template<class Index>
+struct SparseOpWriter {
+    double *data;
+    Index *indices;
+
+    inline void operator()(const double val, const long j) {
+        *data++ = val;
+        *indices++ = static_cast<Index>(j);
+    }
+};
+
+struct SparseOpDot {
+    const double *x;
+    double val = 0.0;
+
+    inline void operator()(const double elem, const long j) {
+        val += elem * x[j];
+    }
+};
+
+/* Generator of the rows of the Hamiltonian matrix of a wave function, restricted to columns
+ * j < ncol (and j < i if symmetric). It holds no Python objects, so it can be used from the
+ * worker threads, which run without the GIL. */
+
+struct SparseOpRows final {
+public:
+    long ncol;
+    bool symmetric;
+    const ConnectedDets *connected;
+
+    template<class WfnType, class Sink>
+    void add_row(const SQuantOp &, const WfnType &, const long, ulong *, long *, long *,
+                 long *, Sink &) const;
+
+private:
+    template<long NW, class Sink>
+    void add_row(const SQuantOp &, const DOCIWfn &, const long, ulong *, long *, long *,
+                 long *, Sink &) const;
+
+    template<long NW, class Sink>
+    void add_row(const SQuantOp &, const FullCIWfn &, const long, ulong *, long *, long *,
+                 long *, Sink &) const;
+
+    template<long NW, class Sink>
+    void add_row(const SQuantOp &, const GenCIWfn &, const long, ulong *, long *, long *,
+                 long *, Sink &) const;
+
+    template<long NW, class Sink>
+    void add_row_connected(const SQuantOp &, const FullCIWfn &, const long, long *, long *,
+                           Sink &) const;
+};
+
 /* Sparse matrix operator class. */
 
 struct SparseOp final {
 public:
     long nrow, ncol, size;
     double ecore;
-    bool symmetric;
+    bool symmetric, compact;
     pybind11::tuple shape;
 
 private:
     AlignedVector<double> data;
     AlignedVector<long> indices, indptr;
+    AlignedVector<std::int32_t> indices_32;
+    std::shared_ptr<void> mapping;
+    const double *mapped_data = nullptr;
+    const long *mapped_indptr = nullptr;
+    const void *mapped_indices = nullptr;
+    std::shared_ptr<int> scratch;
+    Vector<long> blocks;
+    std::shared_ptr<const ConnectedDets> connected;
 
 public:
     SparseOp(const SparseOp &);
 
     SparseOp(SparseOp &&) noexcept;
 
+    SparseOp(const std::string &);
+
     SparseOp(const long, const long, const bool);
 
     SparseOp(const SQuantOp &, const DOCIWfn &, const long, const long, const bool);
@@ -646,7 +1145,8 @@ public:
 
     const double *data_ptr(const long) const;
 
-    const long *indices_ptr(const long) const;
+    template<class Index>
+    const Index *indices_ptr(const long) const;
 
     const long *indptr_ptr(const long) const;
 
@@ -656,9 +1156,14 @@ public:
 
     void perform_op_symm(const double *, double *) const;
 
+    void perform_op_block(const long, const double *, double *) const;
+
     void solve_ci(const long, const double *, const long, const long, const double, double *,
                   double *) const;
 
+    void solve_davidson(const long, const double *, const long, const long, const long,
+                        const double, double *, double *) const;
+
     template<class WfnType>
     void update(const SQuantOp &, const WfnType &, const long, const long, const long);
 
@@ -666,30 +1171,173 @@ public:
 
     void squeeze(void);
 
+    void to_file(const std::string &) const;
+
     Array<double> py_matvec(const Array<double>) const;
 
     Array<double> py_matvec_out(const Array<double>, Array<double>) const;
 
+    Array<double> py_matmat(const Array<double>) const;
+
+    Array<double> py_matmat_out(const Array<double>, Array<double>) const;
+
     pybind11::tuple py_solve_ci(const long, pybind11::object, const long, const long,
-                                const double) const;
+                                const double, const std::string &) const;
 
     template<class WfnType>
-    void py_update(const SQuantOp &, const WfnType &);
+    void py_update(const SQuantOp &, const WfnType &, const long);
 
     Array<double> py_data() const;
 
-    Array<long> py_indices() const;
+    pybind11::array py_indices() const;
 
     Array<long> py_indptr() const;
 
 private:
-    void sort_row(const long);
+    long matvec_threads(void) const;
+
+    void unmap(void);
+
+    template<class Index>
+    void perform_op_csr(const Index *, const bool, const long, const double *, double *) const;
+
+    template<class Index>
+    void perform_op_stream(const bool, const long, const double *, double *) const;
 
-    void add_row(const SQuantOp &, const DOCIWfn &, const long, ulong *, long *, long *);
+    template<class Index>
+    void read_scratch(const long, const long, double *, Index *) const;
 
-    void add_row(const SQuantOp &, const FullCIWfn &, const long, ulong *, long *, long *);
+    template<class Index>
+    void write_scratch(const long, const long, const double *, const Index *) const;
 
-    void add_row(const SQuantOp &, const GenCIWfn &, const long, ulong *, long *, long *);
+    template<class WfnType, class Index>
+    void stream_rows(const SQuantOp &, const WfnType &, const long);
+
+    template<class WfnType>
+    void count_rows(const SQuantOp &, const WfnType &, const long, const long);
+
+    template<class WfnType, class Index>
+    void fill_block(const SQuantOp &, const WfnType &, const long, const long, double *, Index *);
+
+    template<class WfnType, class Index>
+    void fill_rows(const SQuantOp &, const WfnType &, const long, const long, double *, Index *);
+
+    void connect_dets(const Wfn &);
+
+    void connect_dets(const FullCIWfn &);
+
+    template<class WfnType>
+    void extend_columns(const SQuantOp &, const WfnType &, const long, const long);
+
+    template<class WfnType>
+    void collect_columns(const SQuantOp &, const WfnType &, const long, const long, const long,
+                         Vector<long> &, Vector<long> &, Vector<double> &) const;
+
+    SparseOpRows row_generator(const long) const;
+};
+
+template<>
+const long *SparseOp::indices_ptr(const long) const;
+
+template<>
+const std::int32_t *SparseOp::indices_ptr(const long) const;
+
+/* Connected determinant enumerator for selected FullCI spaces. */
+
+struct ConnectedDets final {
+public:
+    long nstr_up, nstr_dn;
+    double cost;
+    bool sparse;
+
+private:
+    // alpha/beta string of each determinant, the determinants having each string, and the
+    // strings of the same spin that are connected to each string by a single replacement
+    AlignedVector<long> str_up, str_dn;
+    AlignedVector<long> dets_ptr[2], dets[2];
+    AlignedVector<long> single_ptr[2], single[2];
+
+public:
+    ConnectedDets(const FullCIWfn &);
+
+    void fill_connected(const FullCIWfn &, const long, Vector<long> &) const;
+
+private:
+    long add_strings(const FullCIWfn &, const long, AlignedVector<long> &);
+
+    void add_singles(const FullCIWfn &, const long);
+};
+
+/* Alpha/beta string-driven sigma vector class for complete FullCI spaces. */
+
+struct StringSigma final {
+public:
+    long nbasis, nstr_up, nstr_dn;
+
+private:
+    // per spin (up, down): single replacement lists and same-spin Hamiltonian of the strings
+    AlignedVector<long> rep_ptr[2], rep_str[2], rep_pair[2];
+    AlignedVector<double> rep_sign[2];
+    AlignedVector<long> ham_ptr[2], ham_str[2];
+    AlignedVector<double> ham_val[2];
+    AlignedVector<double> integrals;
+    AlignedVector<long> address;
+
+public:
+    StringSigma(const SQuantOp &, const FullCIWfn &);
+
+    static bool is_complete(const FullCIWfn &);
+
+    void perform_op(const double *, double *) const;
+
+private:
+    void add_strings(const SQuantOp &, const long, const long);
+
+    void perform_op_thread(const double *, double *, const long, const long) const;
+};
+
+/* Matrix-free (direct) operator class. */
+
+struct DirectOp final {
+public:
+    long nrow, ncol;
+    double ecore;
+    pybind11::tuple shape;
+
+private:
+    const SQuantOp *ham;
+    const Wfn *wfn;
+    void (*op_thread)(const DirectOp &, const double *, double *, const long, const long);
+    std::shared_ptr<const StringSigma> sigma;
+    std::shared_ptr<const ConnectedDets> connected;
+
+public:
+    DirectOp(const DirectOp &);
+
+    DirectOp(const SQuantOp &, const DOCIWfn &, const long, const long);
+
+    DirectOp(const SQuantOp &, const FullCIWfn &, const long, const long);
+
+    DirectOp(const SQuantOp &, const GenCIWfn &, const long, const long);
+
+    pybind11::object dtype(void) const;
+
+    void perform_op(const double *, double *) const;
+
+    void solve_ci(const long, const double *, const long, const long, const double, double *,
+                  double *) const;
+
+    Array<double> py_matvec(const Array<double>) const;
+
+    Array<double> py_matvec_out(const Array<double>, Array<double>) const;
+
+    pybind11::tuple py_solve_ci(const long, pybind11::object, const long, const long,
+                                const double) const;
+
+private:
+    template<class WfnType>
+    static void perform_op_thread(const DirectOp &, const double *, double *, const long,
+                                  const long);
 };
 
 /* FanCI objective classes. */
@@ -49,7 +49,14 @@ m.attr("c_ulong") = py::dtype::of<ulong>();
 m.attr("c_double") = py::dtype::of<double>();
 
 char *env_threads = std::getenv("PYCI_NUM_THREADS");
-set_num_threads((env_threads == nullptr) ? g_number_threads : std::atol(env_threads));
+char *env_pin = std::getenv("PYCI_PIN_THREADS");
+set_num_threads((env_threads == nullptr) ? g_number_threads : std::atol(env_threads),
+                (env_pin == nullptr) ? g_pin_threads : std::atol(env_pin) != 0);
+
+char *env_scratch = std::getenv("PYCI_SCRATCH_DIR");
+char *env_incore = std::getenv("PYCI_INCORE_MAX");
+set_out_of_core((env_scratch == nullptr) ? g_scratch_dir : env_scratch,
+                (env_incore == nullptr) ? -1 : std::atol(env_incore));
 
 /*
 Section: Second quantized operator class
@@ -285,6 +292,51 @@ nvir_dn : int
 
 )""");
 
+wavefunction.def_readonly("complete", &Wfn::complete, R"""(
+Whether the wave function was filled with ``add_all_dets``.
+
+A complete wave function indexes its determinants by their colex rank instead of a hash table.
+
+Returns
+-------
+complete : bool
+    Whether the wave function is complete.
+
+)""");
+
+wavefunction.def_readonly("addressed", &Wfn::addressed, R"""(
+Whether the wave function was filled only with ``add_excited_dets`` from one reference.
+
+Such a wave function indexes its determinants by their excitation level and hole/particle ranks
+instead of a hash table. Adding any other determinant moves it to the hash table.
+
+Returns
+-------
+addressed : bool
+    Whether the wave function is indexed by excitation level.
+
+)""");
+
+wavefunction.def_readonly("zobrist", &Wfn::zobrist, R"""(
+Whether the wave function ranks its determinants with Zobrist hashing.
+
+Returns
+-------
+zobrist : bool
+    Whether Zobrist hashing is used.
+
+)""");
+
+wavefunction.def_readonly("bloom", &Wfn::bloom, R"""(
+Whether the wave function keeps a Bloom filter alongside its hash table.
+
+Returns
+-------
+bloom : bool
+    Whether the Bloom filter is used.
+
+)""");
+
 wavefunction.def("__len__", &Wfn::length, R"""(
 Return the number of determinants in the wave function.
 
@@ -295,6 +347,21 @@ ndet : int
 
 )""");
 
+wavefunction.def("set_bloom", &Wfn::set_bloom, R"""(
+Keep a blocked Bloom filter of the determinants alongside the hash table.
+
+Lookups of determinants that are not in the wave function, such as most excitations tried by
+``sparse_op``, ``add_hci`` and ``compute_enpt2``, are then mostly answered by one cache line of the
+filter instead of a probe of the hash table. The filter is kept in sync as determinants are added.
+
+Parameters
+----------
+bloom : bool
+    Whether to use the Bloom filter.
+
+)""",
+                 py::arg("bloom"));
+
 wavefunction.def("squeeze", &Wfn::squeeze, "Free any unused memory allocated to this object.");
 
 /*
@@ -397,7 +464,8 @@ index : int
 one_spin_wfn.def("index_det_from_rank", &OneSpinWfn::index_det_from_rank, R"""(
 Return the index of determinant with rank ``rank`` in the wave function.
 
-If the determinant is not in the wave function, this function returns -1.
+If the determinant is not in the wave function, this function returns -1. Complete and addressed
+wave functions are not indexed by hash rank and raise a RuntimeError.
 
 Parameters
 ----------
@@ -466,6 +534,8 @@ one_spin_wfn.def("add_hartreefock_det", &OneSpinWfn::add_hartreefock_det,
 one_spin_wfn.def("add_all_dets", &OneSpinWfn::add_all_dets, R"""(
 Add all determinants to the wave function.
 
+The determinants are indexed by their colex rank, without a hash table.
+
 Parameters
 ----------
 nthread : int
@@ -477,6 +547,9 @@ nthread : int
 one_spin_wfn.def("add_excited_dets", &OneSpinWfn::py_add_excited_dets, R"""(
 Add excited determinants to the wave function.
 
+Excitation blocks of a single reference added to an empty wave function are indexed directly (see
+``addressed``).
+
 Parameters
 ----------
 exc : int
@@ -509,6 +582,21 @@ n : int
 )""",
                  py::arg("n"));
 
+one_spin_wfn.def("set_zobrist", &OneSpinWfn::set_zobrist, R"""(
+Rank the determinants with Zobrist (per-orbital XOR) hashing.
+
+An excited determinant's rank is then updated from its parent's, instead of being recomputed, in
+the excitation loops of ``sparse_op``, ``add_hci`` and ``compute_enpt2``. Lookups are confirmed
+against the stored determinants.
+
+Parameters
+----------
+zobrist : bool
+    Whether to use Zobrist hashing.
+
+)""",
+                 py::arg("zobrist"));
+
 /*
 Section: Two-spin wavefunction class
 */
@@ -609,7 +697,8 @@ index : int
 two_spin_wfn.def("index_det_from_rank", &TwoSpinWfn::index_det_from_rank, R"""(
 Return the index of determinant with rank ``rank`` in the wave function.
 
-If the determinant is not in the wave function, this function returns -1.
+If the determinant is not in the wave function, this function returns -1. Complete and addressed
+wave functions are not indexed by hash rank and raise a RuntimeError.
 
 Parameters
 ----------
@@ -678,6 +767,8 @@ two_spin_wfn.def("add_hartreefock_det", &TwoSpinWfn::add_hartreefock_det,
 two_spin_wfn.def("add_all_dets", &TwoSpinWfn::add_all_dets, R"""(
 Add all determinants to the wave function.
 
+The determinants are indexed by their colex rank, without a hash table.
+
 Parameters
 ----------
 nthread : int
@@ -689,6 +780,9 @@ nthread : int
 two_spin_wfn.def("add_excited_dets", &TwoSpinWfn::py_add_excited_dets, R"""(
 Add excited determinants to the wave function.
 
+Excitation blocks of a single reference added to an empty wave function are indexed directly (see
+``addressed``).
+
 Parameters
 ----------
 exc : int
@@ -721,6 +815,21 @@ n : int
 )""",
                  py::arg("n"));
 
+two_spin_wfn.def("set_zobrist", &TwoSpinWfn::set_zobrist, R"""(
+Rank the determinants with Zobrist (per-orbital XOR) hashing.
+
+An excited determinant's rank is then updated from its parent's, instead of being recomputed, in
+the excitation loops of ``sparse_op``, ``add_hci`` and ``compute_enpt2``. Lookups are confirmed
+against the stored determinants.
+
+Parameters
+----------
+zobrist : bool
+    Whether to use Zobrist hashing.
+
+)""",
+                 py::arg("zobrist"));
+
 /*
 Section: DOCI wave function class
 */
@@ -907,6 +1016,16 @@ symmetric : bool
 
 )""");
 
+sparse_op.def_readonly("compact", &SparseOp::compact, R"""(
+Whether the column indices are stored as 32-bit integers.
+
+Returns
+-------
+compact : bool
+    Whether the column indices are stored as 32-bit integers.
+
+)""");
+
 sparse_op.def_readonly("size", &SparseOp::size, R"""(
 Number of non-zero matrix elements.
 
@@ -967,28 +1086,49 @@ sparse_op.def(py::init<const SQuantOp &, const GenCIWfn &, const long, const lon
               py::arg("ham"), py::arg("wfn"), py::arg("nrow") = -1, py::arg("ncol") = -1,
               py::arg("symmetric") = true);
 
+sparse_op.def(py::init<const std::string &>(), R"""(
+Load a sparse matrix operator from a binary file written by ``sparse_op.to_file``.
+
+The file is memory-mapped, so the operator's arrays are paged in from disk as they are used.
+
+Parameters
+----------
+filename : TextIO
+    Name of the file to load.
+
+)""",
+              py::arg("filename"));
+
 sparse_op.def("update", &SparseOp::py_update<DOCIWfn>, R"""(
 Update a sparse matrix operator for the HCI algorithm.
 
+Rows are added for the new determinants in ``wfn``, and, for non-symmetric operators, the
+existing rows are extended with their elements in the new columns. Only the rows of the new
+determinants are generated.
+
 Parameters
 ----------
 ham : pyci.secondquant_op
     Hamiltonian.
 wfn : pyci.wavefunction
     Wave function.
+nrow : int, optional
+    Number of rows after the update. Defaults to ``len(wfn)`` for square operators,
+    and to the current number of rows for rectangular operators.
 
 Notes
 -----
-The user is responsible for using the same ``ham`` and ``wfn``.
-This method doesn't work with rectangular operators. Those must
-be re-initialized from the wave function object.
+The user is responsible for using the same ``ham`` and ``wfn``, with determinants only
+appended to ``wfn`` since the operator was built.
 
 )""",
-              py::arg("ham"), py::arg("wfn"));
+              py::arg("ham"), py::arg("wfn"), py::arg("nrow") = -1);
 
-sparse_op.def("update", &SparseOp::py_update<FullCIWfn>, py::arg("ham"), py::arg("wfn"));
+sparse_op.def("update", &SparseOp::py_update<FullCIWfn>, py::arg("ham"), py::arg("wfn"),
+              py::arg("nrow") = -1);
 
-sparse_op.def("update", &SparseOp::py_update<GenCIWfn>, py::arg("ham"), py::arg("wfn"));
+sparse_op.def("update", &SparseOp::py_update<GenCIWfn>, py::arg("ham"), py::arg("wfn"),
+              py::arg("nrow") = -1);
 
 sparse_op.def("__call__", &SparseOp::py_matvec, R"""(
 Compute the matrix vector product of the sparse matrix operator with vector ``x``.
@@ -1038,6 +1178,33 @@ y : numpy.ndarray
 
 sparse_op.def("matvec", &SparseOp::py_matvec_out, py::arg("x"), py::arg("out"));
 
+sparse_op.def("matmat", &SparseOp::py_matmat, R"""(
+Compute the matrix product of the sparse matrix operator with a block of vectors ``x``.
+
+.. math::
+
+    A \mathbf{X} = \mathbf{Y}
+
+All of the vectors are multiplied in a single pass over the operator.
+
+Parameters
+----------
+x : numpy.ndarray
+    Array of shape ``(ncol, k)`` whose columns are the vectors to which the operator will be applied.
+out : numpy.ndarray, default=None
+    Array of shape ``(nrow, k)`` in which to store the result. One will be created if this is not
+    specified.
+
+Returns
+-------
+y : numpy.ndarray
+    Result array of shape ``(nrow, k)``.
+
+)""",
+              py::arg("x"));
+
+sparse_op.def("matmat", &SparseOp::py_matmat_out, py::arg("x"), py::arg("out"));
+
 sparse_op.def("get_element", &SparseOp::get_element, R"""(
 Return the :math:`\left(i, j\right)`-th element of the sparse matrix operator.
 )""",
@@ -1051,13 +1218,18 @@ Parameters
 n : int, default=1
     Number of lowest eigenpairs to find.
 c0 : np.ndarray, default=[1,0,...,0]
-    Initial guess for lowest eigenvector.
+    Initial guess for lowest eigenvector. With ``method="davidson"``, this can also be an array
+    of shape ``(k, nrow)`` holding initial guesses for the ``k`` lowest eigenvectors.
 ncv : int, default=min(nrow, max(2 * n + 1, 20))
-    Number of Lanczos vectors to use.
+    Number of Lanczos vectors to use, or maximum size of the Davidson subspace.
 maxiter : int, default=nrow * n * 10
     Maximum number of iterations to perform.
 tol : float, default=1.0e-12
-    Convergence tolerance.
+    Convergence tolerance. The Davidson solver converges when the change in each eigenvalue is
+    below ``tol`` and each residual norm is below ``sqrt(tol)``.
+method : ('lanczos' | 'davidson'), default='lanczos'
+    Eigensolver to use: implicitly restarted Lanczos, or block Davidson-Liu with
+    diagonal preconditioning.
 
 Returns
 -------
@@ -1068,7 +1240,7 @@ cs : np.ndarray
 
 )""",
               py::arg("n") = 1, py::arg("c0") = py::none(), py::arg("ncv") = -1,
-              py::arg("maxiter") = -1, py::arg("tol") = 1.0e-12);
+              py::arg("maxiter") = -1, py::arg("tol") = 1.0e-12, py::arg("method") = "lanczos");
 
 sparse_op.def("reserve", &SparseOp::reserve, R"""(
 Reserve space in memory for ``n`` nonzero elements in the sparse matrix operator.
@@ -1083,10 +1255,176 @@ n : int
 
 sparse_op.def("squeeze", &SparseOp::squeeze, "Free any unused memory allocated to this object.");
 
+sparse_op.def("to_file", &SparseOp::to_file, R"""(
+Write the sparse matrix operator to a binary file.
+
+Parameters
+----------
+filename : TextIO
+    Name of the file to write.
+
+)""",
+              py::arg("filename"));
+
 sparse_op.def("data", &SparseOp::py_data, "Return CSR matrix data vector", py::keep_alive<0, 1>());
 sparse_op.def("indices", &SparseOp::py_indices, "Return CSR matrix indices vector", py::keep_alive<0, 1>());
 sparse_op.def("indptr", &SparseOp::py_indptr, "Return CSR matrix index pointer vector", py::keep_alive<0, 1>());
 
+/*
+Section: Matrix-free CI matrix operator class
+*/
+
+py::class_<DirectOp> direct_op(m, "direct_op");
+
+direct_op.doc() = R"""(
+Matrix-free (direct) matrix operator class.
+
+The matrix elements are recomputed from the Hamiltonian and wave function each time the operator
+is applied, instead of being stored as in :class:`pyci.sparse_op`. For a complete FullCI
+wave function (filled with ``add_all_dets``), the operator is applied with alpha/beta string
+replacement lists instead, without looking up any determinants. For a sparse selected FullCI
+wave function, each row visits only the determinants connected to it through its alpha and beta
+strings.
+)""";
+
+direct_op.def_readonly("ecore", &DirectOp::ecore, R"""(
+Constant (or "zero-particle") integral.
+
+Returns
+-------
+ecore : float
+    Constant (or "zero-particle") integral.
+
+)""");
+
+direct_op.def_readonly("shape", &DirectOp::shape, R"""(
+Shape of the matrix.
+
+Returns
+-------
+nrow : int
+    Number of rows.
+ncol : int
+    Number of columns.
+
+)""");
+
+direct_op.def_property_readonly("dtype", &DirectOp::dtype, R"""(
+Data type of matrix.
+
+Returns
+-------
+dtype : numpy.dtype
+    Data type of matrix.
+
+)""");
+
+direct_op.def(py::init<const SQuantOp &, const DOCIWfn &, const long, const long>(), R"""(
+Initialize a matrix-free matrix operator.
+
+Parameters
+----------
+ham : pyci.secondquant_op
+    Hamiltonian.
+wfn : pyci.wavefunction
+    Wave function.
+nrow : int, default=len(wfn)
+    Number of rows in matrix, using the first ``nrow`` determinants in ``wfn``.
+ncol : int, default=len(wfn)
+    Number of columns in matrix, using the first ``ncol`` determinants in ``wfn``.
+
+Notes
+-----
+The operator keeps references to ``ham`` and ``wfn``, which must not be modified while it is
+in use.
+
+)""",
+              py::arg("ham"), py::arg("wfn"), py::arg("nrow") = -1, py::arg("ncol") = -1,
+              py::keep_alive<1, 2>(), py::keep_alive<1, 3>());
+
+direct_op.def(py::init<const SQuantOp &, const FullCIWfn &, const long, const long>(),
+              py::arg("ham"), py::arg("wfn"), py::arg("nrow") = -1, py::arg("ncol") = -1,
+              py::keep_alive<1, 2>(), py::keep_alive<1, 3>());
+
+direct_op.def(py::init<const SQuantOp &, const GenCIWfn &, const long, const long>(),
+              py::arg("ham"), py::arg("wfn"), py::arg("nrow") = -1, py::arg("ncol") = -1,
+              py::keep_alive<1, 2>(), py::keep_alive<1, 3>());
+
+direct_op.def("__call__", &DirectOp::py_matvec, R"""(
+Compute the matrix vector product of the matrix-free operator with vector ``x``.
+
+.. math::
+
+    A \mathbf{x} = \mathbf{y}
+
+Parameters
+----------
+x : numpy.ndarray
+    Vector to which the operator will be applied.
+out : numpy.ndarray, default=None
+    Array in which to store the result. One will be created if this is not specified.
+
+Returns
+-------
+y : numpy.ndarray
+    Result vector.
+
+)""",
+              py::arg("x"));
+
+direct_op.def("__call__", &DirectOp::py_matvec_out, py::arg("x"), py::arg("out"));
+
+direct_op.def("matvec", &DirectOp::py_matvec, R"""(
+Compute the matrix vector product of the matrix-free operator with vector ``x``.
+
+.. math::
+
+    A \mathbf{x} = \mathbf{y}
+
+Parameters
+----------
+x : numpy.ndarray
+    Vector to which the operator will be applied.
+out : numpy.ndarray, default=None
+    Array in which to store the result. One will be created if this is not specified.
+
+Returns
+-------
+y : numpy.ndarray
+    Result vector.
+
+)""",
+              py::arg("x"));
+
+direct_op.def("matvec", &DirectOp::py_matvec_out, py::arg("x"), py::arg("out"));
+
+direct_op.def("solve", &DirectOp::py_solve_ci, R"""(
+Solve a CI eigenproblem.
+
+Parameters
+----------
+n : int, default=1
+    Number of lowest eigenpairs to find.
+c0 : np.ndarray, default=[1,0,...,0]
+    Initial guess for lowest eigenvector.
+ncv : int, default=min(nrow, max(2 * n + 1, 20))
+    Number of Lanczos vectors to use.
+maxiter : int, default=nrow * n * 10
+    Maximum number of iterations to perform.
+tol : float, default=1.0e-12
+    Convergence tolerance.
+
+Returns
+-------
+es : np.ndarray
+    Energies.
+cs : np.ndarray
+    Coefficient vectors.
+
+)""",
+              py::arg("n") = 1, py::arg("c0") = py::none(), py::arg("ncv") = -1,
+              py::arg("maxiter") = -1, py::arg("tol") = 1.0e-12);
+
 /*
 Section: Free functions
 */
@@ -1104,13 +1442,54 @@ nthread : int
 m.def("set_num_threads", &set_num_threads, R"""(
 Set the default number of threads to use.
 
+The threads are kept in a pool that runs the parallel routines, and are started here.
+
 Parameters
 ----------
 nthread : int
     Number of threads.
+pin : bool, default=False
+    Whether to pin each thread of the pool to its own CPU.
+
+)""",
+      py::arg("n"), py::arg("pin") = false);
+
+m.def("get_busy_times", &py_get_busy_times, R"""(
+Return the time spent by each thread in dynamically scheduled loops.
+
+The determinant loops of add_hci, compute_enpt2, compute_overlap, compute_rdms, and of building
+and applying sparse and direct operators are cut into small chunks that the threads share out
+among themselves. The time each thread spends running chunks is summed over these loops since the
+last call to reset_busy_times; uneven times show a load imbalance.
+
+Returns
+-------
+times : numpy.ndarray
+    Busy time of each thread, in seconds.
+
+)""");
+
+m.def("reset_busy_times", &reset_busy_times, R"""(
+Reset the time spent by each thread in dynamically scheduled loops.
+
+)""");
+
+m.def("set_out_of_core", &set_out_of_core, R"""(
+Set the scratch directory and memory limit for out-of-core sparse matrix operators.
+
+Sparse matrix operators with more than ``maxsize`` nonzero elements are built in blocks of rows
+that are written to a scratch file in ``scratch``, and their matrix-vector products stream the
+blocks back from that file. At most ``maxsize`` elements are held in memory at a time.
+
+Parameters
+----------
+scratch : str
+    Scratch directory. If empty, sparse matrix operators are always held in memory.
+maxsize : int, default=-1
+    Maximum number of nonzero elements of an in-memory operator. If -1, there is no limit.
 
 )""",
-      py::arg("n"));
+      py::arg("scratch"), py::arg("maxsize") = -1);
 
 m.def("popcnt", &py_popcnt, R"""(
 Return the number of bits set to 1 in a determinant array.
@@ -1344,6 +1723,9 @@ m.def("compute_transition_rdms", &py_compute_transition_rdms_genci,
 m.def("compute_enpt2", &py_compute_enpt2<DOCIWfn>, R"""(
 Compute the second-order multi-reference Epstein-Nesbet (ENPT2) energy for a wave function.
 
+The return type depends on ``mode``: the deterministic mode returns the energy as a float, and the
+semistochastic mode returns a tuple ``(pt_energy, pt_error)``.
+
 Parameters
 ----------
 ham : pyci.secondquant_op
@@ -1358,21 +1740,47 @@ eps : float, default=1.0e-5
     :math:`\epsilon` value for ENPT2 routine.
 nthread : int
     Number of threads to use.
+npart : int, default=1
+    Number of parts into which the external determinants are partitioned by hash. Each part is
+    summed in a separate pass over the wave function, so the memory held for the external
+    determinants is about 1 / npart of that of a single pass, at npart times the cost.
+mode : ('deterministic' | 'semistochastic'), default='deterministic'
+    Whether to sum the correction deterministically, or to sum the terms larger than eps_det
+    deterministically and estimate the rest from nsamples samples of ndraw determinants drawn
+    with probabilities proportional to :math:`|c_i|` (Sharma et al., 2017).
+eps_det : float, default=1.0e-4
+    :math:`\epsilon` value for the deterministic part of the semistochastic ENPT2 routine.
+nsamples : int, default=32
+    Number of samples for the stochastic part.
+ndraw : int, default=200
+    Number of determinants drawn with replacement in each sample.
+seed : int, default=0
+    Seed of the random streams. Sample k is drawn from a stream seeded by (seed, k), so the
+    result does not depend on the number of threads.
 
 Returns
 -------
 pt_energy : float
-    ENPT2 energy.
+    ENPT2 energy. If mode is 'deterministic', this float is the only return value.
+pt_error : float
+    Standard error of the semistochastic ENPT2 energy. Only returned, as the second element of a
+    tuple ``(pt_energy, pt_error)``, if mode is 'semistochastic'.
 
 )""",
       py::arg("ham"), py::arg("wfn"), py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-5,
-      py::arg("nthread") = -1);
+      py::arg("nthread") = -1, py::arg("npart") = 1, py::arg("mode") = "deterministic",
+      py::arg("eps_det") = 1.0e-4, py::arg("nsamples") = 32, py::arg("ndraw") = 200,
+      py::arg("seed") = 0);
 
 m.def("compute_enpt2", &py_compute_enpt2<FullCIWfn>, py::arg("ham"), py::arg("wfn"),
-      py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-5, py::arg("nthread") = -1);
+      py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-5, py::arg("nthread") = -1,
+      py::arg("npart") = 1, py::arg("mode") = "deterministic", py::arg("eps_det") = 1.0e-4,
+      py::arg("nsamples") = 32, py::arg("ndraw") = 200, py::arg("seed") = 0);
 
 m.def("compute_enpt2", &py_compute_enpt2<GenCIWfn>, py::arg("ham"), py::arg("wfn"),
-      py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-5, py::arg("nthread") = -1);
+      py::arg("coeffs"), py::arg("energy"), py::arg("eps") = 1.0e-5, py::arg("nthread") = -1,
+      py::arg("npart") = 1, py::arg("mode") = "deterministic", py::arg("eps_det") = 1.0e-4,
+      py::arg("nsamples") = 32, py::arg("ndraw") = 200, py::arg("seed") = 0);
 
 /*
 Section: FanCI classes
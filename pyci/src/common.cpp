@@ -15,27 +15,274 @@
 
 #include <pyci.h>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 namespace pyci {
 
 namespace {
 
 long gcd(long, long);
 
+/* Persistent pool of the worker threads that run the tasks of parallel_run. A job's tasks are
+ * claimed one at a time by the workers and by the thread that submitted it, which waits for the
+ * last of them; the workers take tasks from the newest job, so a task may itself submit a job. */
+
+class WorkerPool final {
+public:
+    void resize(const long nworker, const bool pin) {
+        if (pid != getpid()) {
+            // the workers of a parent process do not exist in a forked child, so their handles
+            // are leaked rather than joined
+            if (!workers.empty())
+                static_cast<void>(new Vector<std::thread>(std::move(workers)));
+            jobs.clear();
+            pid = getpid();
+        } else if (nworker == static_cast<long>(workers.size()) && pin == pinned) {
+            return;
+        }
+        stop_workers();
+        pinned = pin;
+        for (long i = 0; i < nworker; ++i) {
+            workers.emplace_back(&WorkerPool::work, this);
+            if (pin)
+                pin_worker(workers.back(), i + 1);
+        }
+    }
+
+    void run(const long ntask, const std::function<void(long)> &task) {
+        resize(g_number_threads - 1, g_pin_threads);
+        if (ntask < 2 || workers.empty()) {
+            for (long i = 0; i < ntask; ++i)
+                task(i);
+            return;
+        }
+        Job job(task, ntask);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(&job);
+        }
+        wake.notify_all();
+        long i;
+        while ((i = job.next++) < ntask)
+            execute(job, i);
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = std::find(jobs.begin(), jobs.end(), &job);
+        if (it != jobs.end())
+            jobs.erase(it);
+        finished.wait(lock, [&job] { return job.ndone == job.ntask; });
+        if (job.error)
+            std::rethrow_exception(job.error);
+    }
+
+private:
+    struct Job {
+        const std::function<void(long)> &task;
+        const long ntask;
+        std::atomic<long> next;
+        long ndone;
+        std::exception_ptr error;
+
+        Job(const std::function<void(long)> &fn, const long n)
+            : task(fn), ntask(n), next(0), ndone(0) {
+        }
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake, finished;
+    Vector<std::thread> workers;
+    Vector<Job *> jobs;
+    bool stop = false, pinned = false;
+    pid_t pid = 0;
+
+    void execute(Job &job, const long i) {
+        std::exception_ptr error;
+        try {
+            job.task(i);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error && !job.error)
+            job.error = error;
+        if (++job.ndone == job.ntask)
+            finished.notify_all();
+    }
+
+    void work(void) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stop || !jobs.empty(); });
+            if (stop)
+                return;
+            Job &job = *jobs.back();
+            long i = job.next++;
+            if (i >= job.ntask) {
+                // every task of the job is claimed
+                jobs.erase(std::find(jobs.begin(), jobs.end(), &job));
+                continue;
+            }
+            lock.unlock();
+            execute(job, i);
+            lock.lock();
+        }
+    }
+
+    void stop_workers(void) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+        workers.clear();
+        stop = false;
+    }
+
+    static void pin_worker(std::thread &worker, const long cpu) {
+#ifdef __linux__
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu % std::max(std::thread::hardware_concurrency(), 1U), &cpus);
+        pthread_setaffinity_np(worker.native_handle(), sizeof(cpu_set_t), &cpus);
+#else
+        (void)worker;
+        (void)cpu;
+#endif
+    }
+};
+
+WorkerPool &worker_pool(void) {
+    // never destroyed, so that no worker is joined during static destruction
+    static WorkerPool *pool = new WorkerPool;
+    return *pool;
+}
+
+/* Chunks [lo, hi) left to a slot of parallel_for. The slot takes them from the front, and thieves
+ * take them from the back. */
+
+struct ChunkQueue {
+    std::mutex mutex;
+    long lo, hi;
+
+    long pop(void) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return (lo < hi) ? lo++ : -1;
+    }
+};
+
+long steal_chunk(ChunkQueue *queues, const long nslot, const long slot) {
+    for (long k = 1; k < nslot; ++k) {
+        ChunkQueue &victim = queues[(slot + k) % nslot];
+        long lo, hi;
+        {
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.lo == victim.hi)
+                continue;
+            hi = victim.hi;
+            lo = hi - (hi - victim.lo + 1) / 2;
+            victim.hi = lo;
+        }
+        // run the first stolen chunk now and queue the rest; the slot's own queue is empty
+        std::lock_guard<std::mutex> lock(queues[slot].mutex);
+        queues[slot].lo = lo + 1;
+        queues[slot].hi = hi;
+        return lo;
+    }
+    return -1;
+}
+
+std::mutex busy_mutex;
+
+Vector<double> busy_times;
+
+void add_busy_times(const Vector<double> &times) {
+    std::lock_guard<std::mutex> lock(busy_mutex);
+    if (busy_times.size() < times.size())
+        busy_times.resize(times.size(), 0.0);
+    for (std::size_t i = 0; i < times.size(); ++i)
+        busy_times[i] += times[i];
+}
+
+double seconds_since(const std::chrono::steady_clock::time_point &start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
+} // namespace
+
 long g_number_threads{1L};
 
+bool g_pin_threads{false};
+
 long get_num_threads(void) {
     return g_number_threads;
 }
 
 long end_chunk_idx(const long thread_idx, const long num_threads, const long sideLength) {
-    return ceil(sqrt(thread_idx / num_threads) * sideLength);
+    // even partition; the product is taken in floating point so that it cannot overflow
+    if (thread_idx >= num_threads)
+        return sideLength;
+    return static_cast<long>(static_cast<double>(sideLength) * thread_idx / num_threads);
 }
 
-void set_num_threads(const long n) {
+void set_num_threads(const long n, const bool pin) {
     g_number_threads = std::max(n, 1L);
+    g_pin_threads = pin;
     Eigen::setNbThreads(g_number_threads);
+    // the calling thread runs tasks too, so the pool has one worker fewer than threads
+    worker_pool().resize(g_number_threads - 1, g_pin_threads);
+}
+
+void parallel_run(const long ntask, const std::function<void(long)> &task) {
+    worker_pool().run(ntask, task);
+}
+
+void parallel_for(const long nslot, const long n, const long chunksize,
+                  const std::function<void(long, long, long)> &fn) {
+    long nchunk = n / chunksize + static_cast<bool>(n % chunksize);
+    Vector<double> times(std::max(std::min(nslot, nchunk), 1L), 0.0);
+    long nrun = times.size();
+    if (nrun == 1) {
+        auto start = std::chrono::steady_clock::now();
+        fn(0, 0, n);
+        times[0] = seconds_since(start);
+        return add_busy_times(times);
+    }
+    std::unique_ptr<ChunkQueue[]> queues(new ChunkQueue[nrun]);
+    for (long i = 0; i < nrun; ++i) {
+        queues[i].lo = nchunk * i / nrun;
+        queues[i].hi = nchunk * (i + 1) / nrun;
+    }
+    parallel_run(nrun, [&](const long slot) {
+        auto start = std::chrono::steady_clock::now();
+        long c;
+        while ((c = queues[slot].pop()) != -1 || (c = steal_chunk(&queues[0], nrun, slot)) != -1)
+            fn(slot, c * chunksize, std::min((c + 1) * chunksize, n));
+        times[slot] = seconds_since(start);
+    });
+    add_busy_times(times);
+}
+
+Vector<double> get_busy_times(void) {
+    std::lock_guard<std::mutex> lock(busy_mutex);
+    return busy_times;
+}
+
+void reset_busy_times(void) {
+    std::lock_guard<std::mutex> lock(busy_mutex);
+    busy_times.clear();
+}
+
+std::string g_scratch_dir{};
+
+long g_incore_max{Max<long>()};
+
+void set_out_of_core(const std::string &dir, const long n) {
+    g_scratch_dir = dir;
+    g_incore_max = (n > -1) ? n : Max<long>();
 }
 
 long binomial(long n, long k) {
@@ -83,33 +330,11 @@ void fill_det(const long nocc, const long *occs, ulong *det) {
 }
 
 void fill_occs(const long nword, const ulong *det, long *occs) {
-    long p, j = 0, offset = 0;
-    ulong word;
-    for (long i = 0; i < nword; ++i) {
-        word = det[i];
-        while (word) {
-            p = Ctz(word);
-            occs[j++] = p + offset;
-            word &= ~(1UL << p);
-        }
-        offset += Size<ulong>();
-    }
+    fill_occs<0>(nword, det, occs);
 }
 
 void fill_virs(const long nword, long nbasis, const ulong *det, long *virs) {
-    long p, j = 0, offset = 0;
-    ulong word, mask;
-    for (long i = 0; i < nword; ++i) {
-        mask = (nbasis < Size<ulong>()) ? ((1UL << nbasis) - 1) : Max<ulong>();
-        word = det[i] ^ mask;
-        while (word) {
-            p = Ctz(word);
-            virs[j++] = p + offset;
-            word &= ~(1UL << p);
-        }
-        offset += Size<ulong>();
-        nbasis -= Size<ulong>();
-    }
+    fill_virs<0>(nword, nbasis, det, virs);
 }
 
 void next_colex(long *indices) {
@@ -153,117 +378,16 @@ void unrank_colex(long nbasis, const long nocc, long rank, long *occs) {
 }
 
 long phase_single_det(const long nword, const long i, const long a, const ulong *det) {
-    (void)nword; // nword is deliberately unused.
-    long j, k, l, m, n, high, low, nperm = 0;
-    ulong mask;
-    if (i > a) {
-        high = i;
-        low = a;
-    } else {
-        high = a;
-        low = i;
-    }
-    k = high / Size<ulong>();
-    m = high % Size<ulong>();
-    j = low / Size<ulong>();
-    n = low % Size<ulong>();
-    mask = det[j];
-    mask &= Max<ulong>();
-    if (j == k) {
-        mask &= (1UL << m) - 1;
-        mask &= ~(1UL << (n + 1)) + 1;
-        nperm += Pop(mask);
-    } else {
-        mask &= ~(1UL << (n + 1)) + 1;
-        nperm += Pop(mask);
-        mask = det[k];
-        mask &= (1UL << m) - 1;
-        nperm += Pop(mask);
-        for (l = j + 1; l < k; ++l) {
-            mask = det[l];
-            mask &= Max<ulong>();
-            nperm += Pop(mask);
-        }
-    }
-    return (nperm % 2) ? -1 : 1;
+    return phase_single_det<0>(nword, i, a, det);
 }
 
 long phase_double_det(const long nword, const long i1, const long i2, const long a1, const long a2,
                       const ulong *det) {
-    (void)nword; // nword is deliberately unused.
-    long j, k, l, m, n, high, low, nperm = 0;
-    ulong mask;
-    // first excitation
-    if (i1 > a1) {
-        high = i1;
-        low = a1;
-    } else {
-        high = a1;
-        low = i1;
-    }
-    k = high / Size<ulong>();
-    m = high % Size<ulong>();
-    j = low / Size<ulong>();
-    n = low % Size<ulong>();
-    mask = det[j];
-    mask &= Max<ulong>();
-    if (j == k) {
-        mask &= (1UL << m) - 1;
-        mask &= ~(1UL << (n + 1)) + 1;
-        nperm += Pop(mask);
-    } else {
-        mask &= ~(1UL << (n + 1)) + 1;
-        nperm += Pop(mask);
-        mask = det[k];
-        mask &= (1UL << m) - 1;
-        nperm += Pop(mask);
-        for (l = j + 1; l < k; ++l) {
-            mask = det[l];
-            mask &= Max<ulong>();
-            nperm += Pop(mask);
-        }
-    }
-    // second excitation
-    if (i2 > a2) {
-        high = i2;
-        low = a2;
-    } else {
-        high = a2;
-        low = i2;
-    }
-    k = high / Size<ulong>();
-    m = high % Size<ulong>();
-    j = low / Size<ulong>();
-    n = low % Size<ulong>();
-    mask = det[j];
-    mask &= Max<ulong>();
-    if (j == k) {
-        mask &= (1UL << m) - 1;
-        mask &= ~(1UL << (n + 1)) + 1;
-        nperm += Pop(mask);
-    } else {
-        mask &= ~(1UL << (n + 1)) + 1;
-        nperm += Pop(mask);
-        mask = det[k];
-        mask &= (1UL << m) - 1;
-        nperm += Pop(mask);
-        for (l = j + 1; l < k; ++l) {
-            mask = det[l];
-            mask &= Max<ulong>();
-            nperm += Pop(mask);
-        }
-    }
-    // order excitations properly
-    if ((i2 < a1) || (i1 > a2))
-        ++nperm;
-    return (nperm % 2) ? -1 : 1;
+    return phase_double_det<0>(nword, i1, i2, a1, a2, det);
 }
 
 long popcnt_det(const long nword, const ulong *det) {
-    long popcnt = 0;
-    for (long i = 0; i < nword; ++i)
-        popcnt += Pop(det[i]);
-    return popcnt;
+    return popcnt_det<0>(nword, det);
 }
 
 long ctz_det(const long nword, const ulong *det) {
@@ -276,6 +400,26 @@ long ctz_det(const long nword, const ulong *det) {
     return 0;
 }
 
+long diff_det(const long nword, const ulong *det1, const ulong *det2, long *holes,
+              long *parts) {
+    // orbitals occupied only in det1 (holes) and only in det2 (particles), in ascending order
+    long nexc = 0, npart = 0;
+    ulong hword, pword;
+    for (long i = 0; i < nword; ++i) {
+        hword = det1[i] & ~det2[i];
+        pword = det2[i] & ~det1[i];
+        while (hword) {
+            holes[nexc++] = Ctz(hword) + i * Size<ulong>();
+            hword &= hword - 1;
+        }
+        while (pword) {
+            parts[npart++] = Ctz(pword) + i * Size<ulong>();
+            pword &= pword - 1;
+        }
+    }
+    return nexc;
+}
+
 long nword_det(const long n) {
     return n / Size<ulong>() + ((n % Size<ulong>()) ? 1 : 0);
 }
@@ -303,6 +447,11 @@ long py_ctz(const Array<ulong> det) {
     return ctz_det(buf.shape[0], reinterpret_cast<const ulong *>(buf.ptr));
 }
 
+Array<double> py_get_busy_times(void) {
+    Vector<double> times = get_busy_times();
+    return Array<double>(static_cast<long>(times.size()), times.data());
+}
+
 namespace {
 
 long gcd(long x, long y) {
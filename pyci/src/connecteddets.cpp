@@ -0,0 +1,158 @@
+/* This file is part of PyCI.
+ *
+ * PyCI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * PyCI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PyCI. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <pyci.h>
+
+namespace pyci {
+
+namespace {
+
+inline long ndiff_det(const long nword, const ulong *det1, const ulong *det2) {
+    long ndiff = 0;
+    for (long i = 0; i < nword; ++i)
+        ndiff += Pop(det1[i] ^ det2[i]);
+    return ndiff;
+}
+
+} // namespace
+
+/* A determinant (a, b) of alpha string a and beta string b is connected to
+ *
+ *     (a, b') for b' at most a double replacement from b (including b' == b),
+ *     (a', b) for a' a single or double replacement from a, and
+ *     (a', b') for a' a single replacement from a and b' a single replacement from b,
+ *
+ * so the rows of H are found by scanning the determinants sharing its alpha string, the
+ * determinants sharing its beta string, and the determinants of the alpha strings singly
+ * connected to its alpha string, without looking up excitations that are not in the space. */
+
+ConnectedDets::ConnectedDets(const FullCIWfn &wfn) {
+    nstr_up = add_strings(wfn, 0, str_up);
+    nstr_dn = add_strings(wfn, 1, str_dn);
+    add_singles(wfn, 0);
+    add_singles(wfn, 1);
+    // average number of candidate determinants visited per row
+    AlignedVector<long> nvisit(nstr_up, 0);
+    for (long s = 0; s < nstr_up; ++s)
+        for (long k = single_ptr[0][s]; k < single_ptr[0][s + 1]; ++k)
+            nvisit[s] += dets_ptr[0][single[0][k] + 1] - dets_ptr[0][single[0][k]];
+    double visits = 0.0;
+    for (long idet = 0, a, b; idet < wfn.ndet; ++idet) {
+        a = str_up[idet];
+        b = str_dn[idet];
+        visits += dets_ptr[0][a + 1] - dets_ptr[0][a] + dets_ptr[1][b + 1] - dets_ptr[1][b] +
+                  nvisit[a];
+    }
+    cost = wfn.ndet ? visits / wfn.ndet : 0.0;
+    // number of excitations generated per row by SparseOp::add_row
+    double single_up = wfn.nocc_up * wfn.nvir_up, single_dn = wfn.nocc_dn * wfn.nvir_dn;
+    double double_up = single_up * (wfn.nocc_up - 1) * (wfn.nvir_up - 1) / 4;
+    double double_dn = single_dn * (wfn.nocc_dn - 1) * (wfn.nvir_dn - 1) / 4;
+    sparse = cost < single_up + single_dn + single_up * single_dn + double_up + double_dn;
+}
+
+long ConnectedDets::add_strings(const FullCIWfn &wfn, const long spin, AlignedVector<long> &str) {
+    // number the distinct strings in order of first appearance
+    HashMap<Hash, long> ids;
+    str.resize(wfn.ndet);
+    for (long idet = 0; idet < wfn.ndet; ++idet)
+        str[idet] = ids.emplace(spookyhash(wfn.nword, wfn.det_ptr(idet) + spin * wfn.nword),
+                                static_cast<long>(ids.size()))
+                        .first->second;
+    long nstr = ids.size();
+    // bucket the determinants by string, in ascending order
+    AlignedVector<long> &ptr = dets_ptr[spin], &ind = dets[spin];
+    ptr.assign(nstr + 1, 0);
+    for (long idet = 0; idet < wfn.ndet; ++idet)
+        ++ptr[str[idet] + 1];
+    for (long s = 0; s < nstr; ++s)
+        ptr[s + 1] += ptr[s];
+    AlignedVector<long> pos(ptr.begin(), ptr.end() - 1);
+    ind.resize(wfn.ndet);
+    for (long idet = 0; idet < wfn.ndet; ++idet)
+        ind[pos[str[idet]]++] = idet;
+    return nstr;
+}
+
+void ConnectedDets::add_singles(const FullCIWfn &wfn, const long spin) {
+    // two strings are connected by a single replacement iff they share an (N - 1)-electron
+    // string, so key each string by each of its (N - 1)-electron strings and group the keys
+    long nstr = spin ? nstr_dn : nstr_up, nocc = spin ? wfn.nocc_dn : wfn.nocc_up;
+    Vector<std::pair<Hash, long>> keys;
+    keys.reserve(nstr * nocc);
+    AlignedVector<ulong> det(wfn.nword);
+    AlignedVector<long> occs(nocc);
+    for (long s = 0; s < nstr; ++s) {
+        const ulong *sdet = wfn.det_ptr(dets[spin][dets_ptr[spin][s]]) + spin * wfn.nword;
+        std::memcpy(&det[0], sdet, sizeof(ulong) * wfn.nword);
+        fill_occs(wfn.nword, sdet, &occs[0]);
+        for (long i = 0; i < nocc; ++i) {
+            clearbit_det(occs[i], &det[0]);
+            keys.emplace_back(spookyhash(wfn.nword, &det[0]), s);
+            setbit_det(occs[i], &det[0]);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    AlignedVector<long> &ptr = single_ptr[spin], &ind = single[spin];
+    ptr.assign(nstr + 1, 0);
+    for (std::size_t g = 0, h; g < keys.size(); g = h) {
+        for (h = g + 1; h < keys.size() && keys[h].first == keys[g].first; ++h)
+            ;
+        for (std::size_t k = g; k < h; ++k)
+            ptr[keys[k].second + 1] += h - g - 1;
+    }
+    for (long s = 0; s < nstr; ++s)
+        ptr[s + 1] += ptr[s];
+    AlignedVector<long> pos(ptr.begin(), ptr.end() - 1);
+    ind.resize(ptr.back());
+    for (std::size_t g = 0, h; g < keys.size(); g = h) {
+        for (h = g + 1; h < keys.size() && keys[h].first == keys[g].first; ++h)
+            ;
+        for (std::size_t k = g; k < h; ++k)
+            for (std::size_t l = g; l < h; ++l)
+                if (k != l)
+                    ind[pos[keys[k].second]++] = keys[l].second;
+    }
+}
+
+void ConnectedDets::fill_connected(const FullCIWfn &wfn, const long idet,
+                                   Vector<long> &jdets) const {
+    long a = str_up[idet], b = str_dn[idet], jdet;
+    const ulong *rdet_up = wfn.det_ptr(idet);
+    const ulong *rdet_dn = rdet_up + wfn.nword;
+    jdets.clear();
+    // same alpha string, beta strings at most a double replacement apart
+    for (long k = dets_ptr[0][a]; k < dets_ptr[0][a + 1]; ++k) {
+        jdet = dets[0][k];
+        if (ndiff_det(wfn.nword, rdet_dn, wfn.det_ptr(jdet) + wfn.nword) <= 4)
+            jdets.push_back(jdet);
+    }
+    // same beta string, alpha strings a single or double replacement apart
+    for (long k = dets_ptr[1][b]; k < dets_ptr[1][b + 1]; ++k) {
+        jdet = dets[1][k];
+        if (str_up[jdet] != a && ndiff_det(wfn.nword, rdet_up, wfn.det_ptr(jdet)) <= 4)
+            jdets.push_back(jdet);
+    }
+    // alpha and beta strings each a single replacement apart
+    for (long l = single_ptr[0][a]; l < single_ptr[0][a + 1]; ++l) {
+        for (long k = dets_ptr[0][single[0][l]]; k < dets_ptr[0][single[0][l] + 1]; ++k) {
+            jdet = dets[0][k];
+            if (ndiff_det(wfn.nword, rdet_dn, wfn.det_ptr(jdet) + wfn.nword) == 2)
+                jdets.push_back(jdet);
+        }
+    }
+}
+
+} // namespace pyci
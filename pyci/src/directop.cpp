@@ -0,0 +1,176 @@
+/* This file is part of PyCI.
+ *
+ * PyCI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * PyCI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PyCI. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <pyci.h>
+
+namespace pyci {
+
+namespace {
+
+/* Spectra matrix operation wrapper around the multithreaded DirectOp kernel. */
+
+class DirectOpProd {
+public:
+    using Scalar = double;
+
+    DirectOpProd(const DirectOp &op_) : op(op_) {
+    }
+
+    long rows(void) const {
+        return op.nrow;
+    }
+
+    long cols(void) const {
+        return op.ncol;
+    }
+
+    void perform_op(const double *x, double *y) const {
+        op.perform_op(x, y);
+    }
+
+private:
+    const DirectOp &op;
+};
+
+} // namespace
+
+DirectOp::DirectOp(const DirectOp &op)
+    : nrow(op.nrow), ncol(op.ncol), ecore(op.ecore), shape(op.shape), ham(op.ham), wfn(op.wfn),
+      op_thread(op.op_thread), sigma(op.sigma), connected(op.connected) {
+}
+
+DirectOp::DirectOp(const SQuantOp &ham_, const DOCIWfn &wfn_, const long rows, const long cols)
+    : nrow((rows > -1) ? rows : wfn_.ndet), ncol((cols > -1) ? cols : wfn_.ndet),
+      ecore(ham_.ecore), ham(&ham_), wfn(&wfn_), op_thread(&perform_op_thread<DOCIWfn>) {
+    shape = pybind11::make_tuple(pybind11::cast(nrow), pybind11::cast(ncol));
+}
+
+DirectOp::DirectOp(const SQuantOp &ham_, const FullCIWfn &wfn_, const long rows, const long cols)
+    : nrow((rows > -1) ? rows : wfn_.ndet), ncol((cols > -1) ? cols : wfn_.ndet),
+      ecore(ham_.ecore), ham(&ham_), wfn(&wfn_), op_thread(&perform_op_thread<FullCIWfn>) {
+    shape = pybind11::make_tuple(pybind11::cast(nrow), pybind11::cast(ncol));
+    // complete spaces are handled by the alpha/beta string-driven sigma vector
+    if (nrow == wfn_.ndet && ncol == wfn_.ndet && StringSigma::is_complete(wfn_)) {
+        sigma = std::make_shared<const StringSigma>(ham_, wfn_);
+        return;
+    }
+    // sparse selected spaces visit only the connected determinants of each row
+    std::shared_ptr<const ConnectedDets> dets = std::make_shared<const ConnectedDets>(wfn_);
+    if (dets->sparse)
+        connected = dets;
+}
+
+DirectOp::DirectOp(const SQuantOp &ham_, const GenCIWfn &wfn_, const long rows, const long cols)
+    : nrow((rows > -1) ? rows : wfn_.ndet), ncol((cols > -1) ? cols : wfn_.ndet),
+      ecore(ham_.ecore), ham(&ham_), wfn(&wfn_), op_thread(&perform_op_thread<GenCIWfn>) {
+    shape = pybind11::make_tuple(pybind11::cast(nrow), pybind11::cast(ncol));
+}
+
+pybind11::object DirectOp::dtype(void) const {
+    return pybind11::dtype::of<double>();
+}
+
+template<class WfnType>
+void DirectOp::perform_op_thread(const DirectOp &op, const double *x, double *y,
+                                 const long start, const long end) {
+    // regenerate each full (non-symmetric) row with the same excitation loops as SparseOp,
+    // contracting the matrix elements with x as they are generated
+    const WfnType &wfn = static_cast<const WfnType &>(*op.wfn);
+    SparseOpRows rows{op.ncol, false, op.connected.get()};
+    ulong *det = thread_scratch<ulong, 0>(wfn.nword2);
+    long *occs = thread_scratch<long, 0>(wfn.nocc);
+    long *virs = thread_scratch<long, 1>(wfn.nvir);
+    long *parity = thread_scratch<long, 2>(wfn.nbasis * 2 + 2);
+    for (long i = start; i < end; ++i) {
+        SparseOpDot dot{x};
+        rows.add_row(*op.ham, wfn, i, det, occs, virs, parity, dot);
+        y[i] = dot.val;
+    }
+}
+
+void DirectOp::perform_op(const double *x, double *y) const {
+    if (sigma)
+        return sigma->perform_op(x, y);
+    long nthread = get_num_threads();
+    long chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    }
+    parallel_for(nthread, nrow, PYCI_CHUNKSIZE_DYNAMIC,
+                 [&](const long, const long start, const long end) {
+                     op_thread(*this, x, y, start, end);
+                 });
+}
+
+void DirectOp::solve_ci(const long n, const double *coeffs, const long ncv, const long maxiter,
+                        const double tol, double *evals, double *evecs) const {
+    if ((nrow > 1 && n >= nrow) || (nrow == 1 && n > 1)) {
+        throw std::invalid_argument("cannot find >=n eigenpairs for direct operator with n rows");
+    } else if (nrow != ncol) {
+        throw pybind11::type_error("Can only solve square direct operators");
+    } else if (nrow == 1) {
+        double x = 1.0;
+        perform_op(&x, evals);
+        *evals += ecore;
+        *evecs = 1.0;
+        return;
+    }
+    DirectOpProd op(*this);
+    Spectra::SymEigsSolver<DirectOpProd> eigs(
+        op, n, (ncv != -1) ? ncv : std::min(nrow, std::max(n * 2 + 1, 20L)));
+    if (coeffs == nullptr)
+        eigs.init();
+    else
+        eigs.init(coeffs);
+    eigs.compute(Spectra::SortRule::SmallestAlge, (maxiter != -1) ? maxiter : n * nrow * 10, tol);
+    if (eigs.info() != Spectra::CompInfo::Successful)
+        throw std::runtime_error("did not converge");
+    DenseVector<double> eigenvalues(evals, n);
+    DenseMatrix<double> eigenvectors(evecs, n, nrow);
+    eigenvalues = eigs.eigenvalues();
+    for (long i = 0; i < n; ++i)
+        evals[i] += ecore;
+    eigenvectors.transpose() = eigs.eigenvectors();
+}
+
+Array<double> DirectOp::py_matvec(const Array<double> x) const {
+    Array<double> y(nrow);
+    perform_op(reinterpret_cast<const double *>(x.request().ptr),
+               reinterpret_cast<double *>(y.request().ptr));
+    return y;
+}
+
+Array<double> DirectOp::py_matvec_out(const Array<double> x, Array<double> y) const {
+    perform_op(reinterpret_cast<const double *>(x.request().ptr),
+               reinterpret_cast<double *>(y.request().ptr));
+    return y;
+}
+
+pybind11::tuple DirectOp::py_solve_ci(const long n, pybind11::object coeffs, const long ncv,
+                                      const long maxiter, const double tol) const {
+    Array<double> eigvals(n);
+    Array<double> eigvecs({n, nrow});
+    const double *cptr =
+        coeffs.is(pybind11::none())
+            ? nullptr
+            : reinterpret_cast<const double *>(coeffs.cast<Array<double>>().request().ptr);
+    double *evals = reinterpret_cast<double *>(eigvals.request().ptr);
+    double *evecs = reinterpret_cast<double *>(eigvecs.request().ptr);
+    solve_ci(n, cptr, ncv, maxiter, tol, evals, evecs);
+    return pybind11::make_tuple(eigvals, eigvecs);
+}
+
+} // namespace pyci
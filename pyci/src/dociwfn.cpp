@@ -20,7 +20,7 @@ namespace pyci {
 DOCIWfn::DOCIWfn(const DOCIWfn &wfn) : OneSpinWfn(wfn) {
 }
 
-DOCIWfn::DOCIWfn(DOCIWfn &&wfn) noexcept : OneSpinWfn(wfn) {
+DOCIWfn::DOCIWfn(DOCIWfn &&wfn) : OneSpinWfn(wfn) {
 }
 
 DOCIWfn::DOCIWfn(const std::string &filename) : OneSpinWfn(filename) {
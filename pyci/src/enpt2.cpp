@@ -21,17 +21,38 @@ typedef HashMap<Hash, std::pair<double, double>> PairHashMap;
 
 namespace {
 
-void compute_enpt2_thread_condense(PairHashMap &terms, PairHashMap &t_terms, const long ithread) {
-    if (!ithread)
-        terms.swap(t_terms);
-    else {
-        for (auto &keyval : t_terms) {
+/* External determinants found by one slot. The external space is partitioned by rank into npart
+ * parts that are summed in separate passes, so that only the determinants of one part are held at
+ * a time. They are kept in one map per reduction bucket, and the buckets are merged in parallel. */
+
+struct PT2Terms {
+    long npart, part;
+    Vector<PairHashMap> buckets;
+
+    inline bool owns(const Hash &rank) const {
+        return static_cast<long>(rank.first % npart) == part;
+    }
+
+    inline std::pair<double, double> &operator[](const Hash &rank) {
+        return buckets[(rank.first / npart) % buckets.size()][rank];
+    }
+};
+
+double compute_enpt2_bucket(Vector<PT2Terms> &v_terms, const long bucket, const double e) {
+    PairHashMap terms;
+    terms.swap(v_terms[0].buckets[bucket]);
+    for (std::size_t i = 1; i < v_terms.size(); ++i) {
+        for (auto &keyval : v_terms[i].buckets[bucket]) {
             std::pair<double, double> *pair = &terms[keyval.first];
             pair->first += keyval.second.first;
             pair->second = keyval.second.second;
         }
-        PairHashMap().swap(t_terms);
+        PairHashMap().swap(v_terms[i].buckets[bucket]);
     }
+    double correction = 0.0;
+    for (const auto &keyval : terms)
+        correction += keyval.second.first * keyval.second.first / (e - keyval.second.second);
+    return correction;
 }
 
 void compute_enpt2_thread_gather(const FullCIWfn &wfn, const double *one_mo, const double *two_mo,
@@ -73,11 +94,13 @@ void compute_enpt2_thread_gather(const FullCIWfn &wfn, const double *one_mo, con
     term.second = diag;
 }
 
-void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairHashMap &terms,
+template<long NW>
+void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PT2Terms &terms,
                                 const double *coeffs, const double eps, const long idet,
-                                ulong *det_up, long *occs_up, long *virs_up, long *t_up) {
+                                ulong *det_up, long *occs_up, long *virs_up, long *parity_up,
+                                long *t_up) {
     long i, j, k, l, ii, jj, kk, ll, ioffset, koffset, sign_up;
-    Hash rank;
+    Hash rank, rank_i;
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
     long n3 = n1 * n2;
@@ -87,14 +110,18 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
     ulong *det_dn = det_up + wfn.nword;
     long *occs_dn = occs_up + wfn.nocc_up;
     long *virs_dn = virs_up + wfn.nvir_up;
+    long *parity_dn = parity_up + n1 + 1;
     long *t_dn = t_up + wfn.nocc_up;
     std::memcpy(det_up, rdet_up, sizeof(ulong) * wfn.nword2);
-    fill_occs(wfn.nword, rdet_up, occs_up);
-    fill_occs(wfn.nword, rdet_dn, occs_dn);
-    fill_virs(wfn.nword, wfn.nbasis, rdet_up, virs_up);
-    fill_virs(wfn.nword, wfn.nbasis, rdet_dn, virs_dn);
+    fill_occs<NW>(wfn.nword, rdet_up, occs_up);
+    fill_occs<NW>(wfn.nword, rdet_dn, occs_dn);
+    fill_virs<NW>(wfn.nword, wfn.nbasis, rdet_up, virs_up);
+    fill_virs<NW>(wfn.nword, wfn.nbasis, rdet_dn, virs_dn);
+    fill_parity<NW>(wfn.nword, n1, rdet_up, parity_up);
+    fill_parity<NW>(wfn.nword, n1, rdet_dn, parity_dn);
     std::memcpy(t_up, occs_up, sizeof(long) * wfn.nocc_up);
     std::memcpy(t_dn, occs_dn, sizeof(long) * wfn.nocc_dn);
+    Hash rank_r = wfn.rank_det(rdet_up);
     // loop over spin-up occupied indices
     for (i = 0; i < wfn.nocc_up; ++i) {
         ii = occs_up[i];
@@ -104,7 +131,8 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
             jj = virs_up[j];
             // 1-0 excitation elements
             excite_det(ii, jj, det_up);
-            sign_up = phase_single_det(wfn.nword, ii, jj, rdet_up);
+            rank_i = wfn.excite_rank(rank_r, ii, jj);
+            sign_up = phase_single_det(parity_up, ii, jj);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc_up; ++k) {
                 kk = occs_up[k];
@@ -118,10 +146,10 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
             val *= coeffs[idet];
             // add determinant if |H*c| > eps and not already in wfn
             if (std::abs(val) > eps) {
-                rank = wfn.rank_det(det_up);
-                if (wfn.index_det_from_rank(rank) == -1) {
+                rank = rank_i;
+                if (wfn.index_det(det_up, rank) == -1 && terms.owns(rank)) {
                     val *= sign_up;
-                    fill_occs(wfn.nword, det_up, t_up);
+                    fill_occs<NW>(wfn.nword, det_up, t_up);
                     compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank], val, n2,
                                                 n3, t_up);
                 }
@@ -138,10 +166,13 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
                     val = ham.two_mo[koffset + n1 * jj + ll] * coeffs[idet];
                     // add determinant if |H*c| > eps and not already in wfn
                     if (std::abs(val) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1) {
-                            val *= sign_up * phase_single_det(wfn.nword, kk, ll, rdet_dn);
-                            fill_occs(wfn.nword, det_dn, t_dn);
+                        rank = wfn.excite_rank(rank_i, n1 + kk, n1 + ll);
+                        if (wfn.index_det(det_up, rank) == -1 && terms.owns(rank)) {
+                            val *= sign_up * phase_single_det(parity_dn, kk, ll);
+                            // the alpha occupations are only filled above if the 1-0
+                            // excitation is kept, so fill both spins
+                            fill_occs<NW>(wfn.nword, det_up, t_up);
+                            fill_occs<NW>(wfn.nword, det_dn, t_dn);
                             compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank],
                                                         val, n2, n3, t_up);
                         }
@@ -164,10 +195,10 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
                         coeffs[idet];
                     // add determinant if |H*c| > eps and not already in wfn
                     if (std::abs(val) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1) {
-                            val *= phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_up);
-                            fill_occs(wfn.nword, det_up, t_up);
+                        rank = wfn.excite_rank(rank_i, kk, ll);
+                        if (wfn.index_det(det_up, rank) == -1 && terms.owns(rank)) {
+                            val *= phase_double_det(parity_up, ii, kk, jj, ll);
+                            fill_occs<NW>(wfn.nword, det_up, t_up);
                             compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank],
                                                         val, n2, n3, t_up);
                         }
@@ -188,6 +219,7 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
             jj = virs_dn[j];
             // 0-1 excitation elements
             excite_det(ii, jj, det_dn);
+            rank_i = wfn.excite_rank(rank_r, n1 + ii, n1 + jj);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc_up; ++k) {
                 kk = occs_up[k];
@@ -201,10 +233,10 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
             val *= coeffs[idet];
             // add determinant if |H*c| > eps and not already in wfn
             if (std::abs(val) > eps) {
-                rank = wfn.rank_det(det_up);
-                if (wfn.index_det_from_rank(rank) == -1) {
-                    val *= phase_single_det(wfn.nword, ii, jj, rdet_dn);
-                    fill_occs(wfn.nword, det_dn, t_dn);
+                rank = rank_i;
+                if (wfn.index_det(det_up, rank) == -1 && terms.owns(rank)) {
+                    val *= phase_single_det(parity_dn, ii, jj);
+                    fill_occs<NW>(wfn.nword, det_dn, t_dn);
                     compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank], val, n2,
                                                 n3, t_up);
                 }
@@ -223,10 +255,10 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const FullCIWfn &wfn, PairH
                         coeffs[idet];
                     // add determinant if |H*c| > eps and not already in wfn
                     if (std::abs(val) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1) {
-                            val *= phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_dn);
-                            fill_occs(wfn.nword, det_dn, t_dn);
+                        rank = wfn.excite_rank(rank_i, n1 + kk, n1 + ll);
+                        if (wfn.index_det(det_up, rank) == -1 && terms.owns(rank)) {
+                            val *= phase_double_det(parity_dn, ii, kk, jj, ll);
+                            fill_occs<NW>(wfn.nword, det_dn, t_dn);
                             compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank],
                                                         val, n2, n3, t_up);
                         }
@@ -262,9 +294,10 @@ void compute_enpt2_thread_gather(const GenCIWfn &wfn, const double *one_mo, cons
     term.second = diag;
 }
 
-void compute_enpt2_thread_terms(const SQuantOp &ham, const GenCIWfn &wfn, PairHashMap &terms,
+template<long NW>
+void compute_enpt2_thread_terms(const SQuantOp &ham, const GenCIWfn &wfn, PT2Terms &terms,
                                 const double *coeffs, const double eps, const long idet, ulong *det,
-                                long *occs, long *virs, long *tmps) {
+                                long *occs, long *virs, long *parity, long *tmps) {
     Hash rank;
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
@@ -272,18 +305,21 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const GenCIWfn &wfn, PairHa
     double val;
     const ulong *rdet = wfn.det_ptr(idet);
     std::memcpy(det, rdet, sizeof(ulong) * wfn.nword);
-    fill_occs(wfn.nword, rdet, occs);
-    fill_virs(wfn.nword, wfn.nbasis, rdet, virs);
+    fill_occs<NW>(wfn.nword, rdet, occs);
+    fill_virs<NW>(wfn.nword, wfn.nbasis, rdet, virs);
+    fill_parity<NW>(wfn.nword, n1, rdet, parity);
     std::memcpy(tmps, occs, sizeof(long) * wfn.nocc);
+    Hash rank_i, rank_r = wfn.rank_det(rdet);
     // loop over occupied indices
     for (long i = 0, j, k, l, ii, jj, kk, ll, ioffset, koffset; i < wfn.nocc; ++i) {
         ii = occs[i];
         ioffset = n3 * ii;
         // loop over virtual indices
-        for (j = 0; j < wfn.nvir; ++j) {
+        for (j = 0; j < wfn.nvir_up; ++j) {
             jj = virs[j];
             // single excitation elements
             excite_det(ii, jj, det);
+            rank_i = wfn.excite_rank(rank_r, ii, jj);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc; ++k) {
                 kk = occs[k];
@@ -293,10 +329,10 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const GenCIWfn &wfn, PairHa
             val *= coeffs[idet];
             // add determinant if |H*c| > eps and not already in wfn
             if (std::abs(val) > eps) {
-                rank = wfn.rank_det(det);
-                if (wfn.index_det_from_rank(rank) == -1) {
-                    val *= phase_single_det(wfn.nword, ii, jj, rdet);
-                    fill_occs(wfn.nword, det, tmps);
+                rank = rank_i;
+                if (wfn.index_det(det, rank) == -1 && terms.owns(rank)) {
+                    val *= phase_single_det(parity, ii, jj);
+                    fill_occs<NW>(wfn.nword, det, tmps);
                     compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank], val, n2,
                                                 n3, tmps);
                 }
@@ -306,7 +342,7 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const GenCIWfn &wfn, PairHa
                 kk = occs[k];
                 koffset = ioffset + n2 * kk;
                 // loop over virtual indices
-                for (l = j + 1; l < wfn.nvir; ++l) {
+                for (l = j + 1; l < wfn.nvir_up; ++l) {
                     ll = virs[l];
                     // double excitation elements
                     excite_det(kk, ll, det);
@@ -315,10 +351,10 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const GenCIWfn &wfn, PairHa
                         coeffs[idet];
                     // add determinant if |H*c| > eps and not already in wfn
                     if (std::abs(val) > eps) {
-                        rank = wfn.rank_det(det);
-                        if (wfn.index_det_from_rank(rank) == -1) {
-                            val *= phase_double_det(wfn.nword, ii, kk, jj, ll, rdet);
-                            fill_occs(wfn.nword, det, tmps);
+                        rank = wfn.excite_rank(rank_i, kk, ll);
+                        if (wfn.index_det(det, rank) == -1 && terms.owns(rank)) {
+                            val *= phase_double_det(parity, ii, kk, jj, ll);
+                            fill_occs<NW>(wfn.nword, det, tmps);
                             compute_enpt2_thread_gather(wfn, ham.one_mo, ham.two_mo, terms[rank],
                                                         val, n2, n3, tmps);
                         }
@@ -331,24 +367,101 @@ void compute_enpt2_thread_terms(const SQuantOp &ham, const GenCIWfn &wfn, PairHa
     }
 }
 
-template<class WfnType>
-void compute_enpt2_thread(const SQuantOp &ham, const WfnType &wfn, PairHashMap &terms,
+template<class WfnType, long NW>
+void compute_enpt2_thread(const SQuantOp &ham, const WfnType &wfn, PT2Terms &terms,
                           const double *coeffs, const double eps, const long start,
                           const long end) {
-    AlignedVector<ulong> det(wfn.nword2);
-    AlignedVector<long> occs(wfn.nocc);
-    AlignedVector<long> virs(wfn.nvir);
-    AlignedVector<long> tmps(wfn.nocc);
+    ulong *det = thread_scratch<ulong, 0>(wfn.nword2);
+    long *occs = thread_scratch<long, 0>(wfn.nocc);
+    long *virs = thread_scratch<long, 1>(wfn.nvir);
+    long *parity = thread_scratch<long, 2>(wfn.nbasis * 2 + 2);
+    long *tmps = thread_scratch<long, 3>(wfn.nocc);
     for (long i = start; i < end; ++i)
-        compute_enpt2_thread_terms(ham, wfn, terms, coeffs, eps, i, &det[0], &occs[0], &virs[0],
-                                   &tmps[0]);
+        compute_enpt2_thread_terms<NW>(ham, wfn, terms, coeffs, eps, i, det, occs, virs, parity,
+                                       tmps);
+}
+
+/* One sample of the stochastic part of the semistochastic ENPT2 correction (Sharma et al., 2017).
+ * N determinants are drawn with replacement with probabilities p_i = |c_i| / sum_j |c_j|, and each
+ * distinct determinant i, drawn w_i times, is expanded by the deterministic kernel. With
+ * x_ai = H_ai c_i,
+ *
+ *     sum_a [(sum_i w_i x_ai / p_i)^2 + sum_i (w_i (N - 1) / p_i - w_i^2 / p_i^2) x_ai^2]
+ *           / (N (N - 1) (E - H_aa))
+ *
+ * is an unbiased estimate of the correction with |x_ai| > eps. The same sum over the terms with
+ * |x_ai| > eps_det is subtracted, since those are summed deterministically. The draws come from a
+ * stream seeded by (seed, sample), so they do not depend on the thread running the sample. */
+
+struct PT2SampleTerm {
+    double s1, s2, s1_det, s2_det, diag;
+};
+
+template<class WfnType, long NW>
+double compute_enpt2_sample(const SQuantOp &ham, const WfnType &wfn, const double *coeffs,
+                            const double *cumul, const double eps, const double eps_det,
+                            const long ndraw, const ulong seed, const long sample,
+                            const double e) {
+    ulong *det = thread_scratch<ulong, 0>(wfn.nword2);
+    long *occs = thread_scratch<long, 0>(wfn.nocc);
+    long *virs = thread_scratch<long, 1>(wfn.nvir);
+    long *parity = thread_scratch<long, 2>(wfn.nbasis * 2 + 2);
+    long *tmps = thread_scratch<long, 3>(wfn.nocc);
+    std::seed_seq seq{static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32),
+                      static_cast<std::uint32_t>(sample),
+                      static_cast<std::uint32_t>(static_cast<ulong>(sample) >> 32)};
+    std::mt19937_64 rng(seq);
+    double norm = cumul[wfn.ndet - 1], n = static_cast<double>(ndraw);
+    // draw the determinants by bisection of the cumulative |c_i|
+    AlignedVector<long> draws(ndraw);
+    for (long k = 0; k < ndraw; ++k) {
+        double u = std::ldexp(static_cast<double>(rng() >> 11), -53) * norm;
+        draws[k] = std::min(static_cast<long>(std::upper_bound(cumul, cumul + wfn.ndet, u) - cumul),
+                            wfn.ndet - 1);
+    }
+    std::sort(draws.begin(), draws.end());
+    PT2Terms terms{1, 0, Vector<PairHashMap>(1)};
+    HashMap<Hash, PT2SampleTerm> sample_terms;
+    for (long k = 0, l; k < ndraw; k = l) {
+        for (l = k + 1; l < ndraw && draws[l] == draws[k]; ++l)
+            ;
+        double w = l - k, p = std::abs(coeffs[draws[k]]) / norm;
+        double f1 = w / p, f2 = w * (n - 1) / p - w * w / (p * p);
+        compute_enpt2_thread_terms<NW>(ham, wfn, terms, coeffs, eps, draws[k], det, occs, virs,
+                                       parity, tmps);
+        // each external determinant is reached once from a given determinant
+        for (const auto &keyval : terms.buckets[0]) {
+            double x = keyval.second.first;
+            PT2SampleTerm &term = sample_terms[keyval.first];
+            term.s1 += f1 * x;
+            term.s2 += f2 * x * x;
+            if (std::abs(x) > eps_det) {
+                term.s1_det += f1 * x;
+                term.s2_det += f2 * x * x;
+            }
+            term.diag = keyval.second.second;
+        }
+        terms.buckets[0].clear();
+    }
+    double correction = 0.0;
+    for (const auto &keyval : sample_terms) {
+        const PT2SampleTerm &term = keyval.second;
+        correction += (term.s1 * term.s1 + term.s2 - term.s1_det * term.s1_det - term.s2_det) /
+                      (e - term.diag);
+    }
+    return correction / (n * (n - 1));
 }
 
 } // namespace
 
 template<class WfnType>
 double compute_enpt2(const SQuantOp &ham, const WfnType &wfn, const double *coeffs, const double energy,
-                     const double eps, long nthread) {
+                     const double eps, long nthread, const long npart) {
+    if (npart < 1)
+        throw std::invalid_argument("npart must be at least 1");
+    // a complete wfn has no external determinants
+    if (wfn.complete)
+        return energy;
     if (nthread == -1)
         nthread = get_num_threads();
     long chunksize = wfn.ndet / nthread + static_cast<bool>(wfn.ndet % nthread);
@@ -356,56 +469,138 @@ double compute_enpt2(const SQuantOp &ham, const WfnType &wfn, const double *coef
         nthread /= 2;
         chunksize = wfn.ndet / nthread + static_cast<bool>(wfn.ndet % nthread);
     }
-    PairHashMap terms;
-    Vector<PairHashMap> v_terms(nthread);
-    Vector<std::thread> v_threads;
-    v_threads.reserve(nthread);
-    for (long i = 0; i < nthread; ++i) {
-        long start = end_chunk_idx(i, nthread, wfn.ndet);
-        long end = end_chunk_idx(i + 1, nthread, wfn.ndet);
-        end = std::min(end, wfn.ndet);
-        v_threads.emplace_back(&compute_enpt2_thread<WfnType>, std::ref(ham), std::ref(wfn),
-                               std::ref(v_terms[i]), coeffs, eps, start, end);
-    }
-    long n = 0;
-    for (auto &thread : v_threads) {
-        thread.join();
-        compute_enpt2_thread_condense(terms, v_terms[n], n);
-        ++n;
-    }
-    // compute enpt2 correction
+    auto thread_fn = select_nword(
+        wfn.nword, &compute_enpt2_thread<WfnType, 1>, &compute_enpt2_thread<WfnType, 2>,
+        &compute_enpt2_thread<WfnType, 4>, &compute_enpt2_thread<WfnType, 0>);
+    Vector<PT2Terms> v_terms(nthread, PT2Terms{npart, 0, Vector<PairHashMap>(nthread)});
+    Vector<double> v_corrections(nthread);
     double e = energy - ham.ecore, correction = 0.0;
-    for (const auto &keyval : terms)
-        correction += keyval.second.first * keyval.second.first / (e - keyval.second.second);
+    // each pass regenerates the excitations of every determinant and keeps those of one part
+    for (long part = 0; part < npart; ++part) {
+        for (auto &t_terms : v_terms)
+            t_terms.part = part;
+        parallel_for(nthread, wfn.ndet, PYCI_CHUNKSIZE_DYNAMIC,
+                     [&](const long slot, const long start, const long end) {
+                         thread_fn(ham, wfn, v_terms[slot], coeffs, eps, start, end);
+                     });
+        // compute enpt2 correction
+        parallel_run(nthread, [&](const long bucket) {
+            v_corrections[bucket] = compute_enpt2_bucket(v_terms, bucket, e);
+        });
+        for (double c : v_corrections)
+            correction += c;
+    }
     return energy + correction;
 }
 
 template double compute_enpt2<FullCIWfn>(const SQuantOp &, const FullCIWfn &, const double *,
-                                         const double, const double, long);
+                                         const double, const double, long, const long);
 
 template double compute_enpt2<GenCIWfn>(const SQuantOp &, const GenCIWfn &, const double *, const double,
-                                        const double, long);
+                                        const double, long, const long);
 
 template<>
 double compute_enpt2<DOCIWfn>(const SQuantOp &ham, const DOCIWfn &wfn, const double *coeffs,
-                              const double energy, const double eps, long nthread) {
-    return compute_enpt2<FullCIWfn>(ham, FullCIWfn(wfn), coeffs, energy, eps, nthread);
+                              const double energy, const double eps, long nthread,
+                              const long npart) {
+    return compute_enpt2<FullCIWfn>(ham, FullCIWfn(wfn), coeffs, energy, eps, nthread, npart);
+}
+
+template<class WfnType>
+std::pair<double, double> compute_enpt2_semistochastic(const SQuantOp &ham, const WfnType &wfn,
+                                                       const double *coeffs, const double energy,
+                                                       const double eps, const double eps_det,
+                                                       const long nsamples, const long ndraw,
+                                                       const ulong seed, long nthread,
+                                                       const long npart) {
+    if (nsamples < 2)
+        throw std::invalid_argument("nsamples must be at least 2");
+    else if (ndraw < 2)
+        throw std::invalid_argument("ndraw must be at least 2");
+    // deterministic part
+    double pt_energy = compute_enpt2<WfnType>(ham, wfn, coeffs, energy, eps_det, nthread, npart);
+    if (wfn.complete || eps_det <= eps)
+        return std::make_pair(pt_energy, 0.0);
+    if (nthread == -1)
+        nthread = get_num_threads();
+    AlignedVector<double> cumul(wfn.ndet);
+    double norm = 0.0;
+    for (long i = 0; i < wfn.ndet; ++i)
+        cumul[i] = norm += std::abs(coeffs[i]);
+    auto sample_fn = select_nword(
+        wfn.nword, &compute_enpt2_sample<WfnType, 1>, &compute_enpt2_sample<WfnType, 2>,
+        &compute_enpt2_sample<WfnType, 4>, &compute_enpt2_sample<WfnType, 0>);
+    // stochastic part
+    Vector<double> v_samples(nsamples);
+    double e = energy - ham.ecore;
+    parallel_for(std::min(nthread, nsamples), nsamples, 1,
+                 [&](const long, const long start, const long end) {
+                     for (long s = start; s < end; ++s)
+                         v_samples[s] = sample_fn(ham, wfn, coeffs, &cumul[0], eps, eps_det, ndraw,
+                                                  seed, s, e);
+                 });
+    double mean = 0.0, var = 0.0;
+    for (double x : v_samples)
+        mean += x;
+    mean /= nsamples;
+    for (double x : v_samples)
+        var += (x - mean) * (x - mean);
+    return std::make_pair(pt_energy + mean, std::sqrt(var / (nsamples * (nsamples - 1))));
+}
+
+template std::pair<double, double>
+compute_enpt2_semistochastic<FullCIWfn>(const SQuantOp &, const FullCIWfn &, const double *,
+                                        const double, const double, const double, const long,
+                                        const long, const ulong, long, const long);
+
+template std::pair<double, double>
+compute_enpt2_semistochastic<GenCIWfn>(const SQuantOp &, const GenCIWfn &, const double *,
+                                       const double, const double, const double, const long,
+                                       const long, const ulong, long, const long);
+
+template<>
+std::pair<double, double>
+compute_enpt2_semistochastic<DOCIWfn>(const SQuantOp &ham, const DOCIWfn &wfn,
+                                      const double *coeffs, const double energy, const double eps,
+                                      const double eps_det, const long nsamples, const long ndraw,
+                                      const ulong seed, long nthread, const long npart) {
+    return compute_enpt2_semistochastic<FullCIWfn>(ham, FullCIWfn(wfn), coeffs, energy, eps,
+                                                   eps_det, nsamples, ndraw, seed, nthread, npart);
 }
 
 template<class WfnType>
-double py_compute_enpt2(const SQuantOp &ham, const WfnType &wfn, const Array<double> coeffs,
-                        const double energy, const double eps, const long nthread) {
-    return compute_enpt2<WfnType>(ham, wfn, reinterpret_cast<const double *>(coeffs.request().ptr),
-                                  energy, eps, nthread);
+pybind11::object py_compute_enpt2(const SQuantOp &ham, const WfnType &wfn,
+                                  const Array<double> coeffs, const double energy,
+                                  const double eps, const long nthread, const long npart,
+                                  const std::string &mode, const double eps_det,
+                                  const long nsamples, const long ndraw, const ulong seed) {
+    const double *c = reinterpret_cast<const double *>(coeffs.request().ptr);
+    if (mode == "deterministic")
+        return pybind11::float_(compute_enpt2<WfnType>(ham, wfn, c, energy, eps, nthread, npart));
+    else if (mode == "semistochastic") {
+        std::pair<double, double> result = compute_enpt2_semistochastic<WfnType>(
+            ham, wfn, c, energy, eps, eps_det, nsamples, ndraw, seed, nthread, npart);
+        return pybind11::make_tuple(result.first, result.second);
+    }
+    throw std::invalid_argument("mode must be one of 'deterministic', 'semistochastic'");
 }
 
-template double py_compute_enpt2<DOCIWfn>(const SQuantOp &, const DOCIWfn &, const Array<double>,
-                                          const double, const double, const long);
+template pybind11::object py_compute_enpt2<DOCIWfn>(const SQuantOp &, const DOCIWfn &,
+                                                    const Array<double>, const double, const double,
+                                                    const long, const long, const std::string &,
+                                                    const double, const long, const long,
+                                                    const ulong);
 
-template double py_compute_enpt2<FullCIWfn>(const SQuantOp &, const FullCIWfn &, const Array<double>,
-                                            const double, const double, const long);
+template pybind11::object py_compute_enpt2<FullCIWfn>(const SQuantOp &, const FullCIWfn &,
+                                                      const Array<double>, const double,
+                                                      const double, const long, const long,
+                                                      const std::string &, const double, const long,
+                                                      const long, const ulong);
 
-template double py_compute_enpt2<GenCIWfn>(const SQuantOp &, const GenCIWfn &, const Array<double>,
-                                           const double, const double, const long);
+template pybind11::object py_compute_enpt2<GenCIWfn>(const SQuantOp &, const GenCIWfn &,
+                                                     const Array<double>, const double,
+                                                     const double, const long, const long,
+                                                     const std::string &, const double, const long,
+                                                     const long, const ulong);
 
 } // namespace pyci
@@ -192,12 +192,22 @@ void Objective<Wfn>::jacobian(const SparseOp &op, const double *x, double *y)
            d(<n|H|\Psi>)/d(p_k) = <m|H|n> d(c_m)/d(p_k)
 
            E d(<n|\Psi>)/d(p_k) = E \delta_{nk} d(c_n)/d(p_k)
+
+       All columns are computed by one pass over the operator, which
+       expects row-major blocks of vectors.
     */
+    std::vector<double> x_block(nconn * nparam);
+    std::vector<double> y_block(nproj * nparam);
+    for (std::size_t i = 0, j; i != nparam; ++i) {
+        for (j = 0; j != nconn; ++j) {
+            x_block[nparam * j + i] = d_ovlp[nconn * i + j];
+        }
+    }
+    op.perform_op_block(nparam, &x_block[0], &y_block[0]);
     double *d_ovlp_col = &d_ovlp[0];
     for (std::size_t i = 0, j; i != nparam; ++i) {
-        op.perform_op(d_ovlp_col, y);
         for (j = 0; j != nproj; ++j) {
-            y[j] -= e * d_ovlp_col[j];
+            y[j] = y_block[nparam * j + i] - e * d_ovlp_col[j];
         }
         d_ovlp_col += nconn;
         y += nproj + n_detcons + n_paramcons;
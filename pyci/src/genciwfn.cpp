@@ -20,7 +20,7 @@ namespace pyci {
 GenCIWfn::GenCIWfn(const GenCIWfn &wfn) : OneSpinWfn(wfn) {
 }
 
-GenCIWfn::GenCIWfn(GenCIWfn &&wfn) noexcept : OneSpinWfn(wfn) {
+GenCIWfn::GenCIWfn(GenCIWfn &&wfn) : OneSpinWfn(wfn) {
 }
 
 GenCIWfn::GenCIWfn(const DOCIWfn &wfn) : GenCIWfn(FullCIWfn(wfn)) {
@@ -38,9 +38,9 @@ GenCIWfn::GenCIWfn(const FullCIWfn &wfn) : OneSpinWfn(wfn.nbasis * 2, wfn.nocc,
         for (j = 0; j < wfn.nocc_dn; ++j)
             occs_dn[j] += wfn.nbasis;
         fill_det(wfn.nocc, occs_up, &dets[k]);
-        dict[rank_det(&dets[k])] = i;
         k += wfn.nword2;
     }
+    hash_dets();
 }
 
 GenCIWfn::GenCIWfn(const std::string &filename) : OneSpinWfn(filename) {
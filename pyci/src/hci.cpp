@@ -19,49 +19,70 @@ namespace pyci {
 
 namespace {
 
+template<long NW>
 void hci_thread_add_dets(const SQuantOp &ham, const DOCIWfn &wfn, DOCIWfn &t_wfn, const double *coeffs,
-                         const double eps, const long idet, ulong *det, long *occs, long *virs) {
-    Hash rank;
+                         const double eps, const double cutoff, const long idet, ulong *det,
+                         long *occs, long *) {
     // fill working vectors
     wfn.copy_det(idet, det);
-    fill_occs(wfn.nword, det, occs);
-    fill_virs(wfn.nword, wfn.nbasis, det, virs);
-    // single/"pair"-excited elements elements
+    fill_occs<NW>(wfn.nword, det, occs);
+    Hash rank_r = wfn.rank_det(det);
+    // the determinants that pass the threshold are looked up in batches, and added to t_wfn with
+    // their full rank if they are not in wfn
+    DetBatch<DOCIWfn, long> batch(wfn, true);
+    auto add_det = [&](const long jdet, const ulong *jdet_ptr, const Hash &rank, const long) {
+        if (jdet == -1)
+            t_wfn.add_det_with_rank(jdet_ptr, rank);
+    };
+    // single/"pair"-excited elements, in order of decreasing |H| until |H*c| <= eps
+    const HeatBath &hb = ham.heatbath_pairs(cutoff);
+    double c = std::abs(coeffs[idet]);
     for (long i = 0, k; i < wfn.nocc_up; ++i) {
         k = occs[i];
-        for (long j = 0, l; j < wfn.nvir_up; ++j) {
-            l = virs[j];
+        for (long e = hb.ptr[k], l; e < hb.ptr[k + 1]; ++e) {
+            // the rest of the couplings are below the threshold
+            if (hb.val[e] * c <= eps)
+                break;
+            l = hb.ind[e];
+            if (testbit_det(l, det))
+                continue;
+            // add determinant if not already in wfn
             excite_det(k, l, det);
-            // add determinant if |H*c| > eps and not already in wfn
-            if (std::abs(ham.v[k * wfn.nbasis + l] * coeffs[idet]) > eps) {
-                rank = wfn.rank_det(det);
-                if (wfn.index_det_from_rank(rank) == -1)
-                    t_wfn.add_det_with_rank(det, rank);
-            }
+            batch.push(det, wfn.excite_rank(rank_r, k, l), 0, add_det);
             excite_det(l, k, det);
         }
     }
+    batch.resolve(add_det);
 }
 
+template<long NW>
 void hci_thread_add_dets(const SQuantOp &ham, const FullCIWfn &wfn, FullCIWfn &t_wfn,
-                         const double *coeffs, const double eps, const long idet, ulong *det_up,
-                         long *occs_up, long *virs_up) {
-    long i, j, k, l, ii, jj, kk, ll, ioffset, koffset;
-    Hash rank;
+                         const double *coeffs, const double eps, const double cutoff,
+                         const long idet, ulong *det_up, long *occs_up, long *virs_up) {
+    long i, j, k, ii, jj, kk, rr, ss, ioffset, koffset;
+    Hash rank_i;
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
     long n3 = n1 * n2;
-    double val;
+    double val, c = std::abs(coeffs[idet]);
     const ulong *rdet_up = wfn.det_ptr(idet);
     const ulong *rdet_dn = rdet_up + wfn.nword;
     ulong *det_dn = det_up + wfn.nword;
     long *occs_dn = occs_up + wfn.nocc_up;
     long *virs_dn = virs_up + wfn.nvir_up;
     std::memcpy(det_up, rdet_up, sizeof(ulong) * wfn.nword2);
-    fill_occs(wfn.nword, rdet_up, occs_up);
-    fill_occs(wfn.nword, rdet_dn, occs_dn);
-    fill_virs(wfn.nword, wfn.nbasis, rdet_up, virs_up);
-    fill_virs(wfn.nword, wfn.nbasis, rdet_dn, virs_dn);
+    fill_occs<NW>(wfn.nword, rdet_up, occs_up);
+    fill_occs<NW>(wfn.nword, rdet_dn, occs_dn);
+    fill_virs<NW>(wfn.nword, wfn.nbasis, rdet_up, virs_up);
+    fill_virs<NW>(wfn.nword, wfn.nbasis, rdet_dn, virs_dn);
+    Hash rank_r = wfn.rank_det(rdet_up);
+    // the determinants that pass the threshold are looked up in batches, and added to t_wfn with
+    // their full rank if they are not in wfn
+    DetBatch<FullCIWfn, long> batch(wfn, true);
+    auto add_det = [&](const long jdet, const ulong *jdet_ptr, const Hash &rank, const long) {
+        if (jdet == -1)
+            t_wfn.add_det_with_rank(jdet_ptr, rank);
+    };
     // loop over spin-up occupied indices
     for (i = 0; i < wfn.nocc_up; ++i) {
         ii = occs_up[i];
@@ -70,7 +91,6 @@ void hci_thread_add_dets(const SQuantOp &ham, const FullCIWfn &wfn, FullCIWfn &t
         for (j = 0; j < wfn.nvir_up; ++j) {
             jj = virs_up[j];
             // 1-0 excitation elements
-            excite_det(ii, jj, det_up);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc_up; ++k) {
                 kk = occs_up[k];
@@ -83,49 +103,10 @@ void hci_thread_add_dets(const SQuantOp &ham, const FullCIWfn &wfn, FullCIWfn &t
             }
             // add determinant if |H*c| > eps and not already in wfn
             if (std::abs(val * coeffs[idet]) > eps) {
-                rank = wfn.rank_det(det_up);
-                if (wfn.index_det_from_rank(rank) == -1)
-                    t_wfn.add_det_with_rank(det_up, rank);
-            }
-            // loop over spin-down occupied indices
-            for (k = 0; k < wfn.nocc_dn; ++k) {
-                kk = occs_dn[k];
-                koffset = ioffset + n2 * kk;
-                // loop over spin-down virtual indices
-                for (l = 0; l < wfn.nvir_dn; ++l) {
-                    ll = virs_dn[l];
-                    // 1-1 excitation elements
-                    excite_det(kk, ll, det_dn);
-                    val = ham.two_mo[koffset + n1 * jj + ll];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val * coeffs[idet]) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1)
-                            t_wfn.add_det_with_rank(det_up, rank);
-                    }
-                    excite_det(ll, kk, det_dn);
-                }
-            }
-            // loop over spin-up occupied indices
-            for (k = i + 1; k < wfn.nocc_up; ++k) {
-                kk = occs_up[k];
-                koffset = ioffset + n2 * kk;
-                // loop over spin-up virtual indices
-                for (l = j + 1; l < wfn.nvir_up; ++l) {
-                    ll = virs_up[l];
-                    // 2-0 excitation elements
-                    excite_det(kk, ll, det_up);
-                    val = ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val * coeffs[idet]) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1)
-                            t_wfn.add_det_with_rank(det_up, rank);
-                    }
-                    excite_det(ll, kk, det_up);
-                }
+                excite_det(ii, jj, det_up);
+                batch.push(det_up, wfn.excite_rank(rank_r, ii, jj), 0, add_det);
+                excite_det(jj, ii, det_up);
             }
-            excite_det(jj, ii, det_up);
         }
     }
     // loop over spin-down occupied indices
@@ -136,7 +117,6 @@ void hci_thread_add_dets(const SQuantOp &ham, const FullCIWfn &wfn, FullCIWfn &t
         for (j = 0; j < wfn.nvir_dn; ++j) {
             jj = virs_dn[j];
             // 0-1 excitation elements
-            excite_det(ii, jj, det_dn);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc_up; ++k) {
                 kk = occs_up[k];
@@ -149,53 +129,99 @@ void hci_thread_add_dets(const SQuantOp &ham, const FullCIWfn &wfn, FullCIWfn &t
             }
             // add determinant if |H*c| > eps and not already in wfn
             if (std::abs(val * coeffs[idet]) > eps) {
-                rank = wfn.rank_det(det_up);
-                if (wfn.index_det_from_rank(rank) == -1)
-                    t_wfn.add_det_with_rank(det_up, rank);
+                excite_det(ii, jj, det_dn);
+                batch.push(det_up, wfn.excite_rank(rank_r, n1 + ii, n1 + jj), 0, add_det);
+                excite_det(jj, ii, det_dn);
             }
-            // loop over spin-down occupied indices
-            for (k = i + 1; k < wfn.nocc_dn; ++k) {
-                kk = occs_dn[k];
-                koffset = ioffset + n2 * kk;
-                // loop over spin-down virtual indices
-                for (l = j + 1; l < wfn.nvir_dn; ++l) {
-                    ll = virs_dn[l];
-                    // 0-2 excitation elements
-                    excite_det(kk, ll, det_dn);
-                    val = ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val * coeffs[idet]) > eps) {
-                        rank = wfn.rank_det(det_up);
-                        if (wfn.index_det_from_rank(rank) == -1)
-                            t_wfn.add_det_with_rank(det_up, rank);
-                    }
-                    excite_det(ll, kk, det_dn);
+        }
+    }
+    // double excitations, in order of decreasing |H| until |H*c| <= eps
+    const HeatBath &hb_same = ham.heatbath_same(cutoff);
+    const HeatBath &hb_opposite = ham.heatbath_opposite(cutoff);
+    long key;
+    // 1-1 excitation elements
+    for (i = 0; i < wfn.nocc_up; ++i) {
+        ii = occs_up[i];
+        for (k = 0; k < wfn.nocc_dn; ++k) {
+            kk = occs_dn[k];
+            key = ii * n1 + kk;
+            for (long e = hb_opposite.ptr[key]; e < hb_opposite.ptr[key + 1]; ++e) {
+                // the rest of the couplings are below the threshold
+                if (hb_opposite.val[e] * c <= eps)
+                    break;
+                rr = hb_opposite.ind[e] / n1;
+                ss = hb_opposite.ind[e] % n1;
+                if (testbit_det(rr, rdet_up) || testbit_det(ss, rdet_dn))
+                    continue;
+                excite_det(ii, rr, det_up);
+                excite_det(kk, ss, det_dn);
+                rank_i = wfn.excite_rank(rank_r, ii, rr);
+                batch.push(det_up, wfn.excite_rank(rank_i, n1 + kk, n1 + ss), 0, add_det);
+                excite_det(ss, kk, det_dn);
+                excite_det(rr, ii, det_up);
+            }
+        }
+    }
+    // 2-0 and 0-2 excitation elements
+    for (long spin = 0; spin < 2; ++spin) {
+        const ulong *rdet = spin ? rdet_dn : rdet_up;
+        ulong *det = spin ? det_dn : det_up;
+        const long *occs = spin ? occs_dn : occs_up;
+        long nocc = spin ? wfn.nocc_dn : wfn.nocc_up, offset = spin ? n1 : 0;
+        for (i = 0; i < nocc; ++i) {
+            ii = occs[i];
+            for (k = i + 1; k < nocc; ++k) {
+                kk = occs[k];
+                key = HeatBath::pair_key(n1, ii, kk);
+                for (long e = hb_same.ptr[key]; e < hb_same.ptr[key + 1]; ++e) {
+                    // the rest of the couplings are below the threshold
+                    if (hb_same.val[e] * c <= eps)
+                        break;
+                    rr = hb_same.ind[e] / n1;
+                    ss = hb_same.ind[e] % n1;
+                    if (testbit_det(rr, rdet) || testbit_det(ss, rdet))
+                        continue;
+                    excite_det(ii, rr, det);
+                    excite_det(kk, ss, det);
+                    rank_i = wfn.excite_rank(rank_r, offset + ii, offset + rr);
+                    batch.push(det_up, wfn.excite_rank(rank_i, offset + kk, offset + ss), 0,
+                               add_det);
+                    excite_det(ss, kk, det);
+                    excite_det(rr, ii, det);
                 }
             }
-            excite_det(jj, ii, det_dn);
         }
     }
+    batch.resolve(add_det);
 }
 
+template<long NW>
 void hci_thread_add_dets(const SQuantOp &ham, const GenCIWfn &wfn, GenCIWfn &t_wfn, const double *coeffs,
-                         const double eps, const long idet, ulong *det, long *occs, long *virs) {
-    Hash rank;
+                         const double eps, const double cutoff, const long idet, ulong *det,
+                         long *occs, long *virs) {
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
     long n3 = n1 * n2;
-    double val;
+    double val, c = std::abs(coeffs[idet]);
     wfn.copy_det(idet, det);
-    fill_occs(wfn.nword, det, occs);
-    fill_virs(wfn.nword, wfn.nbasis, det, virs);
+    fill_occs<NW>(wfn.nword, det, occs);
+    fill_virs<NW>(wfn.nword, wfn.nbasis, det, virs);
+    Hash rank_i, rank_r = wfn.rank_det(det);
+    // the determinants that pass the threshold are looked up in batches, and added to t_wfn with
+    // their full rank if they are not in wfn
+    DetBatch<GenCIWfn, long> batch(wfn, true);
+    auto add_det = [&](const long jdet, const ulong *jdet_ptr, const Hash &rank, const long) {
+        if (jdet == -1)
+            t_wfn.add_det_with_rank(jdet_ptr, rank);
+    };
     // loop over occupied indices
     for (long i = 0, ii, ioffset, koffset; i < wfn.nocc; ++i) {
         ii = occs[i];
         ioffset = n3 * ii;
         // loop over virtual indices
-        for (long j = 0, jj, k, kk; j < wfn.nvir; ++j) {
+        for (long j = 0, jj, k, kk; j < wfn.nvir_up; ++j) {
             jj = virs[j];
             // single excitation elements
-            excite_det(ii, jj, det);
             val = ham.one_mo[n1 * ii + jj];
             for (k = 0; k < wfn.nocc; ++k) {
                 kk = occs[k];
@@ -204,48 +230,69 @@ void hci_thread_add_dets(const SQuantOp &ham, const GenCIWfn &wfn, GenCIWfn &t_w
             }
             // add determinant if |H*c| > eps and not already in wfn
             if (std::abs(val * coeffs[idet]) > eps) {
-                rank = wfn.rank_det(det);
-                if (wfn.index_det_from_rank(rank) == -1)
-                    t_wfn.add_det_with_rank(det, rank);
+                excite_det(ii, jj, det);
+                batch.push(det, wfn.excite_rank(rank_r, ii, jj), 0, add_det);
+                excite_det(jj, ii, det);
             }
-            // loop over occupied indices
-            for (k = i + 1; k < wfn.nocc; ++k) {
-                kk = occs[k];
-                koffset = ioffset + n2 * kk;
-                // loop over virtual indices
-                for (long l = j + 1, ll; l < wfn.nvir; ++l) {
-                    ll = virs[l];
-                    // double excitation elements
-                    excite_det(kk, ll, det);
-                    val = ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj];
-                    // add determinant if |H*c| > eps and not already in wfn
-                    if (std::abs(val * coeffs[idet]) > eps) {
-                        rank = wfn.rank_det(det);
-                        if (wfn.index_det_from_rank(rank) == -1)
-                            t_wfn.add_det_with_rank(det, rank);
-                    }
-                    excite_det(ll, kk, det);
-                }
+        }
+    }
+    // double excitation elements, in order of decreasing |H| until |H*c| <= eps
+    const HeatBath &hb = ham.heatbath_same(cutoff);
+    for (long i = 0, ii; i < wfn.nocc; ++i) {
+        ii = occs[i];
+        for (long k = i + 1, kk, key; k < wfn.nocc; ++k) {
+            kk = occs[k];
+            key = HeatBath::pair_key(n1, ii, kk);
+            for (long e = hb.ptr[key], rr, ss; e < hb.ptr[key + 1]; ++e) {
+                // the rest of the couplings are below the threshold
+                if (hb.val[e] * c <= eps)
+                    break;
+                rr = hb.ind[e] / n1;
+                ss = hb.ind[e] % n1;
+                if (testbit_det(rr, det) || testbit_det(ss, det))
+                    continue;
+                excite_det(ii, rr, det);
+                excite_det(kk, ss, det);
+                rank_i = wfn.excite_rank(rank_r, ii, rr);
+                batch.push(det, wfn.excite_rank(rank_i, kk, ss), 0, add_det);
+                excite_det(ss, kk, det);
+                excite_det(rr, ii, det);
             }
-            excite_det(jj, ii, det);
         }
     }
+    batch.resolve(add_det);
 }
 
-template<class WfnType>
+void hci_heatbath(const SQuantOp &ham, const DOCIWfn &, const double cutoff) {
+    ham.heatbath_pairs(cutoff);
+}
+
+void hci_heatbath(const SQuantOp &ham, const FullCIWfn &, const double cutoff) {
+    ham.heatbath_same(cutoff);
+    ham.heatbath_opposite(cutoff);
+}
+
+void hci_heatbath(const SQuantOp &ham, const GenCIWfn &, const double cutoff) {
+    ham.heatbath_same(cutoff);
+}
+
+template<class WfnType, long NW>
 void hci_thread(const SQuantOp &ham, const WfnType &wfn, WfnType &t_wfn, const double *coeffs,
-                const double eps, const long start, const long end) {
-    AlignedVector<ulong> det(wfn.nword2);
-    AlignedVector<long> occs(wfn.nocc);
-    AlignedVector<long> virs(wfn.nvir);
+                const double eps, const double cutoff, const long start, const long end) {
+    ulong *det = thread_scratch<ulong, 0>(wfn.nword2);
+    long *occs = thread_scratch<long, 0>(wfn.nocc);
+    long *virs = thread_scratch<long, 1>(wfn.nvir);
     for (long i = start; i < end; ++i)
-        hci_thread_add_dets(ham, wfn, t_wfn, coeffs, eps, i, &det[0], &occs[0], &virs[0]);
+        hci_thread_add_dets<NW>(ham, wfn, t_wfn, coeffs, eps, cutoff, i, det, occs, virs);
 };
 
 } // namespace
 
 template<class WfnType>
 long add_hci(const SQuantOp &ham, WfnType &wfn, const double *coeffs, const double eps, long nthread) {
+    // a complete wfn already contains every determinant
+    if (wfn.complete)
+        return 0;
     long ndet_old = wfn.ndet;
     if (nthread == -1)
         nthread = get_num_threads();
@@ -255,22 +302,38 @@ long add_hci(const SQuantOp &ham, WfnType &wfn, const double *coeffs, const doub
         nthread /= 2;
         chunksize = ndet_old / nthread + static_cast<bool>(ndet_old % nthread);
     }
-    Vector<std::thread> v_threads;
-    Vector<WfnType> v_wfns;
-    v_threads.reserve(nthread);
-    v_wfns.reserve(nthread);
-    for (long i = 0; i < nthread; ++i) {
-        long start = end_chunk_idx(i, nthread, ndet_old);
-        long end = end_chunk_idx(i + 1, nthread, ndet_old);
-        end = std::min(end, ndet_old);
-        v_wfns.emplace_back(wfn.nbasis, wfn.nocc_up, wfn.nocc_dn);
-        v_threads.emplace_back(&hci_thread<WfnType>, std::ref(ham), std::ref(wfn),
-                               std::ref(v_wfns.back()), coeffs, eps, start, end);
-    }
-    long n = 0;
-    for (auto &thread : v_threads) {
-        thread.join();
-        wfn.add_dets_from_wfn(v_wfns[n++]);
+    // the heat-bath tables are built on first use, so build them before the threads read them; a
+    // coupling at most eps / max|c| never passes the screen, and normalized coefficients share
+    // the tables for eps
+    double cmax = 1.0;
+    for (long i = 0; i < ndet_old; ++i)
+        cmax = std::max(cmax, std::abs(coeffs[i]));
+    double cutoff = eps / cmax;
+    hci_heatbath(ham, wfn, cutoff);
+    auto thread_fn = select_nword(wfn.nword, &hci_thread<WfnType, 1>, &hci_thread<WfnType, 2>,
+                                  &hci_thread<WfnType, 4>, &hci_thread<WfnType, 0>);
+    // the work per determinant varies with its seniority and coefficient, so the determinants are
+    // scheduled dynamically; the determinants found by each chunk are kept by chunk, so that they
+    // are added in the same order whatever the number of threads and the order the chunks ran in
+    long stride = std::is_base_of<TwoSpinWfn, WfnType>::value ? wfn.nword2 : wfn.nword;
+    long nchunk = ndet_old / PYCI_CHUNKSIZE_DYNAMIC +
+                  static_cast<bool>(ndet_old % PYCI_CHUNKSIZE_DYNAMIC);
+    Vector<AlignedVector<ulong>> v_dets(nchunk);
+    parallel_for(nthread, ndet_old, PYCI_CHUNKSIZE_DYNAMIC,
+                 [&](const long, const long start, const long end) {
+                     WfnType t_wfn(wfn.nbasis, wfn.nocc_up, wfn.nocc_dn);
+                     t_wfn.set_zobrist(wfn.zobrist);
+                     thread_fn(ham, wfn, t_wfn, coeffs, eps, cutoff, start, end);
+                     AlignedVector<ulong> &dets = v_dets[start / PYCI_CHUNKSIZE_DYNAMIC];
+                     dets.resize(t_wfn.ndet * stride);
+                     if (t_wfn.ndet)
+                         t_wfn.to_det_array(0, t_wfn.ndet, &dets[0]);
+                 });
+    // wfn is read by every task, so it can only be extended once they have all finished
+    for (auto &dets : v_dets) {
+        for (std::size_t i = 0; i < dets.size(); i += stride)
+            wfn.add_det(&dets[i]);
+        AlignedVector<ulong>().swap(dets);
     }
     return wfn.ndet - ndet_old;
 }
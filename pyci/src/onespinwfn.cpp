@@ -20,7 +20,7 @@ namespace pyci {
 OneSpinWfn::OneSpinWfn(const OneSpinWfn &wfn) : Wfn(wfn) {
 }
 
-OneSpinWfn::OneSpinWfn(OneSpinWfn &&wfn) noexcept : Wfn(wfn) {
+OneSpinWfn::OneSpinWfn(OneSpinWfn &&wfn) : Wfn(wfn) {
 }
 
 OneSpinWfn::OneSpinWfn(const std::string &filename) {
@@ -44,9 +44,7 @@ OneSpinWfn::OneSpinWfn(const std::string &filename) {
         throw std::ios_base::failure("error in file");
     Wfn::init(nb, nu, nd);
     ndet = n;
-    dict.reserve(n);
-    for (long i = 0; i < ndet; ++i)
-        dict[rank_det(&dets[nword * i])] = i;
+    hash_dets();
 }
 
 OneSpinWfn::OneSpinWfn(const long nb, const long nu, const long nd) : Wfn(nb, nu, nd) {
@@ -57,8 +55,7 @@ OneSpinWfn::OneSpinWfn(const long nb, const long nu, const long nd, const long n
     ndet = n;
     dets.resize(n * nword);
     std::memcpy(&dets[0], ptr, sizeof(ulong) * n * nword);
-    for (long i = 0; i < n; ++i)
-        dict[rank_det(ptr + i * nword)] = i;
+    hash_dets();
 }
 
 OneSpinWfn::OneSpinWfn(const long nb, const long nu, const long nd, const long n, const long *ptr)
@@ -71,8 +68,7 @@ OneSpinWfn::OneSpinWfn(const long nb, const long nu, const long nd, const long n
         j += nu;
         k += nword;
     }
-    for (long i = 0; i < n; ++i)
-        dict[rank_det(&dets[i * nword])] = i;
+    hash_dets();
 }
 
 OneSpinWfn::OneSpinWfn(const long nb, const long nu, const long nd, const Array<ulong> array)
@@ -121,13 +117,60 @@ void OneSpinWfn::to_occ_array(const long low, const long high, long *ptr) const
 }
 
 long OneSpinWfn::index_det(const ulong *det) const {
-    const auto &search = dict.find(rank_det(det));
-    return (search == dict.end()) ? -1 : search->second;
+    if (complete)
+        return rank_complete(nocc_up, det);
+    else if (addressed) {
+        long e, rank = rank_excited(nocc_up, 0, det, e);
+        return (rank == -1 || offsets[e] == -1) ? -1 : offsets[e] + rank;
+    }
+    return find_det(det, rank_det(det));
+}
+
+long OneSpinWfn::index_det(const ulong *det, Hash &rank) const {
+    // a Zobrist rank is given on input; any other rank is only needed (and only computed for
+    // direct indexing) if det is not found
+    if (complete || addressed) {
+        long idet = index_det(det);
+        if (idet == -1 && !zobrist)
+            rank = rank_det(det);
+        return idet;
+    } else if (!zobrist)
+        rank = rank_det(det);
+    return find_det(det, rank);
+}
+
+long OneSpinWfn::index_excited(const ulong *det, const Hash rank) const {
+    // rank is the Zobrist rank of det from excite_rank, and is unused otherwise
+    if (complete || addressed)
+        return index_det(det);
+    return find_det(det, zobrist ? rank : rank_det(det));
 }
 
 long OneSpinWfn::index_det_from_rank(const Hash rank) const {
+    if (complete || addressed)
+        throw std::runtime_error("wavefunction is not indexed by hash rank");
+    else if (bloom && !test_filter(rank))
+        return -1;
     const auto &search = dict.find(rank);
-    return (search == dict.end()) ? -1 : search->second;
+    return (search == dict.end()) ? -1 : *search;
+}
+
+long OneSpinWfn::index_det_with_rank(const ulong *det, const Hash rank) const {
+    // rank is the full rank of det, e.g. from prefetch_det
+    if (complete || addressed)
+        return index_det(det);
+    return find_det(det, rank);
+}
+
+Hash OneSpinWfn::prefetch_det(const ulong *det, const Hash rank) const {
+    // complete the rank of det as in index_excited, and fetch its bucket of the hash index
+    Hash full = zobrist ? rank : rank_det(det);
+    if (!(complete || addressed)) {
+        if (bloom && !filter.empty())
+            __builtin_prefetch(&filter[filter_pos(full)]);
+        dict.prefetch(full);
+    }
+    return full;
 }
 
 void OneSpinWfn::copy_det(const long i, ulong *det) const {
@@ -135,25 +178,15 @@ void OneSpinWfn::copy_det(const long i, ulong *det) const {
 }
 
 Hash OneSpinWfn::rank_det(const ulong *det) const {
-    return spookyhash(nword, det);
+    return zobrist ? rank_zobrist(1, det) : spookyhash(nword, det);
 }
 
 long OneSpinWfn::add_det(const ulong *det) {
-    if (dict.insert(std::make_pair(rank_det(det), ndet)).second) {
-        dets.resize(dets.size() + nword);
-        std::memcpy(&dets[nword * ndet], det, sizeof(ulong) * nword);
-        return ndet++;
-    }
-    return -1;
+    return insert_det(det, rank_det(det));
 }
 
 long OneSpinWfn::add_det_with_rank(const ulong *det, const Hash rank) {
-    if (dict.insert(std::make_pair(rank, ndet)).second) {
-        dets.resize(dets.size() + nword);
-        std::memcpy(&dets[nword * ndet], det, sizeof(ulong) * nword);
-        return ndet++;
-    }
-    return -1;
+    return insert_det(det, rank);
 }
 
 long OneSpinWfn::add_det_from_occs(const long *occs) {
@@ -199,25 +232,30 @@ void OneSpinWfn::add_all_dets(long nthread) {
     ndet = maxrank_up;
     std::fill(dets.begin(), dets.end(), 0UL);
     dets.resize(ndet * nword);
-    dict.clear();
-    dict.reserve(ndet);
-    Vector<std::thread> v_threads;
-    v_threads.reserve(nthread);
-    for (long i = 0; i < nthread; ++i) {
+    parallel_run(nthread, [&](const long i) {
         long start = end_chunk_idx(i, nthread, maxrank_up);
         long end = end_chunk_idx(i + 1, nthread, maxrank_up);
-        end = std::min(end, maxrank_up);
-        v_threads.emplace_back(onespinwfn_add_all_dets_thread, nword, nbasis, nocc_up, &dets[0],
-                               start, end);
-    }
-    for (auto &thread : v_threads)
-        thread.join();
-    for (long i = 0; i < ndet; ++i)
-        dict[rank_det(&dets[i * nword])] = i;
+        onespinwfn_add_all_dets_thread(nword, nbasis, nocc_up, &dets[0], start,
+                                       std::min(end, maxrank_up));
+    });
+    set_complete();
 }
 
 void OneSpinWfn::add_excited_dets(const ulong *rdet, const long e) {
     long i, j, k, no = binomial(nocc_up, e), nv = binomial(nvir_up, e);
+    if (complete || !(no && nv))
+        return;
+    // whole excitation blocks of the same reference are appended without hashing
+    if (!ndet && !addressed)
+        set_addressed(rdet, nword, nocc_up + 1);
+    bool direct = addressed && !std::memcmp(rdet, &ref[0], sizeof(ulong) * nword);
+    if (direct) {
+        if (offsets[e] != -1)
+            return;
+        offsets[e] = ndet;
+        dets.resize((ndet + no * nv) * nword);
+    } else if (addressed)
+        hash_dets();
     AlignedVector<ulong> det(nword);
     AlignedVector<long> occs(nocc_up);
     AlignedVector<long> virs(nvir_up);
@@ -236,7 +274,10 @@ void OneSpinWfn::add_excited_dets(const ulong *rdet, const long e) {
             std::memcpy(&det[0], rdet, sizeof(ulong) * nword);
             for (k = 0; k < e; ++k)
                 excite_det(occs[occinds[k]], virs[virinds[k]], &det[0]);
-            add_det(&det[0]);
+            if (direct)
+                std::memcpy(&dets[nword * ndet++], &det[0], sizeof(ulong) * nword);
+            else
+                add_det(&det[0]);
             next_colex(&occinds[0]);
         }
         next_colex(&virinds[0]);
@@ -244,13 +285,51 @@ void OneSpinWfn::add_excited_dets(const ulong *rdet, const long e) {
 }
 
 void OneSpinWfn::add_dets_from_wfn(const OneSpinWfn &wfn) {
-    for (const auto &keyval : wfn.dict)
-        add_det_with_rank(&wfn.dets[keyval.second * nword], keyval.first);
+    if (complete)
+        return;
+    for (long i = 0; i < wfn.ndet; ++i)
+        add_det(&wfn.dets[i * nword]);
 }
 
 void OneSpinWfn::reserve(const long n) {
     dets.reserve(n * nword);
-    dict.reserve(n);
+    if (!complete && !addressed)
+        dict.reserve(n);
+}
+
+void OneSpinWfn::set_zobrist(const bool z) {
+    if (z == zobrist)
+        return;
+    zobrist = z;
+    if (zobrist && zkeys.empty())
+        set_zkeys();
+    if (complete || addressed)
+        return;
+    clear_index();
+    hash_dets();
+}
+
+long OneSpinWfn::insert_det(const ulong *det, const Hash rank) {
+    if (complete)
+        return -1;
+    else if (addressed) {
+        if (index_det(det) != -1)
+            return -1;
+        hash_dets();
+    }
+    // the index entry is only made if det is new, before det is appended to dets
+    bool added = false;
+    dict.lazy_emplace(DetKey{det, rank}, [&](const DetIndex::constructor &ctor) {
+        ctor(ndet);
+        added = true;
+    });
+    if (!added)
+        return -1;
+    dets.resize(dets.size() + nword);
+    std::memcpy(&dets[nword * ndet], det, sizeof(ulong) * nword);
+    if (bloom)
+        add_filter(rank);
+    return ndet++;
 }
 
 Array<ulong> OneSpinWfn::py_getitem(const long index) const {
@@ -39,19 +39,15 @@ double compute_overlap(const WfnType &wfn1, const WfnType &wfn2, const double *c
     if (wfn1.ndet > wfn2.ndet)
         return compute_overlap<WfnType>(wfn2, wfn1, coeffs2, coeffs1);
     long nthread = get_num_threads();
-    Vector<std::future<double>> v_threads;
-    v_threads.reserve(nthread);
-    for (long i = 0, start, end; i < nthread; ++i) {
-        start = end_chunk_idx(i, nthread, wfn1.ndet);
-        end = end_chunk_idx(i + 1, nthread, wfn1.ndet);
-        end = std::min(end, wfn1.ndet);
-        v_threads.push_back(std::async(std::launch::async, &compute_overlap_thread<WfnType>,
-                                       std::ref(wfn1), std::ref(wfn2), coeffs1, coeffs2, start,
-                                       end));
-    }
+    Vector<double> v_olps(nthread, 0.0);
+    parallel_for(nthread, wfn1.ndet, PYCI_CHUNKSIZE_DYNAMIC,
+                 [&](const long slot, const long start, const long end) {
+                     v_olps[slot] +=
+                         compute_overlap_thread<WfnType>(wfn1, wfn2, coeffs1, coeffs2, start, end);
+                 });
     double olp = 0.0;
-    for (auto &future : v_threads)
-        olp += future.get();
+    for (double v : v_olps)
+        olp += v;
     return olp;
 }
 
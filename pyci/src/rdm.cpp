@@ -17,21 +17,61 @@
 
 namespace pyci {
 
-void compute_rdms(const DOCIWfn &wfn, const double *coeffs, double *d0, double *d2) {
-    // prepare working vectors
-    AlignedVector<ulong> v_det(wfn.nword);
-    AlignedVector<long> v_occs(wfn.nocc_up);
-    AlignedVector<long> v_virs(wfn.nvir_up);
-    ulong *det = &v_det[0];
-    long *occs = &v_occs[0], *virs = &v_virs[0];
-    // fill rdms with zeros
-    long i = wfn.nbasis * wfn.nbasis, j = 0;
-    while (j < i) {
-        d0[j] = 0;
-        d2[j++] = 0;
+namespace {
+
+/* Compute the RDMs rdm1 and rdm2, of size1 and size2 elements, by running
+ * kernel(start, end, rdm1, rdm2) over the determinants [start, end) of the wave function on the
+ * threads. The first slot accumulates into rdm1 and rdm2, and the others into private copies that
+ * are summed into them at the end; the copies are limited to PYCI_RDM_BUFFER_MAX bytes. */
+
+template<class Kernel>
+void compute_rdms_parallel(const long ndet, const long size1, double *rdm1, const long size2,
+                           double *rdm2, const Kernel &kernel) {
+    long size = size1 + size2, nthread = get_num_threads();
+    long chunksize = ndet / nthread + static_cast<bool>(ndet % nthread);
+    while (nthread > 1 &&
+           (chunksize < PYCI_CHUNKSIZE_MIN ||
+            static_cast<double>(nthread - 1) * size * sizeof(double) > PYCI_RDM_BUFFER_MAX)) {
+        nthread /= 2;
+        chunksize = ndet / nthread + static_cast<bool>(ndet % nthread);
     }
+    std::fill(rdm1, rdm1 + size1, 0.0);
+    std::fill(rdm2, rdm2 + size2, 0.0);
+    Vector<AlignedVector<double>> v_rdms(nthread - 1);
+    parallel_for(nthread, ndet, PYCI_CHUNKSIZE_DYNAMIC,
+                 [&](const long slot, const long start, const long end) {
+                     if (!slot)
+                         return kernel(start, end, rdm1, rdm2);
+                     AlignedVector<double> &t_rdm = v_rdms[slot - 1];
+                     if (t_rdm.empty())
+                         t_rdm.assign(size, 0.0);
+                     kernel(start, end, &t_rdm[0], &t_rdm[size1]);
+                 });
+    if (nthread == 1)
+        return;
+    chunksize = size / nthread + static_cast<bool>(size % nthread);
+    parallel_run(nthread, [&](const long i) {
+        long start = std::min(i * chunksize, size), end = std::min(start + chunksize, size);
+        for (const auto &t_rdm : v_rdms) {
+            if (t_rdm.empty())
+                continue;
+            for (long k = start; k < std::min(end, size1); ++k)
+                rdm1[k] += t_rdm[k];
+            for (long k = std::max(start, size1); k < end; ++k)
+                rdm2[k - size1] += t_rdm[k];
+        }
+    });
+}
+
+void compute_rdms_doci(const DOCIWfn &wfn, const double *coeffs, double *d0, double *d2,
+                       const long start, const long end) {
+    // prepare working vectors
+    ulong *det = thread_scratch<ulong, 0>(wfn.nword);
+    long *occs = thread_scratch<long, 0>(wfn.nocc_up);
+    long *virs = thread_scratch<long, 1>(wfn.nvir_up);
+    long i, j;
     // iterate over determinants
-    for (long idet = 0, jdet, k, l; idet < wfn.ndet; ++idet) {
+    for (long idet = start, jdet, k, l; idet < end; ++idet) {
         double val1, val2;
         // fill working vectors
         wfn.copy_det(idet, det);
@@ -64,6 +104,16 @@ void compute_rdms(const DOCIWfn &wfn, const double *coeffs, double *d0, double *
     }
 }
 
+} // namespace
+
+void compute_rdms(const DOCIWfn &wfn, const double *coeffs, double *d0, double *d2) {
+    long n2 = wfn.nbasis * wfn.nbasis;
+    compute_rdms_parallel(wfn.ndet, n2, d0, n2, d2,
+                          [&](const long start, const long end, double *t_d0, double *t_d2) {
+                              compute_rdms_doci(wfn, coeffs, t_d0, t_d2, start, end);
+                          });
+}
+
 
 void compute_rdms_1234(const DOCIWfn &wfn, const double *coeffs, double *d0, double *d2, double *d3, double *d4) {
     // prepare working vectors
@@ -153,111 +203,243 @@ void compute_rdms_1234(const DOCIWfn &wfn, const double *coeffs, double *d0, dou
     }
 }
 
-void compute_rdms(const FullCIWfn &wfn, const double *coeffs, double *rdm1, double *rdm2) {
+namespace {
+
+/* FullCI 1- and 2-RDM contributions of a determinant and of a pair of connected determinants. */
+
+struct FullCIRDMs {
+    long n1, n2, n3;
+    double *aa, *bb, *aaaa, *bbbb, *abab;
+
+    void add_00(const FullCIWfn &wfn, const long *occs_up, const long *occs_dn,
+                const double val) const {
+        long i, k, ii, kk;
+        for (i = 0; i < wfn.nocc_up; ++i) {
+            ii = occs_up[i];
+            // aa(ii, ii) += val;
+            aa[(n1 + 1) * ii] += val;
+            for (k = i + 1; k < wfn.nocc_up; ++k) {
+                kk = occs_up[k];
+                // aaaa(ii, kk, ii, kk) += val;
+                aaaa[ii * n3 + kk * n2 + ii * n1 + kk] += val;
+                // aaaa(ii, kk, kk, ii) -= val;
+                aaaa[ii * n3 + kk * n2 + kk * n1 + ii] -= val;
+                // aaaa(kk, ii, ii, kk) -= val;
+                aaaa[kk * n3 + ii * n2 + ii * n1 + kk] -= val;
+                // aaaa(kk, ii, kk, ii) += val;
+                aaaa[kk * n3 + ii * n2 + kk * n1 + ii] += val;
+            }
+            for (k = 0; k < wfn.nocc_dn; ++k) {
+                kk = occs_dn[k];
+                // abab(ii, kk, ii, kk) += val;
+                abab[ii * n3 + kk * n2 + ii * n1 + kk] += val;
+            }
+        }
+        for (i = 0; i < wfn.nocc_dn; ++i) {
+            ii = occs_dn[i];
+            // bb(ii, ii) += val;
+            bb[(n1 + 1) * ii] += val;
+            for (k = i + 1; k < wfn.nocc_dn; ++k) {
+                kk = occs_dn[k];
+                // bbbb(ii, kk, ii, kk) += val;
+                bbbb[ii * n3 + kk * n2 + ii * n1 + kk] += val;
+                // bbbb(ii, kk, kk, ii) -= val;
+                bbbb[ii * n3 + kk * n2 + kk * n1 + ii] -= val;
+                // bbbb(kk, ii, ii, kk) -= val;
+                bbbb[kk * n3 + ii * n2 + ii * n1 + kk] -= val;
+                // bbbb(kk, ii, kk, ii) += val;
+                bbbb[kk * n3 + ii * n2 + kk * n1 + ii] += val;
+            }
+        }
+    }
+
+    void add_10(const FullCIWfn &wfn, const long *occs_up, const long *occs_dn, const long ii,
+                const long jj, const double val) const {
+        long k, kk;
+        // aa(ii, jj) += val;
+        aa[ii * n1 + jj] += val;
+        aa[jj * n1 + ii] += val;
+        for (k = 0; k < wfn.nocc_up; ++k) {
+            kk = occs_up[k];
+            if (kk != ii)
+                add_single_same(aaaa, ii, jj, kk, val);
+        }
+        for (k = 0; k < wfn.nocc_dn; ++k) {
+            kk = occs_dn[k];
+            // abab(ii, kk, jj, kk) += val;
+            abab[ii * n3 + kk * n2 + jj * n1 + kk] += val;
+            // abab(jj, kk, ii, kk) += val;
+            abab[n3 * jj + kk * n2 + ii * n1 + kk] += val;
+        }
+    }
+
+    void add_01(const FullCIWfn &wfn, const long *occs_up, const long *occs_dn, const long ii,
+                const long jj, const double val) const {
+        long k, kk;
+        // bb(ii, jj) += val;
+        bb[ii * n1 + jj] += val;
+        bb[jj * n1 + ii] += val;
+        for (k = 0; k < wfn.nocc_up; ++k) {
+            kk = occs_up[k];
+            // abab(kk, ii, kk, jj) += val;
+            abab[n3 * kk + n2 * ii + kk * n1 + jj] += val;
+            // abab(kk, jj, kk, ii) += val;
+            abab[n3 * kk + jj * n2 + kk * n1 + ii] += val;
+        }
+        for (k = 0; k < wfn.nocc_dn; ++k) {
+            kk = occs_dn[k];
+            if (kk != ii)
+                add_single_same(bbbb, ii, jj, kk, val);
+        }
+    }
+
+    void add_11(const long ii, const long kk, const long jj, const long ll,
+                const double val) const {
+        // abab(ii, kk, jj, ll) += val;
+        abab[ii * n3 + kk * n2 + jj * n1 + ll] += val;
+        // abab(jj, ll, ii, kk) += val;
+        abab[n3 * jj + n2 * ll + n1 * ii + kk] += val;
+    }
+
+    void add_single_same(double *rdm, const long ii, const long jj, const long kk,
+                         const double val) const {
+        // rdm(ii, kk, jj, kk) += val;
+        rdm[ii * n3 + kk * n2 + jj * n1 + kk] += val;
+        // rdm(ii, kk, kk, jj) -= val;
+        rdm[ii * n3 + kk * n2 + kk * n1 + jj] -= val;
+        // rdm(kk, ii, kk, jj) += val;
+        rdm[kk * n3 + ii * n2 + kk * n1 + jj] += val;
+        // rdm(kk, ii, jj, kk) -= val;
+        rdm[kk * n3 + ii * n2 + jj * n1 + kk] -= val;
+        // rdm(jj, kk, ii, kk) += val;
+        rdm[n3 * jj + n2 * kk + n1 * ii + kk] += val;
+        // rdm(jj, kk, kk, ii) -= val;
+        rdm[n3 * jj + n2 * kk + n1 * kk + ii] -= val;
+        // rdm(kk, jj, ii, kk) -= val;
+        rdm[n3 * kk + n2 * jj + n1 * ii + kk] -= val;
+        // rdm(kk, jj, kk, ii) += val;
+        rdm[n3 * kk + n2 * jj + n1 * kk + ii] += val;
+    }
+
+    void add_double_same(double *rdm, const long ii, const long kk, const long jj, const long ll,
+                         const double val) const {
+        // rdm(ii, kk, jj, ll) += val;
+        rdm[ii * n3 + kk * n2 + jj * n1 + ll] += val;
+        // rdm(ii, kk, ll, jj) -= val;
+        rdm[ii * n3 + kk * n2 + ll * n1 + jj] -= val;
+        // rdm(kk, ii, jj, ll) -= val;
+        rdm[n3 * kk + n2 * ii + n1 * jj + ll] -= val;
+        // rdm(kk, ii, ll, jj) += val;
+        rdm[n3 * kk + n2 * ii + n1 * ll + jj] += val;
+        // rdm(jj, ll, ii, kk) += val;
+        rdm[jj * n3 + ll * n2 + ii * n1 + kk] += val;
+        // rdm(jj, ll, kk, ii) -= val;
+        rdm[jj * n3 + ll * n2 + kk * n1 + ii] -= val;
+        // rdm(ll, jj, ii, kk) -= val;
+        rdm[n3 * ll + n2 * jj + n1 * ii + kk] -= val;
+        // rdm(ll, jj, kk, ii) += val;
+        rdm[n3 * ll + n2 * jj + n1 * kk + ii] += val;
+    }
+};
+
+template<long NW>
+void compute_rdms_connected(const FullCIWfn &wfn, const ConnectedDets &connected,
+                            const double *coeffs, double *rdm1, double *rdm2, const long start,
+                            const long end) {
+    long n1 = wfn.nbasis, n2 = n1 * n1, n4 = n2 * n2;
+    FullCIRDMs rdms{n1, n2, n1 * n2, rdm1, rdm1 + n2, rdm2, rdm2 + n4, rdm2 + 2 * n4};
+    // visit only the pairs of connected determinants in the wfn
+    long *occs_up = thread_scratch<long, 0>(wfn.nocc), *occs_dn = occs_up + wfn.nocc_up;
+    long *parity_up = thread_scratch<long, 2>(n1 * 2 + 2), *parity_dn = parity_up + n1 + 1;
+    long holes_up[2], parts_up[2], holes_dn[2], parts_dn[2], nexc_up, nexc_dn;
+    Vector<long> jdets;
+    for (long idet = start; idet < end; ++idet) {
+        const ulong *rdet_up = wfn.det_ptr(idet);
+        const ulong *rdet_dn = rdet_up + wfn.nword;
+        fill_occs<NW>(wfn.nword, rdet_up, occs_up);
+        fill_occs<NW>(wfn.nword, rdet_dn, occs_dn);
+        fill_parity<NW>(wfn.nword, wfn.nbasis, rdet_up, parity_up);
+        fill_parity<NW>(wfn.nword, wfn.nbasis, rdet_dn, parity_dn);
+        rdms.add_00(wfn, occs_up, occs_dn, coeffs[idet] * coeffs[idet]);
+        connected.fill_connected(wfn, idet, jdets);
+        for (long jdet : jdets) {
+            if (jdet <= idet)
+                continue;
+            const ulong *jdet_up = wfn.det_ptr(jdet);
+            nexc_up = diff_det(wfn.nword, rdet_up, jdet_up, holes_up, parts_up);
+            nexc_dn = diff_det(wfn.nword, rdet_dn, jdet_up + wfn.nword, holes_dn, parts_dn);
+            if (nexc_up == 1 && nexc_dn == 0)
+                rdms.add_10(wfn, occs_up, occs_dn, holes_up[0], parts_up[0],
+                            coeffs[idet] * coeffs[jdet] *
+                                phase_single_det(parity_up, holes_up[0], parts_up[0]));
+            else if (nexc_up == 0 && nexc_dn == 1)
+                rdms.add_01(wfn, occs_up, occs_dn, holes_dn[0], parts_dn[0],
+                            coeffs[idet] * coeffs[jdet] *
+                                phase_single_det(parity_dn, holes_dn[0], parts_dn[0]));
+            else if (nexc_up == 1)
+                rdms.add_11(holes_up[0], holes_dn[0], parts_up[0], parts_dn[0],
+                            coeffs[idet] * coeffs[jdet] *
+                                phase_single_det(parity_up, holes_up[0], parts_up[0]) *
+                                phase_single_det(parity_dn, holes_dn[0], parts_dn[0]));
+            else if (nexc_up == 2)
+                rdms.add_double_same(rdms.aaaa, holes_up[0], holes_up[1], parts_up[0],
+                                     parts_up[1],
+                                     coeffs[idet] * coeffs[jdet] *
+                                         phase_double_det(parity_up, holes_up[0], holes_up[1],
+                                                          parts_up[0], parts_up[1]));
+            else
+                rdms.add_double_same(rdms.bbbb, holes_dn[0], holes_dn[1], parts_dn[0],
+                                     parts_dn[1],
+                                     coeffs[idet] * coeffs[jdet] *
+                                         phase_double_det(parity_dn, holes_dn[0], holes_dn[1],
+                                                          parts_dn[0], parts_dn[1]));
+        }
+    }
+}
+
+template<long NW>
+void compute_rdms_fullci(const FullCIWfn &wfn, const double *coeffs, double *rdm1, double *rdm2,
+                         const long start, const long end) {
     long n1 = wfn.nbasis;
     long n2 = wfn.nbasis * wfn.nbasis;
     long n3 = n1 * n2;
     long n4 = n2 * n2;
-    double *aa = rdm1;
-    double *bb = aa + n2;
-    double *aaaa = rdm2;
-    double *bbbb = aaaa + n4;
-    double *abab = bbbb + n4;
+    FullCIRDMs rdms{n1, n2, n3, rdm1, rdm1 + n2, rdm2, rdm2 + n4, rdm2 + 2 * n4};
     // prepare working vectors
-    AlignedVector<ulong> v_det(wfn.nword2);
-    AlignedVector<long> v_occs(wfn.nocc);
-    AlignedVector<long> v_virs(wfn.nvir);
-    ulong *det_up = &v_det[0], *det_dn = &v_det[wfn.nword];
-    long *occs_up = &v_occs[0], *occs_dn = &v_occs[wfn.nocc_up];
-    long *virs_up = &v_virs[0], *virs_dn = &v_virs[wfn.nvir_up];
-    // fill rdms with zeros
-    long i = 2 * n2;
-    long j = 0;
-    while (j < i)
-        rdm1[j++] = 0;
-    i = 3 * n4;
-    j = 0;
-    while (j < i)
-        rdm2[j++] = 0;
+    ulong *det_up = thread_scratch<ulong, 0>(wfn.nword2), *det_dn = det_up + wfn.nword;
+    long *occs_up = thread_scratch<long, 0>(wfn.nocc), *occs_dn = occs_up + wfn.nocc_up;
+    long *virs_up = thread_scratch<long, 1>(wfn.nvir), *virs_dn = virs_up + wfn.nvir_up;
+    long *parity_up = thread_scratch<long, 2>(n1 * 2 + 2), *parity_dn = parity_up + n1 + 1;
     // iterate over determinants
-    for (long idet = 0; idet < wfn.ndet; ++idet) {
+    for (long idet = start; idet < end; ++idet) {
         const ulong *rdet_up, *rdet_dn;
-        double val1, val2;
-        long k, l, ii, jj, kk, ll, jdet, sign_up;
+        long i, j, k, l, ii, jj, kk, ll, jdet, sign_up;
         // fill working vectors
         rdet_up = wfn.det_ptr(idet);
         rdet_dn = rdet_up + wfn.nword;
         std::memcpy(det_up, rdet_up, sizeof(ulong) * wfn.nword2);
-        fill_occs(wfn.nword, rdet_up, occs_up);
-        fill_occs(wfn.nword, rdet_dn, occs_dn);
-        fill_virs(wfn.nword, n1, rdet_up, virs_up);
-        fill_virs(wfn.nword, n1, rdet_dn, virs_dn);
-        val1 = coeffs[idet] * coeffs[idet];
+        fill_occs<NW>(wfn.nword, rdet_up, occs_up);
+        fill_occs<NW>(wfn.nword, rdet_dn, occs_dn);
+        fill_virs<NW>(wfn.nword, n1, rdet_up, virs_up);
+        fill_virs<NW>(wfn.nword, n1, rdet_dn, virs_dn);
+        fill_parity<NW>(wfn.nword, n1, rdet_up, parity_up);
+        fill_parity<NW>(wfn.nword, n1, rdet_dn, parity_dn);
+        // compute 0-0 terms
+        rdms.add_00(wfn, occs_up, occs_dn, coeffs[idet] * coeffs[idet]);
         // loop over spin-up occupied indices
         for (i = 0; i < wfn.nocc_up; ++i) {
             ii = occs_up[i];
-            // compute 0-0 terms
-            // aa(ii, ii) += val1;
-            aa[(n1 + 1) * ii] += val1;
-            for (k = i + 1; k < wfn.nocc_up; ++k) {
-                kk = occs_up[k];
-                // aaaa(ii, kk, ii, kk) += val1;
-                aaaa[ii * n3 + kk * n2 + ii * n1 + kk] += val1;
-                // aaaa(ii, kk, kk, ii) -= val1;
-                aaaa[ii * n3 + kk * n2 + kk * n1 + ii] -= val1;
-                // aaaa(kk, ii, ii, kk) -= val1;
-                aaaa[kk * n3 + ii * n2 + ii * n1 + kk] -= val1;
-                // rdm2(kk, ii, kk, ii) -= val1;
-                aaaa[kk * n3 + ii * n2 + kk * n1 + ii] += val1;
-            }
-            for (k = 0; k < wfn.nocc_dn; ++k) {
-                kk = occs_dn[k];
-                // abab(ii, kk, ii, kk) += val1;
-                abab[ii * n3 + kk * n2 + ii * n1 + kk] += val1;
-            }
             // loop over spin-up virtual indices
             for (j = 0; j < wfn.nvir_up; ++j) {
                 jj = virs_up[j];
                 // 1-0 excitation elements
                 excite_det(ii, jj, det_up);
-                sign_up = phase_single_det(wfn.nword, ii, jj, rdet_up);
+                sign_up = phase_single_det(parity_up, ii, jj);
                 jdet = wfn.index_det(det_up);
                 // check if 1-0 excited determinant is in wfn
-                if (jdet > idet) {
-                    // compute 1-0 terms
-                    val2 = coeffs[idet] * coeffs[jdet] * sign_up;
-                    // aa(ii, jj) += val2;
-                    aa[ii * n1 + jj] += val2;
-                    aa[jj * n1 + ii] += val2;
-                    for (k = 0; k < wfn.nocc_up; ++k) {
-                        if (i != k) {
-                            kk = occs_up[k];
-                            // aaaa(ii, kk, jj, kk) += val2;
-                            aaaa[ii * n3 + kk * n2 + jj * n1 + kk] += val2;
-                            // aaaa(ii, kk, kk, jj) -= val2;
-                            aaaa[ii * n3 + kk * n2 + kk * n1 + jj] -= val2;
-                            // aaaa(kk, ii, kk, jj) += val2;
-                            aaaa[kk * n3 + ii * n2 + kk * n1 + jj] += val2;
-                            // aaaa(kk, ii, jj, kk) -= val2;
-                            aaaa[kk * n3 + ii * n2 + jj * n1 + kk] -= val2;
-                            // aaaa(jj, kk, ii, kk) += val2;
-                            aaaa[n3 * jj + n2 * kk + n1 * ii + kk] += val2;
-                            // aaaa(jj, kk, kk, ii) -= val2;
-                            aaaa[n3 * jj + n2 * kk + n1 * kk + ii] -= val2;
-                            // aaaa(kk, jj, ii, kk) -= val2;
-                            aaaa[n3 * kk + n2 * jj + n1 * ii + kk] -= val2;
-                            // aaaa(kk, jj, kk, ii) += val2;
-                            aaaa[n3 * kk + n2 * jj + n1 * kk + ii] += val2;
-                        }
-                    }
-                    for (k = 0; k < wfn.nocc_dn; ++k) {
-                        kk = occs_dn[k];
-                        // abab(ii, kk, jj, kk) += val2;
-                        abab[ii * n3 + kk * n2 + jj * n1 + kk] += val2;
-                        // abab(jj, kk, ii, kk) += val2;
-                        abab[n3 * jj + kk * n2 + ii * n1 + kk] += val2;
-                    }
-                }
+                if (jdet > idet)
+                    rdms.add_10(wfn, occs_up, occs_dn, ii, jj,
+                                coeffs[idet] * coeffs[jdet] * sign_up);
                 // loop over spin-down occupied indices
                 for (k = 0; k < wfn.nocc_dn; ++k) {
                     kk = occs_dn[k];
@@ -268,15 +450,10 @@ void compute_rdms(const FullCIWfn &wfn, const double *coeffs, double *rdm1, doub
                         excite_det(kk, ll, det_dn);
                         jdet = wfn.index_det(det_up);
                         // check if 1-1 excited determinant is in wfn
-                        if (jdet > idet) {
-                            // compute 1-1 terms
-                            val2 = coeffs[idet] * coeffs[jdet] * sign_up *
-                                   phase_single_det(wfn.nword, kk, ll, rdet_dn);
-                            // abab(ii, kk, jj, ll) += val2;
-                            abab[ii * n3 + kk * n2 + jj * n1 + ll] += val2;
-                            // abab(jj, ll, ii, kk) += val2;
-                            abab[n3 * jj + n2 * ll + n1 * ii + kk] += val2;
-                        }
+                        if (jdet > idet)
+                            rdms.add_11(ii, kk, jj, ll,
+                                        coeffs[idet] * coeffs[jdet] * sign_up *
+                                            phase_single_det(parity_dn, kk, ll));
                         excite_det(ll, kk, det_dn);
                     }
                 }
@@ -290,27 +467,11 @@ void compute_rdms(const FullCIWfn &wfn, const double *coeffs, double *rdm1, doub
                         excite_det(kk, ll, det_up);
                         jdet = wfn.index_det(det_up);
                         // check if 2-0 excited determinant is in wfn
-                        if (jdet > idet) {
-                            // compute 2-0 terms
-                            val2 = coeffs[idet] * coeffs[jdet] *
-                                   phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_up);
-                            // aaaa(ii, kk, jj, ll) += val2;
-                            aaaa[ii * n3 + kk * n2 + jj * n1 + ll] += val2;
-                            // aaaa(ii, kk, ll, jj) -= val2;
-                            aaaa[ii * n3 + kk * n2 + ll * n1 + jj] -= val2;
-                            // aaaa(kk, ii, jj, ll) -= val2;
-                            aaaa[n3 * kk + n2 * ii + n1 * jj + ll] -= val2;
-                            // aaaa(kk, ii, ll, jj) += val2;
-                            aaaa[n3 * kk + n2 * ii + n1 * ll + jj] += val2;
-                            // aaaa(jj, ll, ii, kk) += val2;
-                            aaaa[jj * n3 + ll * n2 + ii * n1 + kk] += val2;
-                            // aaaa(jj, ll, kk, ii) -= val2;
-                            aaaa[jj * n3 + ll * n2 + kk * n1 + ii] -= val2;
-                            // aaaa(ll, jj, ii, kk) -= val2;
-                            aaaa[n3 * ll + n2 * jj + n1 * ii + kk] -= val2;
-                            // aaaa(ll, jj, kk, ii) += val2;
-                            aaaa[n3 * ll + n2 * jj + n1 * kk + ii] += val2;
-                        }
+                        if (jdet > idet)
+                            rdms.add_double_same(
+                                rdms.aaaa, ii, kk, jj, ll,
+                                coeffs[idet] * coeffs[jdet] *
+                                    phase_double_det(parity_up, ii, kk, jj, ll));
                         excite_det(ll, kk, det_up);
                     }
                 }
@@ -320,19 +481,6 @@ void compute_rdms(const FullCIWfn &wfn, const double *coeffs, double *rdm1, doub
         // loop over spin-down occupied indices
         for (i = 0; i < wfn.nocc_dn; ++i) {
             ii = occs_dn[i];
-            // compute 0-0 terms
-            // bb(ii, ii) += val1;
-            bb[(n1 + 1) * ii] += val1;
-            for (k = i + 1; k < wfn.nocc_dn; ++k) {
-                kk = occs_dn[k];
-                // bbbb(ii, kk, ii, kk) += val1;
-                bbbb[ii * n3 + kk * n2 + ii * n1 + kk] += val1;
-                // bbbb(ii, kk, kk, ii) -= val1;
-                bbbb[ii * n3 + kk * n2 + kk * n1 + ii] -= val1;
-                bbbb[kk * n3 + ii * n2 + ii * n1 + kk] -= val1;
-                // rdm2(ii, kk, kk, ii) -= val1;
-                bbbb[kk * n3 + ii * n2 + kk * n1 + ii] += val1;
-            }
             // loop over spin-down virtual indices
             for (j = 0; j < wfn.nvir_dn; ++j) {
                 jj = virs_dn[j];
@@ -340,42 +488,10 @@ void compute_rdms(const FullCIWfn &wfn, const double *coeffs, double *rdm1, doub
                 excite_det(ii, jj, det_dn);
                 jdet = wfn.index_det(det_up);
                 // check if 0-1 excited determinant is in wfn
-                if (jdet > idet) {
-                    // compute 0-1 terms
-                    val2 =
-                        coeffs[idet] * coeffs[jdet] * phase_single_det(wfn.nword, ii, jj, rdet_dn);
-                    // bb(ii, jj) += val2;
-                    bb[ii * n1 + jj] += val2;
-                    bb[jj * n1 + ii] += val2;
-                    for (k = 0; k < wfn.nocc_up; ++k) {
-                        kk = occs_up[k];
-                        // abab(ii, kk, jj, kk) += val2;
-                        abab[n3 * kk + n2 * ii + kk * n1 + jj] += val2;
-                        // abab(kk, jj, kk, ii) += val2;
-                        abab[n3 * kk + jj * n2 + kk * n1 + ii] += val2;
-                    }
-                    for (k = 0; k < wfn.nocc_dn; ++k) {
-                        if (i != k) {
-                            kk = occs_dn[k];
-                            // bbbb(ii, kk, jj, kk) += val2;
-                            bbbb[ii * n3 + kk * n2 + jj * n1 + kk] += val2;
-                            // bbbb(ii, kk, kk, jj) -= val2;
-                            bbbb[ii * n3 + kk * n2 + kk * n1 + jj] -= val2;
-                            // bbbb(kk, ii, kk, jj) += val2;
-                            bbbb[kk * n3 + ii * n2 + kk * n1 + jj] += val2;
-                            // bbbb(kk, ii, jj, kk) -= val2;
-                            bbbb[kk * n3 + ii * n2 + jj * n1 + kk] -= val2;
-                            // bbbb(jj, kk, ii, kk) += val2;
-                            bbbb[n3 * jj + n2 * kk + n1 * ii + kk] += val2;
-                            // bbbb(jj, kk, kk, ii) -= val2;
-                            bbbb[n3 * jj + n2 * kk + n1 * kk + ii] -= val2;
-                            // bbbb(kk, jj, ii, kk) -= val2;
-                            bbbb[n3 * kk + n2 * jj + n1 * ii + kk] -= val2;
-                            // bbbb(kk, jj, kk, ii) += val2;
-                            bbbb[n3 * kk + n2 * jj + n1 * kk + ii] += val2;
-                        }
-                    }
-                }
+                if (jdet > idet)
+                    rdms.add_01(wfn, occs_up, occs_dn, ii, jj,
+                                coeffs[idet] * coeffs[jdet] *
+                                    phase_single_det(parity_dn, ii, jj));
                 // loop over spin-down occupied indices
                 for (k = i + 1; k < wfn.nocc_dn; ++k) {
                     kk = occs_dn[k];
@@ -386,27 +502,11 @@ void compute_rdms(const FullCIWfn &wfn, const double *coeffs, double *rdm1, doub
                         excite_det(kk, ll, det_dn);
                         jdet = wfn.index_det(det_up);
                         // check if excited determinant is in wfn
-                        if (jdet > idet) {
-                            // compute 2-0 terms
-                            val2 = coeffs[idet] * coeffs[jdet] *
-                                   phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_dn);
-                            // bbbb(ii, kk, jj, ll) += val2;
-                            bbbb[ii * n3 + kk * n2 + jj * n1 + ll] += val2;
-                            // bbbb(ii, kk, ll, jj) -= val2;
-                            bbbb[ii * n3 + kk * n2 + ll * n1 + jj] -= val2;
-                            // bbbb(kk, ii, jj, ll) -= val2;
-                            bbbb[n3 * kk + n2 * ii + n1 * jj + ll] -= val2;
-                            // bbbb(kk, ii, ll, jj) += val2;
-                            bbbb[n3 * kk + n2 * ii + n1 * ll + jj] += val2;
-                            // bbbb(jj, ll, ii, kk) += val2;
-                            bbbb[jj * n3 + ll * n2 + ii * n1 + kk] += val2;
-                            // bbbb(ll, jj, ii, kk) -= val2;
-                            bbbb[n3 * ll + n2 * jj + n1 * ii + kk] -= val2;
-                            // bbbb(jj, ll, kk, ii) -= val2;
-                            bbbb[jj * n3 + ll * n2 + kk * n1 + ii] -= val2;
-                            // bbbb(ll, jj, kk, ii) += val2;
-                            bbbb[n3 * ll + n2 * jj + n1 * kk + ii] += val2;
-                        }
+                        if (jdet > idet)
+                            rdms.add_double_same(
+                                rdms.bbbb, ii, kk, jj, ll,
+                                coeffs[idet] * coeffs[jdet] *
+                                    phase_double_det(parity_dn, ii, kk, jj, ll));
                         excite_det(ll, kk, det_dn);
                     }
                 }
@@ -416,35 +516,27 @@ void compute_rdms(const FullCIWfn &wfn, const double *coeffs, double *rdm1, doub
     }
 }
 
-void compute_rdms(const GenCIWfn &wfn, const double *coeffs, double *rdm1, double *rdm2) {
+template<long NW>
+void compute_rdms_genci(const GenCIWfn &wfn, const double *coeffs, double *rdm1, double *rdm2,
+                        const long start, const long end) {
     long n1 = wfn.nbasis;
     long n2 = wfn.nbasis * wfn.nbasis;
     long n3 = n1 * n2;
-    long n4 = n2 * n2;
     // prepare working vectors
-    AlignedVector<ulong> v_det(wfn.nword);
-    AlignedVector<long> v_occs(wfn.nocc);
-    AlignedVector<long> v_virs(wfn.nvir);
-    ulong *det = &v_det[0];
-    long *occs = &v_occs[0], *virs = &v_virs[0];
-    // fill rdms with zeros
-    long i = 2 * n2;
-    long j = 0;
-    while (j < i)
-        rdm1[j++] = 0;
-    i = 3 * n4;
-    j = 0;
-    while (j < i)
-        rdm2[j++] = 0;
+    ulong *det = thread_scratch<ulong, 0>(wfn.nword);
+    long *occs = thread_scratch<long, 0>(wfn.nocc);
+    long *virs = thread_scratch<long, 1>(wfn.nvir);
+    long *parity = thread_scratch<long, 2>(n1 + 1);
     // loop over determinants
-    for (long idet = 0; idet < wfn.ndet; ++idet) {
-        long k, l, ii, jj, kk, ll, jdet;
+    for (long idet = start; idet < end; ++idet) {
+        long i, j, k, l, ii, jj, kk, ll, jdet;
         double val1, val2;
         // fill working vectors
         const ulong *rdet = wfn.det_ptr(idet);
         std::memcpy(det, rdet, sizeof(ulong) * wfn.nword);
-        fill_occs(wfn.nword, rdet, occs);
-        fill_virs(wfn.nword, n1, rdet, virs);
+        fill_occs<NW>(wfn.nword, rdet, occs);
+        fill_virs<NW>(wfn.nword, n1, rdet, virs);
+        fill_parity<NW>(wfn.nword, n1, rdet, parity);
         val1 = coeffs[idet] * coeffs[idet];
         // loop over occupied indices
         for (i = 0; i < wfn.nocc; ++i) {
@@ -459,13 +551,13 @@ void compute_rdms(const GenCIWfn &wfn, const double *coeffs, double *rdm1, doubl
                 rdm2[ii * n3 + kk * n2 + ii * n1 + kk] += val1;
                 // rdm2(ii, kk, kk, ii) -= val1;
                 rdm2[ii * n3 + kk * n2 + kk * n1 + ii] -= val1;
-                // rdm2(kk, ii, ii, kk) += val1;
+                // rdm2(kk, ii, ii, kk) -= val1;
                 rdm2[kk * n3 + ii * n2 + ii * n1 + kk] -= val1;
-                // rdm2(kk, ii, kk, ii) -= val1;
-                rdm2[kk * n3 + ii * n2 + kk * n1 + kk] += val1;
+                // rdm2(kk, ii, kk, ii) += val1;
+                rdm2[kk * n3 + ii * n2 + kk * n1 + ii] += val1;
             }
             // loop over virtual indices
-            for (j = 0; j < wfn.nvir; ++j) {
+            for (j = 0; j < wfn.nvir_up; ++j) {
                 jj = virs[j];
                 // single excitation elements
                 excite_det(ii, jj, det);
@@ -473,7 +565,7 @@ void compute_rdms(const GenCIWfn &wfn, const double *coeffs, double *rdm1, doubl
                 // check if singly-excited determinant is in wfn
                 if (jdet != -1) {
                     // compute single excitation terms
-                    val2 = coeffs[idet] * coeffs[jdet] * phase_single_det(wfn.nword, ii, jj, rdet);
+                    val2 = coeffs[idet] * coeffs[jdet] * phase_single_det(parity, ii, jj);
                     // rdm1(ii, jj) += val2;
                     rdm1[ii * n1 + jj] += val2;
                     for (k = 0; k < wfn.nocc; ++k) {
@@ -482,10 +574,10 @@ void compute_rdms(const GenCIWfn &wfn, const double *coeffs, double *rdm1, doubl
                             // rdm2(ii, kk, jj, kk) += val2;
                             rdm2[ii * n3 + kk * n2 + jj * n1 + kk] += val2;
                             // rdm2(ii, kk, kk, jj) -= val2;
-                            rdm2[ii * n3 + kk * n2 + kk * n2 + jj] -= val2;
+                            rdm2[ii * n3 + kk * n2 + kk * n1 + jj] -= val2;
                             // rdm2(kk, ii, jj, kk) -= val2;
                             rdm2[kk * n3 + ii * n2 + jj * n1 + kk] -= val2;
-                            // rdm2(kk, ii, kk, jj) -= val2;
+                            // rdm2(kk, ii, kk, jj) += val2;
                             rdm2[kk * n3 + ii * n2 + kk * n1 + jj] += val2;
                         }
                     }
@@ -494,7 +586,7 @@ void compute_rdms(const GenCIWfn &wfn, const double *coeffs, double *rdm1, doubl
                 for (k = i + 1; k < wfn.nocc; ++k) {
                     kk = occs[k];
                     // loop over virtual indices
-                    for (l = j + 1; l < wfn.nvir; ++l) {
+                    for (l = j + 1; l < wfn.nvir_up; ++l) {
                         ll = virs[l];
                         // double excitation elements
                         excite_det(kk, ll, det);
@@ -503,11 +595,15 @@ void compute_rdms(const GenCIWfn &wfn, const double *coeffs, double *rdm1, doubl
                         if (jdet != -1) {
                             // compute double excitation terms
                             val2 = coeffs[idet] * coeffs[jdet] *
-                                   phase_double_det(wfn.nword, ii, kk, jj, ll, rdet);
+                                   phase_double_det(parity, ii, kk, jj, ll);
                             // rdm2(ii, kk, jj, ll) += val2;
                             rdm2[ii * n3 + kk * n2 + jj * n1 + ll] += val2;
                             // rdm2(ii, kk, ll, jj) -= val2;
                             rdm2[ii * n3 + kk * n2 + ll * n1 + jj] -= val2;
+                            // rdm2(kk, ii, jj, ll) -= val2;
+                            rdm2[kk * n3 + ii * n2 + jj * n1 + ll] -= val2;
+                            // rdm2(kk, ii, ll, jj) += val2;
+                            rdm2[kk * n3 + ii * n2 + ll * n1 + jj] += val2;
                         }
                         excite_det(ll, kk, det);
                     }
@@ -518,6 +614,43 @@ void compute_rdms(const GenCIWfn &wfn, const double *coeffs, double *rdm1, doubl
     }
 }
 
+} // namespace
+
+void compute_rdms(const FullCIWfn &wfn, const double *coeffs, double *rdm1, double *rdm2) {
+    long n2 = wfn.nbasis * wfn.nbasis;
+    // sparse selected spaces are handled by enumerating the connected pairs directly; complete
+    // spaces always take the excitation loop, so their connectivity is not built
+    std::shared_ptr<const ConnectedDets> connected;
+    if (!wfn.complete) {
+        connected = std::make_shared<const ConnectedDets>(wfn);
+        if (!connected->sparse)
+            connected.reset();
+    }
+    auto fullci_fn = select_nword(wfn.nword, &compute_rdms_fullci<1>, &compute_rdms_fullci<2>,
+                                  &compute_rdms_fullci<4>, &compute_rdms_fullci<0>);
+    auto connected_fn =
+        select_nword(wfn.nword, &compute_rdms_connected<1>, &compute_rdms_connected<2>,
+                     &compute_rdms_connected<4>, &compute_rdms_connected<0>);
+    compute_rdms_parallel(wfn.ndet, 2 * n2, rdm1, 3 * n2 * n2, rdm2,
+                          [&](const long start, const long end, double *t_rdm1, double *t_rdm2) {
+                              if (connected)
+                                  connected_fn(wfn, *connected, coeffs, t_rdm1, t_rdm2, start,
+                                               end);
+                              else
+                                  fullci_fn(wfn, coeffs, t_rdm1, t_rdm2, start, end);
+                          });
+}
+
+void compute_rdms(const GenCIWfn &wfn, const double *coeffs, double *rdm1, double *rdm2) {
+    long n2 = wfn.nbasis * wfn.nbasis;
+    auto genci_fn = select_nword(wfn.nword, &compute_rdms_genci<1>, &compute_rdms_genci<2>,
+                                 &compute_rdms_genci<4>, &compute_rdms_genci<0>);
+    compute_rdms_parallel(wfn.ndet, n2, rdm1, n2 * n2, rdm2,
+                          [&](const long start, const long end, double *t_rdm1, double *t_rdm2) {
+                              genci_fn(wfn, coeffs, t_rdm1, t_rdm2, start, end);
+                          });
+}
+
 void compute_transition_rdms(const DOCIWfn &wfn1, const DOCIWfn &wfn2, const double *coeffs1, const double *coeffs2, double *d0, double *d2) {
     // prepare working vectors
     AlignedVector<ulong> v_det(wfn1.nword);
@@ -19,54 +19,342 @@ namespace pyci {
 
 namespace {
 
-template<class T>
-inline void append(AlignedVector<T> &v, const T &t) {
-    if (v.size() + 1 >= v.capacity())
-        v.reserve(std::lround(PYCI_SPARSEOP_RESIZE_FACTOR * v.size() + 0.5));
-    v.push_back(t);
+/* Fixed-size header of the on-disk sparse operator format. The header is followed by the indptr
+ * (nrow + 1 longs), data (size doubles), and indices (size int32s or longs) arrays, so that every
+ * array is 8-byte aligned within the file and can be used in place from a memory mapping. */
+
+constexpr char sparseop_magic[8] = {'P', 'Y', 'C', 'I', 'S', 'P', 'O', 'P'};
+
+constexpr long sparseop_version = 1;
+
+struct SparseOpHeader {
+    char magic[8];
+    long version, nrow, ncol, size;
+    double ecore;
+    long symmetric, compact;
+};
+
+template<class Index>
+double sparseop_get_element(const double *data, const Index *indices, const long *indptr,
+                            const long i, const long j) {
+    const Index *start = indices + indptr[i];
+    const Index *end = indices + indptr[i + 1];
+    const Index *e = std::lower_bound(start, end, j);
+    return (e != end && *e == j) ? data[indptr[i] + e - start] : 0.0;
+}
+
+template<class Index>
+void sparseop_sort_row(double *data, Index *indices, const long n) {
+    typedef std::sort_with_arg::value_iterator_t<double, Index> iter;
+    std::sort(iter(data, indices), iter(data + n, indices + n));
+}
+
+struct SparseOpCollector {
+    long col;
+    Vector<long> &rows;
+    Vector<long> &cols;
+    Vector<double> &vals;
+
+    inline void operator()(const double val, const long i) {
+        rows.push_back(i);
+        cols.push_back(col);
+        vals.push_back(val);
+    }
+};
+
+template<class Index>
+void sparseop_merge_columns(AlignedVector<double> &data, AlignedVector<Index> &indices,
+                            AlignedVector<long> &indptr, const long nrow, const Vector<long> &ptr,
+                            const Vector<long> &cols, const Vector<double> &vals) {
+    // append the new (sorted, larger) columns to the end of each of the first nrow rows,
+    // shifting the rows towards the end of the arrays in place, last row first
+    long shift = ptr[nrow], nnz = indptr.back();
+    if (!shift)
+        return;
+    data.resize(nnz + shift);
+    indices.resize(nnz + shift);
+    std::move_backward(data.begin() + indptr[nrow], data.begin() + nnz, data.end());
+    std::move_backward(indices.begin() + indptr[nrow], indices.begin() + nnz, indices.end());
+    for (long i = nrow - 1, start, end; i >= 0; --i) {
+        start = indptr[i];
+        end = indptr[i + 1];
+        shift = ptr[i];
+        std::copy(cols.begin() + ptr[i], cols.begin() + ptr[i + 1],
+                  indices.begin() + end + ptr[i]);
+        std::copy(vals.begin() + ptr[i], vals.begin() + ptr[i + 1], data.begin() + end + ptr[i]);
+        std::move_backward(indices.begin() + start, indices.begin() + end,
+                           indices.begin() + end + shift);
+        std::move_backward(data.begin() + start, data.begin() + end, data.begin() + end + shift);
+    }
+    for (std::size_t i = nrow + 1; i < indptr.size(); ++i)
+        indptr[i] += ptr[nrow];
+    for (long i = 1; i <= nrow; ++i)
+        indptr[i] += ptr[i];
+}
+
+void sparseop_partition_rows(const long nrow, const long *indptr, const long nthread, long *ends) {
+    // split rows into blocks with about the same number of nonzero elements
+    for (long i = 1; i < nthread; ++i)
+        ends[i - 1] =
+            std::upper_bound(indptr, indptr + nrow + 1,
+                             indptr[0] + (indptr[nrow] - indptr[0]) * i / nthread) -
+            indptr - 1;
+    ends[nthread - 1] = nrow;
+}
+
+void sparseop_partition_blocks(const long *indptr, const long start, const long end,
+                               const long maxnnz, Vector<long> &blocks) {
+    // split rows [start, end) into consecutive blocks of at most maxnnz nonzero elements (or of
+    // a single row, if that row alone is larger)
+    blocks.assign(1, start);
+    while (blocks.back() < end)
+        blocks.push_back(std::max(std::upper_bound(indptr + blocks.back() + 1, indptr + end + 1,
+                                                   indptr[blocks.back()] + maxnnz) -
+                                      indptr - 1,
+                                  blocks.back() + 1));
+}
+
+/* The kernels below take data and indices pointing to the first element of row start, so that
+ * they run unchanged on the whole operator or on one streamed block of rows. */
+
+template<class Index>
+void sparseop_op_thread(const double *data, const Index *indices, const long *indptr,
+                        const double *x, double *y, const long start, const long end) {
+    double val;
+    const long base = indptr[start];
+    for (long i = start, k; i < end; ++i) {
+        val = 0.0;
+        for (k = indptr[i] - base; k < indptr[i + 1] - base; ++k)
+            val += data[k] * x[indices[k]];
+        y[i] = val;
+    }
+}
+
+template<class Index>
+void sparseop_op_symm_thread(const double *data, const Index *indices, const long *indptr,
+                             const double *x, double *y, double *z, const long start,
+                             const long end) {
+    // gather the lower triangle into rows [start, end) of y and scatter the (implicit) upper
+    // triangle into z, which is either a zeroed buffer or y itself when running on one thread
+    double val, xi;
+    const long base = indptr[start];
+    for (long i = start, j, k; i < end; ++i) {
+        val = 0.0;
+        xi = x[i];
+        for (k = indptr[i] - base; k < indptr[i + 1] - base; ++k) {
+            j = indices[k];
+            val += data[k] * x[j];
+            if (j != i)
+                z[j] += data[k] * xi;
+        }
+        y[i] = val;
+    }
+}
+
+template<class Index>
+void sparseop_op_block_thread(const double *data, const Index *indices, const long *indptr,
+                              const long k, const double *x, double *y, const long start,
+                              const long end) {
+    double val, *yi;
+    const double *xj;
+    const long base = indptr[start];
+    for (long i = start, j, l; i < end; ++i) {
+        yi = y + i * k;
+        std::fill(yi, yi + k, 0.0);
+        for (j = indptr[i] - base; j < indptr[i + 1] - base; ++j) {
+            val = data[j];
+            xj = x + indices[j] * k;
+            for (l = 0; l < k; ++l)
+                yi[l] += val * xj[l];
+        }
+    }
 }
 
+template<class Index>
+void sparseop_op_symm_block_thread(const double *data, const Index *indices, const long *indptr,
+                                   const long k, const double *x, double *y, double *z,
+                                   const long start, const long end) {
+    // same as sparseop_op_symm_thread, for a row-major block of k vectors
+    double val, *yi, *zj;
+    const double *xi, *xj;
+    const long base = indptr[start];
+    for (long i = start, j, l, m; i < end; ++i) {
+        yi = y + i * k;
+        xi = x + i * k;
+        std::fill(yi, yi + k, 0.0);
+        for (m = indptr[i] - base; m < indptr[i + 1] - base; ++m) {
+            j = indices[m];
+            val = data[m];
+            xj = x + j * k;
+            for (l = 0; l < k; ++l)
+                yi[l] += val * xj[l];
+            if (j != i) {
+                zj = z + j * k;
+                for (l = 0; l < k; ++l)
+                    zj[l] += val * xi[l];
+            }
+        }
+    }
+}
+
+void sparseop_reduce_thread(const Vector<AlignedVector<double>> &v_bufs, const long *ends,
+                            const long k, double *y, const long start, const long end) {
+    const double *z;
+    for (std::size_t t = 0; t < v_bufs.size(); ++t) {
+        z = &v_bufs[t][0];
+        for (long i = start * k; i < std::min(end, ends[t]) * k; ++i)
+            y[i] += z[i];
+    }
+}
+
+long sparseop_check_block(const pybind11::buffer_info &buf, const long n, const char *what) {
+    // return the number of vectors k of an array of shape (n,) or (n, k)
+    if (buf.ndim < 1 || buf.ndim > 2 || buf.shape[0] != n)
+        throw std::invalid_argument(what);
+    return (buf.ndim > 1) ? buf.shape[1] : 1;
+}
+
+/* Davidson subspace matrix type (column-major, so that each subspace vector is contiguous). */
+
+using DavidsonMatrix = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>;
+
+bool davidson_orthonormalize(DavidsonMatrix &v, const long m) {
+    // orthonormalize column m of v against columns [0, m) using two passes of Gram-Schmidt;
+    // returns false if it is numerically linearly dependent on them
+    auto col = v.col(m);
+    double norm = col.norm();
+    if (norm == 0.0)
+        return false;
+    col /= norm;
+    for (int pass = 0; pass < 2; ++pass)
+        col -= v.leftCols(m) * (v.leftCols(m).transpose() * col);
+    norm = col.norm();
+    if (norm < 1.0e-8)
+        return false;
+    col /= norm;
+    return true;
+}
+
+/* Spectra matrix operation wrapper around the multithreaded SparseOp kernel. */
+
+class SparseOpProd {
+public:
+    using Scalar = double;
+
+    SparseOpProd(const SparseOp &op_) : op(op_) {
+    }
+
+    long rows(void) const {
+        return op.nrow;
+    }
+
+    long cols(void) const {
+        return op.ncol;
+    }
+
+    void perform_op(const double *x, double *y) const {
+        op.perform_op(x, y);
+    }
+
+private:
+    const SparseOp &op;
+};
+
 } // namespace
 
 SparseOp::SparseOp(const SparseOp &op)
     : nrow(op.nrow), ncol(op.ncol), size(op.size), ecore(op.ecore), symmetric(op.symmetric),
-      shape(op.shape), data(op.data), indices(op.indices), indptr(op.indptr) {
+      compact(op.compact), shape(op.shape), data(op.data), indices(op.indices),
+      indptr(op.indptr), indices_32(op.indices_32), mapping(op.mapping),
+      mapped_data(op.mapped_data), mapped_indptr(op.mapped_indptr),
+      mapped_indices(op.mapped_indices), scratch(op.scratch), blocks(op.blocks) {
 }
 
 SparseOp::SparseOp(SparseOp &&op) noexcept
     : nrow(std::exchange(op.nrow, 0)), ncol(std::exchange(op.ncol, 0)),
       size(std::exchange(op.size, 0)), ecore(std::exchange(op.ecore, 0.0)),
-      symmetric(std::exchange(op.symmetric, 0)), shape(std::move(op.shape)),
-      data(std::move(op.data)), indices(std::move(op.indices)), indptr(std::move(op.indptr)) {
+      symmetric(std::exchange(op.symmetric, 0)), compact(std::exchange(op.compact, 0)),
+      shape(std::move(op.shape)), data(std::move(op.data)), indices(std::move(op.indices)),
+      indptr(std::move(op.indptr)), indices_32(std::move(op.indices_32)),
+      mapping(std::move(op.mapping)), mapped_data(std::exchange(op.mapped_data, nullptr)),
+      mapped_indptr(std::exchange(op.mapped_indptr, nullptr)),
+      mapped_indices(std::exchange(op.mapped_indices, nullptr)), scratch(std::move(op.scratch)),
+      blocks(std::move(op.blocks)) {
+}
+
+SparseOp::SparseOp(const std::string &filename) {
+    // map the file read-only; the arrays are used in place, and pages are loaded on demand
+    SparseOpHeader header;
+    struct stat st;
+    bool failed = true;
+    int fd = open(filename.c_str(), O_RDONLY);
+    do {
+        if (fd == -1 || fstat(fd, &st) == -1 ||
+            st.st_size < static_cast<off_t>(sizeof(SparseOpHeader)))
+            break;
+        long len = st.st_size;
+        void *addr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+            break;
+        mapping = std::shared_ptr<void>(addr, [len](void *ptr) { munmap(ptr, len); });
+        std::memcpy(&header, addr, sizeof(SparseOpHeader));
+        if (std::memcmp(header.magic, sparseop_magic, sizeof(sparseop_magic)) ||
+            header.version != sparseop_version || header.nrow < 0 || header.ncol < 0 ||
+            header.size < 0)
+            break;
+        long index_size = header.compact ? sizeof(std::int32_t) : sizeof(long);
+        if (len != static_cast<long>(sizeof(SparseOpHeader) + sizeof(long) * (header.nrow + 1) +
+                                     (sizeof(double) + index_size) * header.size))
+            break;
+        const char *ptr = reinterpret_cast<const char *>(addr) + sizeof(SparseOpHeader);
+        mapped_indptr = reinterpret_cast<const long *>(ptr);
+        ptr += sizeof(long) * (header.nrow + 1);
+        mapped_data = reinterpret_cast<const double *>(ptr);
+        ptr += sizeof(double) * header.size;
+        mapped_indices = ptr;
+        failed = false;
+    } while (false);
+    if (fd != -1)
+        close(fd);
+    if (failed)
+        throw std::ios_base::failure("error in file");
+    nrow = header.nrow;
+    ncol = header.ncol;
+    size = header.size;
+    ecore = header.ecore;
+    symmetric = header.symmetric;
+    compact = header.compact;
+    shape = pybind11::make_tuple(pybind11::cast(nrow), pybind11::cast(ncol));
 }
 
 SparseOp::SparseOp(const long rows, const long cols, const bool symm)
-    : nrow(rows), ncol(cols), size(0), ecore(0.0), symmetric(symm) {
+    : nrow(rows), ncol(cols), size(0), ecore(0.0), symmetric(symm),
+      compact(ncol <= Max<std::int32_t>()) {
     shape = pybind11::make_tuple(pybind11::cast(nrow), pybind11::cast(ncol));
-    append<long>(indptr, 0);
+    indptr.push_back(0);
 }
 
 SparseOp::SparseOp(const SQuantOp &ham, const DOCIWfn &wfn, const long rows, const long cols,
                    const bool symm)
     : nrow((rows > -1) ? rows : wfn.ndet), ncol((cols > -1) ? cols : wfn.ndet), size(0),
-      ecore(ham.ecore), symmetric(symm) {
-    append<long>(indptr, 0);
+      ecore(ham.ecore), symmetric(symm), compact(ncol <= Max<std::int32_t>()) {
+    indptr.push_back(0);
     update<DOCIWfn>(ham, wfn, nrow, ncol, 0);
 }
 
 SparseOp::SparseOp(const SQuantOp &ham, const FullCIWfn &wfn, const long rows, const long cols,
                    const bool symm)
     : nrow((rows > -1) ? rows : wfn.ndet), ncol((cols > -1) ? cols : wfn.ndet), size(0),
-      ecore(ham.ecore), symmetric(symm) {
-    append<long>(indptr, 0);
+      ecore(ham.ecore), symmetric(symm), compact(ncol <= Max<std::int32_t>()) {
+    indptr.push_back(0);
     update<FullCIWfn>(ham, wfn, nrow, ncol, 0);
 }
 
 SparseOp::SparseOp(const SQuantOp &ham, const GenCIWfn &wfn, const long rows, const long cols,
                    const bool symm)
     : nrow((rows > -1) ? rows : wfn.ndet), ncol((cols > -1) ? cols : wfn.ndet), size(0),
-      ecore(ham.ecore), symmetric(symm) {
-    append<long>(indptr, 0);
+      ecore(ham.ecore), symmetric(symm), compact(ncol <= Max<std::int32_t>()) {
+    indptr.push_back(0);
     update<GenCIWfn>(ham, wfn, nrow, ncol, 0);
 }
 
@@ -75,40 +363,276 @@ pybind11::object SparseOp::dtype(void) const {
 }
 
 const double *SparseOp::data_ptr(const long index) const {
-    return &data[index];
+    return (mapping ? mapped_data : data.data()) + index;
 }
 
+template<>
 const long *SparseOp::indices_ptr(const long index) const {
-    return &indices[index];
+    return (mapping ? static_cast<const long *>(mapped_indices) : indices.data()) + index;
+}
+
+template<>
+const std::int32_t *SparseOp::indices_ptr(const long index) const {
+    return (mapping ? static_cast<const std::int32_t *>(mapped_indices) : indices_32.data()) +
+           index;
 }
 
 const long *SparseOp::indptr_ptr(const long index) const {
-    return &indptr[index];
+    return (mapping ? mapped_indptr : indptr.data()) + index;
 }
 
 double SparseOp::get_element(const long i, const long j) const {
-    const long *start = &indices[indptr[i]];
-    const long *end = &indices[indptr[i + 1]];
-    const long *e = std::lower_bound(start, end, j);
-    return (*e == j) ? data[indptr[i] + e - start] : 0.0;
+    if (scratch) {
+        // read row i from scratch
+        long n = indptr[i + 1] - indptr[i], ptr[2] = {0, n};
+        AlignedVector<double> row_data(n);
+        if (compact) {
+            AlignedVector<std::int32_t> row_indices(n);
+            read_scratch(indptr[i], indptr[i + 1], row_data.data(), row_indices.data());
+            return sparseop_get_element(row_data.data(), row_indices.data(), ptr, 0, j);
+        }
+        AlignedVector<long> row_indices(n);
+        read_scratch(indptr[i], indptr[i + 1], row_data.data(), row_indices.data());
+        return sparseop_get_element(row_data.data(), row_indices.data(), ptr, 0, j);
+    }
+    return compact ? sparseop_get_element(data_ptr(0), indices_ptr<std::int32_t>(0),
+                                          indptr_ptr(0), i, j)
+                   : sparseop_get_element(data_ptr(0), indices_ptr<long>(0), indptr_ptr(0), i, j);
+}
+
+long SparseOp::matvec_threads(void) const {
+    long nthread = get_num_threads();
+    long chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    }
+    return nthread;
 }
 
 void SparseOp::perform_op(const double *x, double *y) const {
-    if (symmetric)
-        return perform_op_symm(x, y);
-    typedef Eigen::Map<const Eigen::SparseMatrix<double, Eigen::RowMajor, long>> SparseMatrix;
-    SparseMatrix mat(nrow, ncol, size, &indptr[0], &indices[0], &data[0], 0);
-    Eigen::Map<const Eigen::VectorXd> xvec(x, ncol);
-    Eigen::Map<Eigen::VectorXd> yvec(y, nrow);
-    yvec = mat * xvec;
+    if (compact)
+        perform_op_csr(indices_ptr<std::int32_t>(0), symmetric, 1, x, y);
+    else
+        perform_op_csr(indices_ptr<long>(0), symmetric, 1, x, y);
 }
 
 void SparseOp::perform_op_symm(const double *x, double *y) const {
-    typedef Eigen::Map<const Eigen::SparseMatrix<double, Eigen::RowMajor, long>> SparseMatrix;
-    SparseMatrix mat(nrow, ncol, size, &indptr[0], &indices[0], &data[0], 0);
-    Eigen::Map<const Eigen::VectorXd> xvec(x, ncol);
-    Eigen::Map<Eigen::VectorXd> yvec(y, nrow);
-    yvec = mat.selfadjointView<Eigen::Lower>() * xvec;
+    // the kernels apply the transpose of every stored element, so the operator must hold only the
+    // lower triangle
+    if (!symmetric)
+        throw std::invalid_argument("operator is not stored as a lower triangle");
+    if (compact)
+        perform_op_csr(indices_ptr<std::int32_t>(0), true, 1, x, y);
+    else
+        perform_op_csr(indices_ptr<long>(0), true, 1, x, y);
+}
+
+void SparseOp::perform_op_block(const long k, const double *x, double *y) const {
+    if (compact)
+        perform_op_csr(indices_ptr<std::int32_t>(0), symmetric, k, x, y);
+    else
+        perform_op_csr(indices_ptr<long>(0), symmetric, k, x, y);
+}
+
+template<class Index>
+void SparseOp::perform_op_csr(const Index *ind, const bool symm, const long k, const double *x,
+                              double *y) const {
+    if (scratch)
+        return perform_op_stream<Index>(symm, k, x, y);
+    const double *data = data_ptr(0);
+    const long *indptr = indptr_ptr(0);
+    long nthread = matvec_threads();
+    if (nthread == 1) {
+        if (k == 1 && symm)
+            sparseop_op_symm_thread(data, ind, indptr, x, y, y, 0, nrow);
+        else if (k == 1)
+            sparseop_op_thread(data, ind, indptr, x, y, 0, nrow);
+        else if (symm)
+            sparseop_op_symm_block_thread(data, ind, indptr, k, x, y, y, 0, nrow);
+        else
+            sparseop_op_block_thread(data, ind, indptr, k, x, y, 0, nrow);
+        return;
+    }
+    Vector<long> ends(nthread);
+    sparseop_partition_rows(nrow, indptr, nthread, &ends[0]);
+    if (!symm) {
+        parallel_run(nthread, [&](const long i) {
+            long start = i ? ends[i - 1] : 0;
+            if (k == 1)
+                sparseop_op_thread<Index>(data + indptr[start], ind + indptr[start], indptr, x, y,
+                                          start, ends[i]);
+            else
+                sparseop_op_block_thread<Index>(data + indptr[start], ind + indptr[start], indptr,
+                                                k, x, y, start, ends[i]);
+        });
+        return;
+    }
+    // each thread scatters into a private buffer; the buffers are then reduced into y
+    Vector<AlignedVector<double>> v_bufs;
+    v_bufs.reserve(nthread);
+    for (long i = 0; i < nthread; ++i)
+        v_bufs.emplace_back(std::max(ends[i], 1L) * k);
+    parallel_run(nthread, [&](const long i) {
+        long start = i ? ends[i - 1] : 0;
+        if (k == 1)
+            sparseop_op_symm_thread<Index>(data + indptr[start], ind + indptr[start], indptr, x,
+                                           y, &v_bufs[i][0], start, ends[i]);
+        else
+            sparseop_op_symm_block_thread<Index>(data + indptr[start], ind + indptr[start],
+                                                 indptr, k, x, y, &v_bufs[i][0], start, ends[i]);
+    });
+    long chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    parallel_run(nthread, [&](const long i) {
+        sparseop_reduce_thread(v_bufs, &ends[0], k, y, std::min(i * chunksize, nrow),
+                               std::min((i + 1) * chunksize, nrow));
+    });
+}
+
+template<class Index>
+void SparseOp::perform_op_stream(const bool symm, const long k, const double *x,
+                                 double *y) const {
+    // stream the row blocks from scratch through two buffers; one reader thread reads block b + 1
+    // in the background while the threads multiply block b
+    long nblock = blocks.size() - 1, maxnnz = 1;
+    for (long b = 0; b < nblock; ++b)
+        maxnnz = std::max(maxnnz, indptr[blocks[b + 1]] - indptr[blocks[b]]);
+    AlignedVector<double> v_data[2] = {AlignedVector<double>(maxnnz),
+                                       AlignedVector<double>(maxnnz)};
+    AlignedVector<Index> v_ind[2] = {AlignedVector<Index>(maxnnz), AlignedVector<Index>(maxnnz)};
+    long nthread = matvec_threads();
+    Vector<long> ends(nthread), bounds(nthread, 0);
+    // the upper triangle is scattered into one zeroed buffer per thread over the whole pass, and
+    // row i of buffer t is only touched if it is below bounds[t], the last row thread t ran
+    Vector<AlignedVector<double>> v_bufs;
+    if (symm) {
+        for (long i = 0; i < nthread; ++i)
+            v_bufs.emplace_back(std::max(nrow, 1L) * k);
+    }
+    std::mutex mutex;
+    std::condition_variable cond;
+    long nread = 0, nused = 0;
+    bool stop = false, failed = false;
+    std::future<void> reader = std::async(std::launch::async, [&]() {
+        try {
+            for (long b = 0; b < nblock; ++b) {
+                {
+                    // the buffer of block b is free once block b - 2 has been multiplied
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cond.wait(lock, [&]() { return stop || nused >= b - 1; });
+                    if (stop)
+                        return;
+                }
+                read_scratch<Index>(indptr[blocks[b]], indptr[blocks[b + 1]], &v_data[b % 2][0],
+                                    &v_ind[b % 2][0]);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    nread = b + 1;
+                }
+                cond.notify_all();
+            }
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                failed = true;
+            }
+            cond.notify_all();
+            throw;
+        }
+    });
+    try {
+        for (long b = 0, r0, r1; b < nblock; ++b) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&]() { return failed || nread > b; });
+                if (failed)
+                    break;
+            }
+            r0 = blocks[b];
+            r1 = blocks[b + 1];
+            const double *data = &v_data[b % 2][0];
+            const Index *ind = &v_ind[b % 2][0];
+            sparseop_partition_rows(r1 - r0, &indptr[r0], nthread, &ends[0]);
+            parallel_run(nthread, [&](const long i) {
+                long start = r0 + (i ? ends[i - 1] : 0), end = r0 + ends[i];
+                long pos = indptr[start] - indptr[r0];
+                if (k == 1 && symm)
+                    sparseop_op_symm_thread<Index>(data + pos, ind + pos, &indptr[0], x, y,
+                                                   &v_bufs[i][0], start, end);
+                else if (k == 1)
+                    sparseop_op_thread<Index>(data + pos, ind + pos, &indptr[0], x, y, start,
+                                              end);
+                else if (symm)
+                    sparseop_op_symm_block_thread<Index>(data + pos, ind + pos, &indptr[0], k, x,
+                                                         y, &v_bufs[i][0], start, end);
+                else
+                    sparseop_op_block_thread<Index>(data + pos, ind + pos, &indptr[0], k, x, y,
+                                                    start, end);
+            });
+            for (long i = 0; i < nthread; ++i)
+                bounds[i] = std::max(bounds[i], r0 + ends[i]);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                nused = b + 1;
+            }
+            cond.notify_all();
+        }
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cond.notify_all();
+        throw;
+    }
+    // rethrows a read error
+    reader.get();
+    if (!symm)
+        return;
+    long chunksize = nrow / nthread + static_cast<bool>(nrow % nthread);
+    parallel_run(nthread, [&](const long i) {
+        sparseop_reduce_thread(v_bufs, &bounds[0], k, y, std::min(i * chunksize, nrow),
+                               std::min((i + 1) * chunksize, nrow));
+    });
+}
+
+template<class Index>
+void SparseOp::read_scratch(const long start, const long end, double *dst_data,
+                            Index *dst_indices) const {
+    // read elements [start, end) of the data and/or indices arrays from the scratch file
+    long offsets[2] = {static_cast<long>(sizeof(double)) * start,
+                       static_cast<long>(sizeof(double)) * size +
+                           static_cast<long>(sizeof(Index)) * start};
+    long lengths[2] = {static_cast<long>(sizeof(double)) * (end - start),
+                       static_cast<long>(sizeof(Index)) * (end - start)};
+    char *ptrs[2] = {reinterpret_cast<char *>(dst_data), reinterpret_cast<char *>(dst_indices)};
+    for (int i = 0; i < 2; ++i) {
+        for (long n = 0, m; ptrs[i] != nullptr && n < lengths[i]; n += m) {
+            m = pread(*scratch, ptrs[i] + n, lengths[i] - n, offsets[i] + n);
+            if (m <= 0)
+                throw std::ios_base::failure("error reading scratch file");
+        }
+    }
+}
+
+template<class Index>
+void SparseOp::write_scratch(const long start, const long end, const double *src_data,
+                             const Index *src_indices) const {
+    // write elements [start, end) of the data and indices arrays to the scratch file
+    long offsets[2] = {static_cast<long>(sizeof(double)) * start,
+                       static_cast<long>(sizeof(double)) * size +
+                           static_cast<long>(sizeof(Index)) * start};
+    long lengths[2] = {static_cast<long>(sizeof(double)) * (end - start),
+                       static_cast<long>(sizeof(Index)) * (end - start)};
+    const char *ptrs[2] = {reinterpret_cast<const char *>(src_data),
+                           reinterpret_cast<const char *>(src_indices)};
+    for (int i = 0; i < 2; ++i) {
+        for (long n = 0, m; n < lengths[i]; n += m) {
+            m = pwrite(*scratch, ptrs[i] + n, lengths[i] - n, offsets[i] + n);
+            if (m <= 0)
+                throw std::ios_base::failure("error writing scratch file");
+        }
+    }
 }
 
 void SparseOp::solve_ci(const long n, const double *coeffs, const long ncv, const long maxiter,
@@ -122,11 +646,9 @@ void SparseOp::solve_ci(const long n, const double *coeffs, const long ncv, cons
         *evecs = 1.0;
         return;
     }
-    typedef Eigen::Map<const Eigen::SparseMatrix<double, Eigen::RowMajor, long>> SparseMatrix;
-    SparseMatrix mat(nrow, ncol, size, &indptr[0], &indices[0], &data[0], 0);
-    Spectra::SparseSymMatProd<double, Eigen::Lower, Eigen::RowMajor, long> op(mat);
-    Spectra::SymEigsSolver<Spectra::SparseSymMatProd<double, Eigen::Lower, Eigen::RowMajor, long>>
-        eigs(op, n, (ncv != -1) ? ncv : std::min(nrow, std::max(n * 2 + 1, 20L)));
+    SparseOpProd op(*this);
+    Spectra::SymEigsSolver<SparseOpProd> eigs(
+        op, n, (ncv != -1) ? ncv : std::min(nrow, std::max(n * 2 + 1, 20L)));
     if (coeffs == nullptr)
         eigs.init();
     else
@@ -145,7 +667,115 @@ void SparseOp::solve_ci(const long n, const double *coeffs, const long ncv, cons
 
 }
 
+void SparseOp::solve_davidson(const long n, const double *coeffs, const long nguess,
+                              const long ncv, const long maxiter, const double tol, double *evals,
+                              double *evecs) const {
+    if ((nrow > 1 && n >= nrow) || (nrow == 1 && n > 1)) {
+        throw std::invalid_argument("cannot find >=n eigenpairs for sparse operator with n rows");
+    } else if (nrow != ncol) {
+        throw pybind11::type_error("Can only solve sparse symmetric matrix operators");
+    } else if (nrow == 1) {
+        *evals = get_element(0, 0) + ecore;
+        *evecs = 1.0;
+        return;
+    }
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+    // more guesses and Ritz vectors than roots are kept, so that the subspace has components along
+    // the partners of degenerate roots
+    long nblock = std::min(nrow, std::max(n * 2, n + 4));
+    long maxdim =
+        std::min(nrow, std::max((ncv != -1) ? ncv : std::max(n * 2 + 1, 20L), nblock + n));
+    long niter = (maxiter != -1) ? maxiter : n * nrow * 10;
+    // diagonal elements for the (H_ii - E)^-1 preconditioner
+    AlignedVector<double> diag(nrow);
+    for (long i = 0; i < nrow; ++i)
+        diag[i] = get_element(i, i);
+    // initial guesses from coeffs, filled in with unit vectors on the lowest diagonal elements
+    DavidsonMatrix v(nrow, maxdim), av(nrow, maxdim), g(maxdim, maxdim), x, r;
+    long m = 0, nnew = 0, nk;
+    for (long i = 0; i < std::min(nguess, n); ++i) {
+        v.col(nnew) = CDenseVector<double>(coeffs + i * nrow, nrow);
+        if (davidson_orthonormalize(v, nnew))
+            ++nnew;
+    }
+    if (nnew < nblock) {
+        Vector<long> order(nrow);
+        std::iota(order.begin(), order.end(), 0L);
+        std::sort(order.begin(), order.end(),
+                  [&diag](const long i, const long j) { return diag[i] < diag[j]; });
+        for (long i = 0; nnew < nblock && i < nrow; ++i) {
+            v.col(nnew).setZero();
+            v(order[i], nnew) = 1.0;
+            if (davidson_orthonormalize(v, nnew))
+                ++nnew;
+        }
+    }
+    Eigen::SelfAdjointEigenSolver<DavidsonMatrix> eigs;
+    Eigen::VectorXd theta, theta_old = Eigen::VectorXd::Constant(n, Max<double>());
+    Vector<char> converged(n, 0);
+    RowMatrix xblk, yblk;
+    for (long iter = 0;; ++iter) {
+        // apply the operator to all of the new subspace vectors in one pass
+        xblk = v.middleCols(m, nnew);
+        yblk.resize(nrow, nnew);
+        perform_op_block(nnew, xblk.data(), yblk.data());
+        av.middleCols(m, nnew) = yblk;
+        // extend the projected matrix and diagonalize it
+        g.block(0, m, m + nnew, nnew) = v.leftCols(m + nnew).transpose() * av.middleCols(m, nnew);
+        g.block(m, 0, nnew, m) = g.block(0, m, m, nnew).transpose();
+        m += nnew;
+        eigs.compute(g.topLeftCorner(m, m));
+        theta = eigs.eigenvalues().head(n);
+        // compute the Ritz vectors of the nblock lowest roots and the residuals of the n lowest
+        nk = std::min(m, nblock);
+        x = v.leftCols(m) * eigs.eigenvectors().leftCols(nk);
+        r = av.leftCols(m) * eigs.eigenvectors().leftCols(n) - x.leftCols(n) * theta.asDiagonal();
+        nnew = 0;
+        for (long k = 0; k < n; ++k) {
+            converged[k] = (std::abs(theta[k] - theta_old[k]) < tol) &&
+                           (r.col(k).norm() < std::sqrt(tol));
+            nnew += !converged[k];
+        }
+        theta_old = theta;
+        if (!nnew || m == nrow)
+            break;
+        else if (iter == niter)
+            throw std::runtime_error("did not converge");
+        // restart by collapsing the subspace onto the current Ritz vectors
+        if (m + nnew > maxdim) {
+            av.leftCols(nk) = av.leftCols(m) * eigs.eigenvectors().leftCols(nk);
+            v.leftCols(nk) = x;
+            g.topLeftCorner(nk, nk) = eigs.eigenvalues().head(nk).asDiagonal();
+            m = nk;
+        }
+        // add preconditioned residuals of the unconverged roots; converged roots are locked
+        nnew = 0;
+        for (long k = 0; k < n && m + nnew < maxdim; ++k) {
+            if (converged[k])
+                continue;
+            for (long i = 0; i < nrow; ++i) {
+                double denom = theta[k] - diag[i];
+                v(i, m + nnew) = r(i, k) / ((std::abs(denom) > 1.0e-8) ? denom
+                                                                        : std::copysign(1.0e-8, denom));
+            }
+            if (davidson_orthonormalize(v, m + nnew))
+                ++nnew;
+        }
+        // the subspace cannot be extended any further, and some roots are not converged
+        if (!nnew)
+            throw std::runtime_error("did not converge");
+    }
+    for (long i = 0; i < n; ++i)
+        evals[i] = theta[i] + ecore;
+    // This is needed so that the eigenvectors are in the proper order
+    // when passed back to Python as NumPy arrays
+    DenseMatrix<double> eigenvectors(evecs, n, nrow);
+    eigenvectors.transpose() = x.leftCols(n);
+}
+
 Array<double> SparseOp::py_matvec(const Array<double> x) const {
+    if (x.size() != ncol)
+        throw std::invalid_argument("x must have ncol elements");
     Array<double> y(nrow);
     perform_op(reinterpret_cast<const double *>(x.request().ptr),
                reinterpret_cast<double *>(y.request().ptr));
@@ -153,78 +783,411 @@ Array<double> SparseOp::py_matvec(const Array<double> x) const {
 }
 
 Array<double> SparseOp::py_matvec_out(const Array<double> x, Array<double> y) const {
+    if (x.size() != ncol)
+        throw std::invalid_argument("x must have ncol elements");
+    else if (y.size() != nrow)
+        throw std::invalid_argument("out must have nrow elements");
     perform_op(reinterpret_cast<const double *>(x.request().ptr),
                reinterpret_cast<double *>(y.request().ptr));
     return y;
 }
 
+Array<double> SparseOp::py_matmat(const Array<double> x) const {
+    pybind11::buffer_info buf = x.request();
+    long k = sparseop_check_block(buf, ncol, "x must have shape (ncol,) or (ncol, k)");
+    Array<double> y({nrow, k});
+    perform_op_block(k, reinterpret_cast<const double *>(buf.ptr),
+                     reinterpret_cast<double *>(y.request().ptr));
+    return y;
+}
+
+Array<double> SparseOp::py_matmat_out(const Array<double> x, Array<double> y) const {
+    pybind11::buffer_info buf = x.request(), out = y.request();
+    long k = sparseop_check_block(buf, ncol, "x must have shape (ncol,) or (ncol, k)");
+    if (sparseop_check_block(out, nrow, "out must have shape (nrow,) or (nrow, k)") != k)
+        throw std::invalid_argument("x and out must have the same number of columns k");
+    perform_op_block(k, reinterpret_cast<const double *>(buf.ptr),
+                     reinterpret_cast<double *>(out.ptr));
+    return y;
+}
+
 pybind11::tuple SparseOp::py_solve_ci(const long n, pybind11::object coeffs, const long ncv,
-                                      const long maxiter, const double tol) const {
+                                      const long maxiter, const double tol,
+                                      const std::string &method) const {
     Array<double> eigvals(n);
     Array<double> eigvecs({n, nrow});
-    const double *cptr =
-        coeffs.is(pybind11::none())
-            ? nullptr
-            : reinterpret_cast<const double *>(coeffs.cast<Array<double>>().request().ptr);
+    Array<double> c0;
+    const double *cptr = nullptr;
+    long nguess = 0;
+    if (!coeffs.is(pybind11::none())) {
+        c0 = coeffs.cast<Array<double>>();
+        cptr = reinterpret_cast<const double *>(c0.request().ptr);
+        nguess = c0.size() / std::max(nrow, 1L);
+    }
     double *evals = reinterpret_cast<double *>(eigvals.request().ptr);
     double *evecs = reinterpret_cast<double *>(eigvecs.request().ptr);
-    solve_ci(n, cptr, ncv, maxiter, tol, evals, evecs);
+    if (method == "lanczos")
+        solve_ci(n, cptr, ncv, maxiter, tol, evals, evecs);
+    else if (method == "davidson")
+        solve_davidson(n, cptr, nguess, ncv, maxiter, tol, evals, evecs);
+    else
+        throw std::invalid_argument("method must be one of 'lanczos', 'davidson'");
     return pybind11::make_tuple(eigvals, eigvecs);
 }
 
 template<class WfnType>
-void SparseOp::py_update(const SQuantOp &ham, const WfnType &wfn) {
-    update<WfnType>(ham, wfn, wfn.ndet, wfn.ndet, nrow);
+void SparseOp::py_update(const SQuantOp &ham, const WfnType &wfn, const long rows) {
+    update<WfnType>(ham, wfn, (rows > -1) ? rows : ((nrow == ncol) ? wfn.ndet : nrow), wfn.ndet,
+                    nrow);
 }
 
-template void SparseOp::py_update(const SQuantOp &, const DOCIWfn &);
+template void SparseOp::py_update(const SQuantOp &, const DOCIWfn &, const long);
 
-template void SparseOp::py_update(const SQuantOp &, const FullCIWfn &);
+template void SparseOp::py_update(const SQuantOp &, const FullCIWfn &, const long);
 
-template void SparseOp::py_update(const SQuantOp &, const GenCIWfn &);
+template void SparseOp::py_update(const SQuantOp &, const GenCIWfn &, const long);
 
 template<class WfnType>
 void SparseOp::update(const SQuantOp &ham, const WfnType &wfn, const long rows, const long cols,
                       const long startrow) {
-    AlignedVector<ulong> det(wfn.nword2);
-    AlignedVector<long> occs(wfn.nocc);
-    AlignedVector<long> virs(wfn.nvir);
+    unmap();
+    // an out-of-core operator is rebuilt from its first row
+    long first = scratch ? 0 : startrow;
+    long oldcols = ncol;
     shape = pybind11::make_tuple(pybind11::cast(rows), pybind11::cast(cols));
     nrow = rows;
     ncol = cols;
-    indptr.reserve(nrow + 1);
-    for (long idet = startrow; idet < rows; ++idet) {
-        add_row(ham, wfn, idet, &det[0], &occs[0], &virs[0]);
-        sort_row(idet);
+    // widen the column indices if the new columns do not fit in 32 bits
+    if (compact && ncol > Max<std::int32_t>()) {
+        indices.assign(indices_32.begin(), indices_32.end());
+        AlignedVector<std::int32_t>().swap(indices_32);
+        compact = false;
+    }
+    // enumerate the connected determinants directly if the space is sparse enough
+    connect_dets(wfn);
+    // add the couplings of the existing rows to the new columns
+    if (!symmetric && first && cols > oldcols)
+        extend_columns<WfnType>(ham, wfn, first, oldcols);
+    long nthread = get_num_threads(), nrows = std::max(rows - first, 0L);
+    long chunksize = nrows / nthread + static_cast<bool>(nrows % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrows / nthread + static_cast<bool>(nrows % nthread);
+    }
+    // symbolic pass: count the nonzero elements of each new row into indptr
+    indptr.resize(first + nrows + 1);
+    parallel_for(nthread, nrows, PYCI_CHUNKSIZE_DYNAMIC,
+                 [&](const long, const long start, const long end) {
+                     count_rows<WfnType>(ham, wfn, first + start, first + end);
+                 });
+    for (long i = first; i < first + nrows; ++i)
+        indptr[i + 1] += indptr[i];
+    size = indptr.back();
+    // build the operator out-of-core if it is too large to hold in memory
+    if (!g_scratch_dir.empty() && size > g_incore_max) {
+        if (compact)
+            stream_rows<WfnType, std::int32_t>(ham, wfn, first);
+        else
+            stream_rows<WfnType, long>(ham, wfn, first);
+        connected.reset();
+        return;
+    }
+    scratch.reset();
+    blocks.clear();
+    // allocate the exact storage once, then fill each row in place
+    data.resize(size);
+    if (compact) {
+        indices_32.resize(size);
+        fill_block<WfnType, std::int32_t>(ham, wfn, first, first + nrows,
+                                          data.data() + indptr[first],
+                                          indices_32.data() + indptr[first]);
+    } else {
+        indices.resize(size);
+        fill_block<WfnType, long>(ham, wfn, first, first + nrows, data.data() + indptr[first],
+                                  indices.data() + indptr[first]);
+    }
+    connected.reset();
+}
+
+void SparseOp::connect_dets(const Wfn &) {
+    connected.reset();
+}
+
+void SparseOp::connect_dets(const FullCIWfn &wfn) {
+    std::shared_ptr<const ConnectedDets> dets = std::make_shared<const ConnectedDets>(wfn);
+    if (dets->sparse)
+        connected = dets;
+    else
+        connected.reset();
+}
+
+template<class WfnType, class Index>
+void SparseOp::stream_rows(const SQuantOp &ham, const WfnType &wfn, const long first) {
+    // the data and indices arrays go to an unlinked scratch file that is closed along with the
+    // last operator using it; rows [0, first) are already in memory, and the remaining rows are
+    // built in blocks, each written in the background while the next one is built
+    std::string filename = g_scratch_dir + "/pyci-sparseop-XXXXXX";
+    int fd = mkstemp(&filename[0]);
+    if (fd == -1)
+        throw std::ios_base::failure("error creating scratch file");
+    unlink(filename.c_str());
+    scratch = std::shared_ptr<int>(new int(fd), [](int *ptr) {
+        close(*ptr);
+        delete ptr;
+    });
+    long maxnnz = std::max(g_incore_max / 2, 1L), bufsize = 1;
+    write_scratch<Index>(0, indptr[first], data_ptr(0), indices_ptr<Index>(0));
+    Vector<long> rows;
+    sparseop_partition_blocks(&indptr[0], first, nrow, maxnnz, rows);
+    for (std::size_t b = 0; b + 1 < rows.size(); ++b)
+        bufsize = std::max(bufsize, indptr[rows[b + 1]] - indptr[rows[b]]);
+    AlignedVector<double> v_data[2] = {AlignedVector<double>(bufsize),
+                                       AlignedVector<double>(bufsize)};
+    AlignedVector<Index> v_ind[2] = {AlignedVector<Index>(bufsize),
+                                     AlignedVector<Index>(bufsize)};
+    std::future<void> prev;
+    for (std::size_t b = 0; b + 1 < rows.size(); ++b) {
+        fill_block<WfnType, Index>(ham, wfn, rows[b], rows[b + 1], &v_data[b % 2][0],
+                                   &v_ind[b % 2][0]);
+        if (prev.valid())
+            prev.get();
+        prev = std::async(std::launch::async, &SparseOp::write_scratch<Index>, this,
+                          indptr[rows[b]], indptr[rows[b + 1]], &v_data[b % 2][0],
+                          &v_ind[b % 2][0]);
+    }
+    if (prev.valid())
+        prev.get();
+    // matvecs stream the whole operator in blocks of the same size
+    sparseop_partition_blocks(&indptr[0], 0, nrow, maxnnz, blocks);
+    AlignedVector<double>().swap(data);
+    AlignedVector<long>().swap(indices);
+    AlignedVector<std::int32_t>().swap(indices_32);
+}
+
+template<class WfnType, class Index>
+void SparseOp::fill_block(const SQuantOp &ham, const WfnType &wfn, const long start,
+                          const long end, double *dst_data, Index *dst_indices) {
+    // fill rows [start, end) into arrays beginning at the first element of row start
+    long nthread = get_num_threads(), nrows = end - start;
+    long chunksize = nrows / nthread + static_cast<bool>(nrows % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nrows / nthread + static_cast<bool>(nrows % nthread);
+    }
+    // the row offsets are known from the symbolic pass, so the rows can be filled in any order
+    parallel_for(nthread, nrows, PYCI_CHUNKSIZE_DYNAMIC,
+                 [&](const long, const long s, const long e) {
+                     long pos = indptr[start + s] - indptr[start];
+                     fill_rows<WfnType, Index>(ham, wfn, start + s, start + e, dst_data + pos,
+                                               dst_indices + pos);
+                 });
+}
+
+template<class WfnType>
+void SparseOp::extend_columns(const SQuantOp &ham, const WfnType &wfn, const long oldrows,
+                              const long oldcols) {
+    // H is symmetric, so the new elements (i, j) of the existing rows i < oldrows are found
+    // by generating the rows of the new determinants j >= oldcols, restricted to columns i
+    long ncols = ncol - oldcols;
+    long nthread = get_num_threads();
+    long chunksize = ncols / nthread + static_cast<bool>(ncols % nthread);
+    while (nthread > 1 && chunksize < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = ncols / nthread + static_cast<bool>(ncols % nthread);
+    }
+    Vector<Vector<long>> v_rows(nthread), v_cols(nthread);
+    Vector<Vector<double>> v_vals(nthread);
+    if (nthread == 1) {
+        collect_columns<WfnType>(ham, wfn, oldrows, oldcols, ncol, v_rows[0], v_cols[0],
+                                 v_vals[0]);
+    } else {
+        parallel_run(nthread, [&](const long i) {
+            collect_columns<WfnType>(ham, wfn, oldrows, std::min(oldcols + i * chunksize, ncol),
+                                     std::min(oldcols + (i + 1) * chunksize, ncol), v_rows[i],
+                                     v_cols[i], v_vals[i]);
+        });
+    }
+    // bucket the new elements by row; columns stay in ascending order within each row
+    Vector<long> ptr(oldrows + 1, 0);
+    for (const auto &rows : v_rows)
+        for (long i : rows)
+            ++ptr[i + 1];
+    for (long i = 0; i < oldrows; ++i)
+        ptr[i + 1] += ptr[i];
+    Vector<long> pos(ptr.begin(), ptr.end() - 1), cols(ptr.back());
+    Vector<double> vals(ptr.back());
+    for (long t = 0; t < nthread; ++t) {
+        for (std::size_t k = 0; k < v_rows[t].size(); ++k) {
+            long p = pos[v_rows[t][k]]++;
+            cols[p] = v_cols[t][k];
+            vals[p] = v_vals[t][k];
+        }
+        Vector<long>().swap(v_rows[t]);
+        Vector<long>().swap(v_cols[t]);
+        Vector<double>().swap(v_vals[t]);
+    }
+    if (compact)
+        sparseop_merge_columns(data, indices_32, indptr, oldrows, ptr, cols, vals);
+    else
+        sparseop_merge_columns(data, indices, indptr, oldrows, ptr, cols, vals);
+}
+
+template<class WfnType>
+void SparseOp::collect_columns(const SQuantOp &ham, const WfnType &wfn, const long oldrows,
+                               const long start, const long end, Vector<long> &rows,
+                               Vector<long> &cols, Vector<double> &vals) const {
+    SparseOpRows gen = row_generator(oldrows);
+    ulong *det = thread_scratch<ulong, 0>(wfn.nword2);
+    long *occs = thread_scratch<long, 0>(wfn.nocc);
+    long *virs = thread_scratch<long, 1>(wfn.nvir);
+    long *parity = thread_scratch<long, 2>(wfn.nbasis * 2 + 2);
+    for (long jdet = start; jdet < end; ++jdet) {
+        SparseOpCollector collector{jdet, rows, cols, vals};
+        gen.add_row(ham, wfn, jdet, det, occs, virs, parity, collector);
     }
-    size = indices.size();
 }
 
 void SparseOp::reserve(const long n) {
-    indices.reserve(n);
+    if (compact)
+        indices_32.reserve(n);
+    else
+        indices.reserve(n);
     data.reserve(n);
 }
 
 void SparseOp::squeeze(void) {
     indptr.shrink_to_fit();
     indices.shrink_to_fit();
+    indices_32.shrink_to_fit();
     data.shrink_to_fit();
 }
 
-void SparseOp::sort_row(const long idet) {
-    typedef std::sort_with_arg::value_iterator_t<double, long> iter;
-    long start = indptr[idet], end = indptr[idet + 1];
-    std::sort(iter(&data[start], &indices[start]), iter(&data[end], &indices[end]));
+void SparseOp::to_file(const std::string &filename) const {
+    SparseOpHeader header;
+    std::memcpy(header.magic, sparseop_magic, sizeof(sparseop_magic));
+    header.version = sparseop_version;
+    header.nrow = nrow;
+    header.ncol = ncol;
+    header.size = size;
+    header.ecore = ecore;
+    header.symmetric = symmetric;
+    header.compact = compact;
+    std::ofstream file;
+    file.open(filename, std::ios::out | std::ios::binary);
+    bool success =
+        file.write(reinterpret_cast<const char *>(&header), sizeof(SparseOpHeader)) &&
+        file.write(reinterpret_cast<const char *>(indptr_ptr(0)), sizeof(long) * (nrow + 1));
+    if (scratch) {
+        // the scratch file holds the data and indices arrays in the same layout
+        Vector<char> buf(1L << 24);
+        long len = size * (sizeof(double) + (compact ? sizeof(std::int32_t) : sizeof(long)));
+        for (long pos = 0, m; success && pos < len; pos += m) {
+            m = pread(*scratch, &buf[0], std::min(len - pos, static_cast<long>(buf.size())), pos);
+            success = (m > 0) && file.write(&buf[0], m);
+        }
+    } else {
+        success =
+            success &&
+            file.write(reinterpret_cast<const char *>(data_ptr(0)), sizeof(double) * size) &&
+            (compact ? file.write(reinterpret_cast<const char *>(indices_ptr<std::int32_t>(0)),
+                                  sizeof(std::int32_t) * size)
+                     : file.write(reinterpret_cast<const char *>(indices_ptr<long>(0)),
+                                  sizeof(long) * size));
+    }
+    file.close();
+    if (!success)
+        throw std::ios_base::failure("error writing file");
+}
+
+void SparseOp::unmap(void) {
+    // copy a memory-mapped operator into owned arrays so that it can be modified
+    if (!mapping)
+        return;
+    indptr.assign(mapped_indptr, mapped_indptr + nrow + 1);
+    data.assign(mapped_data, mapped_data + size);
+    if (compact) {
+        const std::int32_t *ind = static_cast<const std::int32_t *>(mapped_indices);
+        indices_32.assign(ind, ind + size);
+    } else {
+        const long *ind = static_cast<const long *>(mapped_indices);
+        indices.assign(ind, ind + size);
+    }
+    mapping.reset();
+    mapped_data = nullptr;
+    mapped_indptr = nullptr;
+    mapped_indices = nullptr;
+}
+
+SparseOpRows SparseOp::row_generator(const long cols) const {
+    return SparseOpRows{cols, symmetric, connected.get()};
 }
 
-void SparseOp::add_row(const SQuantOp &ham, const DOCIWfn &wfn, const long idet, ulong *det, long *occs,
-                       long *virs) {
+template<class WfnType>
+void SparseOp::count_rows(const SQuantOp &ham, const WfnType &wfn, const long start,
+                          const long end) {
+    SparseOpRows gen = row_generator(ncol);
+    ulong *det = thread_scratch<ulong, 0>(wfn.nword2);
+    long *occs = thread_scratch<long, 0>(wfn.nocc);
+    long *virs = thread_scratch<long, 1>(wfn.nvir);
+    long *parity = thread_scratch<long, 2>(wfn.nbasis * 2 + 2);
+    for (long idet = start; idet < end; ++idet) {
+        SparseOpCounter counter;
+        gen.add_row(ham, wfn, idet, det, occs, virs, parity, counter);
+        indptr[idet + 1] = counter.nnz;
+    }
+}
+
+template<class WfnType, class Index>
+void SparseOp::fill_rows(const SQuantOp &ham, const WfnType &wfn, const long start,
+                         const long end, double *dst_data, Index *dst_indices) {
+    SparseOpRows gen = row_generator(ncol);
+    ulong *det = thread_scratch<ulong, 0>(wfn.nword2);
+    long *occs = thread_scratch<long, 0>(wfn.nocc);
+    long *virs = thread_scratch<long, 1>(wfn.nvir);
+    long *parity = thread_scratch<long, 2>(wfn.nbasis * 2 + 2);
+    for (long idet = start, pos; idet < end; ++idet) {
+        pos = indptr[idet] - indptr[start];
+        SparseOpWriter<Index> writer{dst_data + pos, dst_indices + pos};
+        gen.add_row(ham, wfn, idet, det, occs, virs, parity, writer);
+        sparseop_sort_row(dst_data + pos, dst_indices + pos, indptr[idet + 1] - indptr[idet]);
+    }
+}
+
+template<class WfnType, class Sink>
+void SparseOpRows::add_row(const SQuantOp &ham, const WfnType &wfn, const long idet, ulong *det,
+                       long *occs, long *virs, long *parity, Sink &sink) const {
+    // the determinant kernels are selected for the number of words once per row
+    switch (wfn.nword) {
+    case 1:
+        return add_row<1>(ham, wfn, idet, det, occs, virs, parity, sink);
+    case 2:
+        return add_row<2>(ham, wfn, idet, det, occs, virs, parity, sink);
+    case 4:
+        return add_row<4>(ham, wfn, idet, det, occs, virs, parity, sink);
+    default:
+        return add_row<0>(ham, wfn, idet, det, occs, virs, parity, sink);
+    }
+}
+
+template<long NW, class Sink>
+void SparseOpRows::add_row(const SQuantOp &ham, const DOCIWfn &wfn, const long idet, ulong *det, long *occs,
+                       long *virs, long *, Sink &sink) const {
     /* long i, j, k, l, jdet, jmin = symmetric ? idet - 1 : -1; */
-    long  jdet, jmin = symmetric ? idet : Max<long>();
+    long jmin = symmetric ? idet : Max<long>();
     double val1 = 0.0, val2 = 0.0;
     wfn.copy_det(idet, det);
-    fill_occs(wfn.nword, det, occs);
-    fill_virs(wfn.nword, wfn.nbasis, det, virs);
+    fill_occs<NW>(wfn.nword, det, occs);
+    fill_virs<NW>(wfn.nword, wfn.nbasis, det, virs);
+    Hash rank_r = wfn.rank_det(det);
+    // the pair-excited determinants are looked up in batches
+    DetBatch<DOCIWfn, long> batch(wfn);
+    auto add_pair = [&](const long jdet, const ulong *, const Hash &, const long kl) {
+        // check if excited determinant is in wfn
+        if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
+            // add single/"pair"-excited matrix element
+            sink(ham.v[kl], jdet);
+        }
+    };
     // loop over occupied indices
     for (long i = 0, j, k, l ; i < wfn.nocc_up; ++i) {
         k = occs[i];
@@ -238,43 +1201,72 @@ void SparseOp::add_row(const SQuantOp &ham, const DOCIWfn &wfn, const long idet,
             // compute single/"pair"-excited elements
             l = virs[j];
             excite_det(k, l, det);
-            jdet = wfn.index_det(det);
-            // check if excited determinant is in wfn
-            if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
-                // add single/"pair"-excited matrix element
-                append<double>(data, ham.v[k * wfn.nbasis + l]);
-                append<long>(indices, jdet);
-            }
+            batch.push(det, wfn.excite_rank(rank_r, k, l), k * wfn.nbasis + l, add_pair);
             excite_det(l, k, det);
         }
     }
+    batch.resolve(add_pair);
     // add diagonal element to matrix
     if (idet < ncol) {
-        append<double>(data, val1 + val2 * 2);
-        append<long>(indices, idet);
+        sink(val1 + val2 * 2, idet);
     }
-    // add pointer to next row's indices
-    append<long>(indptr, indices.size());
 }
 
-void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long idet, ulong *det_up,
-                       long *occs_up, long *virs_up) {
+template<long NW, class Sink>
+void SparseOpRows::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long idet, ulong *det_up,
+                       long *occs_up, long *virs_up, long *parity_up, Sink &sink) const {
     long i, j, k, l, ii, jj, kk, ll, jdet, jmin = symmetric ? idet : Max<long>();
     long ioffset, koffset, sign_up;
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
     long n3 = n1 * n2;
     double val1, val2 = 0.0;
+    Hash rank_r, rank_i;
     const ulong *rdet_up = wfn.det_ptr(idet);
     const ulong *rdet_dn = rdet_up + wfn.nword;
     ulong *det_dn = det_up + wfn.nword;
     long *occs_dn = occs_up + wfn.nocc_up;
     long *virs_dn = virs_up + wfn.nvir_up;
+    long *parity_dn = parity_up + n1 + 1;
+    if (connected)
+        return add_row_connected<NW>(ham, wfn, idet, occs_up, parity_up, sink);
     std::memcpy(det_up, rdet_up, sizeof(ulong) * wfn.nword2);
-    fill_occs(wfn.nword, rdet_up, occs_up);
-    fill_occs(wfn.nword, rdet_dn, occs_dn);
-    fill_virs(wfn.nword, wfn.nbasis, rdet_up, virs_up);
-    fill_virs(wfn.nword, wfn.nbasis, rdet_dn, virs_dn);
+    fill_occs<NW>(wfn.nword, rdet_up, occs_up);
+    fill_occs<NW>(wfn.nword, rdet_dn, occs_dn);
+    fill_virs<NW>(wfn.nword, wfn.nbasis, rdet_up, virs_up);
+    fill_virs<NW>(wfn.nword, wfn.nbasis, rdet_dn, virs_dn);
+    fill_parity<NW>(wfn.nword, n1, rdet_up, parity_up);
+    fill_parity<NW>(wfn.nword, n1, rdet_dn, parity_dn);
+    rank_r = wfn.rank_det(rdet_up);
+    // the double excitations of each (i, j, k) are looked up in batches
+    DetBatch<FullCIWfn, long> batch(wfn);
+    auto add_11 = [&](const long jdet, const ulong *, const Hash &, const long ll) {
+        // check if 1-1 excited determinant is in wfn
+        if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
+            // add 1-1 matrix element
+            sink(sign_up * phase_single_det(parity_dn, kk, ll) *
+                     ham.two_mo[koffset + n1 * jj + ll],
+                 jdet);
+        }
+    };
+    auto add_20 = [&](const long jdet, const ulong *, const Hash &, const long ll) {
+        // check if 2-0 excited determinant is in wfn
+        if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
+            // add 2-0 matrix element
+            sink(phase_double_det(parity_up, ii, kk, jj, ll) *
+                     (ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj]),
+                 jdet);
+        }
+    };
+    auto add_02 = [&](const long jdet, const ulong *, const Hash &, const long ll) {
+        // check if 0-2 excited determinant is in wfn
+        if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
+            // add 0-2 matrix element
+            sink(phase_double_det(parity_dn, ii, kk, jj, ll) *
+                     (ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj]),
+                 jdet);
+        }
+    };
     // loop over spin-up occupied indices
     for (i = 0; i < wfn.nocc_up; ++i) {
         ii = occs_up[i];
@@ -295,8 +1287,9 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
             jj = virs_up[j];
             // 1-0 excitation elements
             excite_det(ii, jj, det_up);
-            sign_up = phase_single_det(wfn.nword, ii, jj, rdet_up);
-            jdet = wfn.index_det(det_up);
+            sign_up = phase_single_det(parity_up, ii, jj);
+            rank_i = wfn.excite_rank(rank_r, ii, jj);
+            jdet = wfn.index_excited(det_up, rank_i);
             // check if 1-0 excited determinant is in wfn
             if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
                 // compute 1-0 matrix element
@@ -311,8 +1304,7 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
                     val1 += ham.two_mo[ioffset + n2 * kk + n1 * jj + kk];
                 }
                 // add 1-0 matrix element
-                append<double>(data, sign_up * val1);
-                append<long>(indices, jdet);
+                sink(sign_up * val1, jdet);
             }
             // loop over spin-down occupied indices
             for (k = 0; k < wfn.nocc_dn; ++k) {
@@ -323,17 +1315,10 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
                     ll = virs_dn[l];
                     // 1-1 excitation elements
                     excite_det(kk, ll, det_dn);
-                    jdet = wfn.index_det(det_up);
-                    // check if 1-1 excited determinant is in wfn
-                    if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
-                        // add 1-1 matrix element
-                        append<double>(data, sign_up *
-                                                 phase_single_det(wfn.nword, kk, ll, rdet_dn) *
-                                                 ham.two_mo[koffset + n1 * jj + ll]);
-                        append<long>(indices, jdet);
-                    }
+                    batch.push(det_up, wfn.excite_rank(rank_i, n1 + kk, n1 + ll), ll, add_11);
                     excite_det(ll, kk, det_dn);
                 }
+                batch.resolve(add_11);
             }
             // loop over spin-up occupied indices
             for (k = i + 1; k < wfn.nocc_up; ++k) {
@@ -344,17 +1329,10 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
                     ll = virs_up[l];
                     // 2-0 excitation elements
                     excite_det(kk, ll, det_up);
-                    jdet = wfn.index_det(det_up);
-                    // check if 2-0 excited determinant is in wfn
-                    if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
-                        // add 2-0 matrix element
-                        append<double>(data, phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_up) *
-                                                 (ham.two_mo[koffset + n1 * jj + ll] -
-                                                  ham.two_mo[koffset + n1 * ll + jj]));
-                        append<long>(indices, jdet);
-                    }
+                    batch.push(det_up, wfn.excite_rank(rank_i, kk, ll), ll, add_20);
                     excite_det(ll, kk, det_up);
                 }
+                batch.resolve(add_20);
             }
             excite_det(jj, ii, det_up);
         }
@@ -375,7 +1353,8 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
             jj = virs_dn[j];
             // 0-1 excitation elements
             excite_det(ii, jj, det_dn);
-            jdet = wfn.index_det(det_up);
+            rank_i = wfn.excite_rank(rank_r, n1 + ii, n1 + jj);
+            jdet = wfn.index_excited(det_up, rank_i);
             // check if 0-1 excited determinant is in wfn
             if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
                 // compute 0-1 matrix element
@@ -390,8 +1369,7 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
                     val1 += ham.two_mo[koffset + n1 * jj + kk] - ham.two_mo[koffset + n1 * kk + jj];
                 }
                 // add 0-1 matrix element
-                append<double>(data, phase_single_det(wfn.nword, ii, jj, rdet_dn) * val1);
-                append<long>(indices, jdet);
+                sink(phase_single_det(parity_dn, ii, jj) * val1, jdet);
             }
             // loop over spin-down occupied indices
             for (k = i + 1; k < wfn.nocc_dn; ++k) {
@@ -402,32 +1380,145 @@ void SparseOp::add_row(const SQuantOp &ham, const FullCIWfn &wfn, const long ide
                     ll = virs_dn[l];
                     // 0-2 excitation elements
                     excite_det(kk, ll, det_dn);
-                    jdet = wfn.index_det(det_up);
-                    // check if excited determinant is in wfn
-                    if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
-                        // add 0-2 matrix element
-                        append<double>(data, phase_double_det(wfn.nword, ii, kk, jj, ll, rdet_dn) *
-                                                 (ham.two_mo[koffset + n1 * jj + ll] -
-                                                  ham.two_mo[koffset + n1 * ll + jj]));
-                        append<long>(indices, jdet);
-                    }
+                    batch.push(det_up, wfn.excite_rank(rank_i, n1 + kk, n1 + ll), ll, add_02);
                     excite_det(ll, kk, det_dn);
                 }
+                batch.resolve(add_02);
             }
             excite_det(jj, ii, det_dn);
         }
     }
     // add diagonal element to matrix
     if (idet < ncol) {
-        append<double>(data, val2);
-        append<long>(indices, idet);
+        sink(val2, idet);
+    }
+}
+
+template<long NW, class Sink>
+void SparseOpRows::add_row_connected(const SQuantOp &ham, const FullCIWfn &wfn, const long idet,
+                                 long *occs_up, long *parity_up, Sink &sink) const {
+    long i, k, ii, jj, kk, ll, nexc_up, nexc_dn, ioffset, koffset;
+    long jmin = symmetric ? idet : Max<long>();
+    long holes_up[2], parts_up[2], holes_dn[2], parts_dn[2];
+    long n1 = wfn.nbasis;
+    long n2 = n1 * n1;
+    long n3 = n1 * n2;
+    double val;
+    const ulong *rdet_up = wfn.det_ptr(idet);
+    const ulong *rdet_dn = rdet_up + wfn.nword;
+    long *occs_dn = occs_up + wfn.nocc_up;
+    long *parity_dn = parity_up + n1 + 1;
+    fill_occs<NW>(wfn.nword, rdet_up, occs_up);
+    fill_occs<NW>(wfn.nword, rdet_dn, occs_dn);
+    fill_parity<NW>(wfn.nword, n1, rdet_up, parity_up);
+    fill_parity<NW>(wfn.nword, n1, rdet_dn, parity_dn);
+    // only the determinants of the wfn connected to idet are visited
+    Vector<long> jdets;
+    connected->fill_connected(wfn, idet, jdets);
+    for (long jdet : jdets) {
+        if (jdet == idet || jdet >= jmin || jdet >= ncol)
+            continue;
+        const ulong *jdet_up = wfn.det_ptr(jdet);
+        nexc_up = diff_det(wfn.nword, rdet_up, jdet_up, holes_up, parts_up);
+        nexc_dn = diff_det(wfn.nword, rdet_dn, jdet_up + wfn.nword, holes_dn, parts_dn);
+        if (nexc_up == 1 && nexc_dn == 0) {
+            // 1-0 matrix element
+            ii = holes_up[0];
+            jj = parts_up[0];
+            ioffset = n3 * ii;
+            val = ham.one_mo[n1 * ii + jj];
+            for (k = 0; k < wfn.nocc_up; ++k) {
+                kk = occs_up[k];
+                koffset = ioffset + n2 * kk;
+                val += ham.two_mo[koffset + n1 * jj + kk] - ham.two_mo[koffset + n1 * kk + jj];
+            }
+            for (k = 0; k < wfn.nocc_dn; ++k) {
+                kk = occs_dn[k];
+                val += ham.two_mo[ioffset + n2 * kk + n1 * jj + kk];
+            }
+            sink(phase_single_det(parity_up, ii, jj) * val, jdet);
+        } else if (nexc_up == 0 && nexc_dn == 1) {
+            // 0-1 matrix element
+            ii = holes_dn[0];
+            jj = parts_dn[0];
+            ioffset = n3 * ii;
+            val = ham.one_mo[n1 * ii + jj];
+            for (k = 0; k < wfn.nocc_up; ++k) {
+                kk = occs_up[k];
+                val += ham.two_mo[ioffset + n2 * kk + n1 * jj + kk];
+            }
+            for (k = 0; k < wfn.nocc_dn; ++k) {
+                kk = occs_dn[k];
+                koffset = ioffset + n2 * kk;
+                val += ham.two_mo[koffset + n1 * jj + kk] - ham.two_mo[koffset + n1 * kk + jj];
+            }
+            sink(phase_single_det(parity_dn, ii, jj) * val, jdet);
+        } else if (nexc_up == 1) {
+            // 1-1 matrix element
+            ii = holes_up[0];
+            jj = parts_up[0];
+            kk = holes_dn[0];
+            ll = parts_dn[0];
+            sink(phase_single_det(parity_up, ii, jj) *
+                     phase_single_det(parity_dn, kk, ll) *
+                     ham.two_mo[n3 * ii + n2 * kk + n1 * jj + ll],
+                 jdet);
+        } else if (nexc_up == 2) {
+            // 2-0 matrix element
+            ii = holes_up[0];
+            kk = holes_up[1];
+            jj = parts_up[0];
+            ll = parts_up[1];
+            koffset = n3 * ii + n2 * kk;
+            sink(phase_double_det(parity_up, ii, kk, jj, ll) *
+                     (ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj]),
+                 jdet);
+        } else {
+            // 0-2 matrix element
+            ii = holes_dn[0];
+            kk = holes_dn[1];
+            jj = parts_dn[0];
+            ll = parts_dn[1];
+            koffset = n3 * ii + n2 * kk;
+            sink(phase_double_det(parity_dn, ii, kk, jj, ll) *
+                     (ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj]),
+                 jdet);
+        }
+    }
+    // add diagonal element to matrix
+    if (idet < ncol) {
+        val = 0.0;
+        for (i = 0; i < wfn.nocc_up; ++i) {
+            ii = occs_up[i];
+            ioffset = n3 * ii;
+            val += ham.one_mo[(n1 + 1) * ii];
+            for (k = i + 1; k < wfn.nocc_up; ++k) {
+                kk = occs_up[k];
+                koffset = ioffset + n2 * kk;
+                val += ham.two_mo[koffset + n1 * ii + kk] - ham.two_mo[koffset + n1 * kk + ii];
+            }
+            for (k = 0; k < wfn.nocc_dn; ++k) {
+                kk = occs_dn[k];
+                val += ham.two_mo[ioffset + n2 * kk + n1 * ii + kk];
+            }
+        }
+        for (i = 0; i < wfn.nocc_dn; ++i) {
+            ii = occs_dn[i];
+            ioffset = n3 * ii;
+            val += ham.one_mo[(n1 + 1) * ii];
+            for (k = i + 1; k < wfn.nocc_dn; ++k) {
+                kk = occs_dn[k];
+                koffset = ioffset + n2 * kk;
+                val += ham.two_mo[koffset + n1 * ii + kk] - ham.two_mo[koffset + n1 * kk + ii];
+            }
+        }
+        sink(val, idet);
     }
-    // add pointer to next row's indices
-    append<long>(indptr, indices.size());
 }
 
-void SparseOp::add_row(const SQuantOp &ham, const GenCIWfn &wfn, const long idet, ulong *det, long *occs,
-                       long *virs) {
+template<long NW, class Sink>
+void SparseOpRows::add_row(const SQuantOp &ham, const GenCIWfn &wfn, const long idet, ulong *det, long *occs,
+                       long *virs, long *parity, Sink &sink) const {
     long jdet, jmin = symmetric ? idet : Max<long>();
     long n1 = wfn.nbasis;
     long n2 = n1 * n1;
@@ -436,10 +1527,24 @@ void SparseOp::add_row(const SQuantOp &ham, const GenCIWfn &wfn, const long idet
     const ulong *rdet = wfn.det_ptr(idet);
     // fill working vectors
     std::memcpy(det, rdet, sizeof(ulong) * wfn.nword);
-    fill_occs(wfn.nword, rdet, occs);
-    fill_virs(wfn.nword, wfn.nbasis, rdet, virs);
+    fill_occs<NW>(wfn.nword, rdet, occs);
+    fill_virs<NW>(wfn.nword, wfn.nbasis, rdet, virs);
+    fill_parity<NW>(wfn.nword, n1, rdet, parity);
+    Hash rank_i, rank_r = wfn.rank_det(rdet);
+    // the double excitations of each (i, j, k) are looked up in batches
+    long ii, jj, kk, koffset;
+    DetBatch<GenCIWfn, long> batch(wfn);
+    auto add_double = [&](const long jdet, const ulong *, const Hash &, const long ll) {
+        // check if double excited determinant is in wfn
+        if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
+            // add double matrix element
+            sink(phase_double_det(parity, ii, kk, jj, ll) *
+                     (ham.two_mo[koffset + n1 * jj + ll] - ham.two_mo[koffset + n1 * ll + jj]),
+                 jdet);
+        }
+    };
     // loop over occupied indices
-    for (long i = 0, j, k, l, ii, jj, kk, ll, ioffset, koffset; i < wfn.nocc; ++i) {
+    for (long i = 0, j, k, l, ll, ioffset; i < wfn.nocc; ++i) {
         ii = occs[i];
         ioffset = n3 * ii;
         // compute part of diagonal matrix element
@@ -450,11 +1555,12 @@ void SparseOp::add_row(const SQuantOp &ham, const GenCIWfn &wfn, const long idet
             val2 += ham.two_mo[koffset + n1 * ii + kk] - ham.two_mo[koffset + n1 * kk + ii];
         }
         // loop over virtual indices
-        for (j = 0; j < wfn.nvir; ++j) {
+        for (j = 0; j < wfn.nvir_up; ++j) {
             jj = virs[j];
             // single excitation elements
             excite_det(ii, jj, det);
-            jdet = wfn.index_det(det);
+            rank_i = wfn.excite_rank(rank_r, ii, jj);
+            jdet = wfn.index_excited(det, rank_i);
             // check if singly-excited determinant is in wfn
             if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
                 // compute single excitation matrix element
@@ -465,52 +1571,67 @@ void SparseOp::add_row(const SQuantOp &ham, const GenCIWfn &wfn, const long idet
                     val1 += ham.two_mo[koffset + n1 * jj + kk] - ham.two_mo[koffset + n1 * kk + jj];
                 }
                 // add single excitation matrix element
-                append<double>(data, phase_single_det(wfn.nword, ii, jj, rdet) * val1);
-                append<long>(indices, jdet);
+                sink(phase_single_det(parity, ii, jj) * val1, jdet);
             }
             // loop over occupied indices
             for (k = i + 1; k < wfn.nocc; ++k) {
                 kk = occs[k];
                 koffset = ioffset + n2 * kk;
                 // loop over virtual indices
-                for (l = j + 1; l < wfn.nvir; ++l) {
+                for (l = j + 1; l < wfn.nvir_up; ++l) {
                     ll = virs[l];
                     // double excitation elements
                     excite_det(kk, ll, det);
-                    jdet = wfn.index_det(det);
-                    // check if double excited determinant is in wfn
-                    if ((jdet != -1) && (jdet < jmin) && (jdet < ncol)) {
-                        // add double matrix element
-                        append<double>(data, phase_double_det(wfn.nword, ii, kk, jj, ll, rdet) *
-                                                 (ham.two_mo[koffset + n1 * jj + ll] -
-                                                  ham.two_mo[koffset + n1 * ll + jj]));
-                        append<long>(indices, jdet);
-                    }
+                    batch.push(det, wfn.excite_rank(rank_i, kk, ll), ll, add_double);
                     excite_det(ll, kk, det);
                 }
+                batch.resolve(add_double);
             }
             excite_det(jj, ii, det);
         }
     }
     // add diagonal element to matrix
     if (idet < ncol) {
-        append<double>(data, val2);
-        append<long>(indices, idet);
+        sink(val2, idet);
     }
-    // add pointer to next row's indices
-    append<long>(indptr, indices.size());
 }
 
+template void SparseOpRows::add_row(const SQuantOp &, const DOCIWfn &, const long, ulong *, long *,
+                                long *, long *, SparseOpDot &) const;
+
+template void SparseOpRows::add_row(const SQuantOp &, const FullCIWfn &, const long, ulong *, long *,
+                                long *, long *, SparseOpDot &) const;
+
+template void SparseOpRows::add_row(const SQuantOp &, const GenCIWfn &, const long, ulong *, long *,
+                                long *, long *, SparseOpDot &) const;
+
 Array<double> SparseOp::py_data() const {
-    return Array<double>(data.size(), &data[0]);
+    if (scratch) {
+        Array<double> array(size);
+        read_scratch<long>(0, size, reinterpret_cast<double *>(array.request().ptr), nullptr);
+        return array;
+    }
+    return Array<double>(size, data_ptr(0));
 }
 
-Array<long> SparseOp::py_indices() const {
-    return Array<long>(indices.size(), &indices[0]);
+pybind11::array SparseOp::py_indices() const {
+    if (scratch && compact) {
+        Array<std::int32_t> array(size);
+        read_scratch<std::int32_t>(0, size, nullptr,
+                                   reinterpret_cast<std::int32_t *>(array.request().ptr));
+        return array;
+    } else if (scratch) {
+        Array<long> array(size);
+        read_scratch<long>(0, size, nullptr, reinterpret_cast<long *>(array.request().ptr));
+        return array;
+    } else if (compact) {
+        return Array<std::int32_t>(size, indices_ptr<std::int32_t>(0));
+    }
+    return Array<long>(size, indices_ptr<long>(0));
 }
 
 Array<long> SparseOp::py_indptr() const {
-    return Array<long>(indptr.size(), &indptr[0]);
+    return Array<long>(nrow + 1, indptr_ptr(0));
 }
 
 } // namespace pyci
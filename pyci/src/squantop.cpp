@@ -27,7 +27,8 @@ SQuantOp::SQuantOp(void) {
 SQuantOp::SQuantOp(const SQuantOp &ham)
     : nbasis(ham.nbasis), ecore(ham.ecore), one_mo(ham.one_mo), two_mo(ham.two_mo), h(ham.h),
       v(ham.v), w(ham.w), one_mo_array(ham.one_mo_array), two_mo_array(ham.two_mo_array),
-      h_array(ham.h_array), v_array(ham.v_array), w_array(ham.w_array) {
+      h_array(ham.h_array), v_array(ham.v_array), w_array(ham.w_array), hb_pairs(ham.hb_pairs),
+      hb_same(ham.hb_same), hb_opposite(ham.hb_opposite) {
 }
 
 SQuantOp::SQuantOp(SQuantOp &&ham) noexcept
@@ -36,7 +37,9 @@ SQuantOp::SQuantOp(SQuantOp &&ham) noexcept
       h(std::exchange(ham.h, nullptr)), v(std::exchange(ham.v, nullptr)),
       w(std::exchange(ham.w, nullptr)), one_mo_array(std::move(ham.one_mo_array)),
       two_mo_array(std::move(ham.two_mo_array)), h_array(std::move(ham.h_array)),
-      v_array(std::move(ham.v_array)), w_array(std::move(ham.w_array)) {
+      v_array(std::move(ham.v_array)), w_array(std::move(ham.w_array)),
+      hb_pairs(std::move(ham.hb_pairs)), hb_same(std::move(ham.hb_same)),
+      hb_opposite(std::move(ham.hb_opposite)) {
 }
 
 namespace {
@@ -74,6 +77,33 @@ T read_parameter(const std::string &header, const std::string &name,
     return parameter;
 }
 
+template<class Coupling>
+std::shared_ptr<const HeatBath> make_heatbath(const long nkey, const long ntarget,
+                                              const double cutoff, Coupling coupling) {
+    // for each key, the targets with a coupling above the cutoff by decreasing magnitude (ties by
+    // target)
+    auto hb = std::make_shared<HeatBath>();
+    Vector<std::pair<double, long>> row;
+    hb->cutoff = cutoff;
+    hb->ptr.reserve(nkey + 1);
+    hb->ptr.push_back(0);
+    for (long key = 0; key < nkey; ++key) {
+        row.clear();
+        for (long target = 0; target < ntarget; ++target) {
+            double val = std::abs(coupling(key, target));
+            if (val != 0.0 && val > cutoff)
+                row.emplace_back(-val, target);
+        }
+        std::sort(row.begin(), row.end());
+        for (const auto &entry : row) {
+            hb->ind.push_back(entry.second);
+            hb->val.push_back(-entry.first);
+        }
+        hb->ptr.push_back(hb->ind.size());
+    }
+    return hb;
+}
+
 } // namespace
 
 SQuantOp::SQuantOp(const std::string &filename) {
@@ -182,6 +212,48 @@ SQuantOp::SQuantOp(const double e, const Array<double> mo1, const Array<double>
     }
 }
 
+const HeatBath &SQuantOp::heatbath_pairs(const double cutoff) const {
+    if (!hb_pairs || hb_pairs->cutoff > cutoff)
+        hb_pairs = make_heatbath(nbasis, nbasis, cutoff, [this](const long k, const long l) {
+            return (k == l) ? 0.0 : v[k * nbasis + l];
+        });
+    return *hb_pairs;
+}
+
+const HeatBath &SQuantOp::heatbath_same(const double cutoff) const {
+    if (!hb_same || hb_same->cutoff > cutoff) {
+        long n1 = nbasis, n2 = n1 * n1;
+        // rows only for the pairs p < q, in the order of HeatBath::pair_key
+        AlignedVector<long> pairs;
+        pairs.reserve(n1 * (n1 - 1) / 2);
+        for (long p = 0; p < n1; ++p)
+            for (long q = p + 1; q < n1; ++q)
+                pairs.push_back(p * n1 + q);
+        hb_same = make_heatbath(pairs.size(), n2, cutoff,
+                                [this, &pairs, n1, n2](const long key, const long rs) {
+                                    long pq = pairs[key], p = pq / n1, q = pq % n1, r = rs / n1,
+                                         s = rs % n1;
+                                    if (r >= s || r == p || r == q || s == p || s == q)
+                                        return 0.0;
+                                    return two_mo[pq * n2 + r * n1 + s] -
+                                           two_mo[pq * n2 + s * n1 + r];
+                                });
+    }
+    return *hb_same;
+}
+
+const HeatBath &SQuantOp::heatbath_opposite(const double cutoff) const {
+    if (!hb_opposite || hb_opposite->cutoff > cutoff) {
+        long n1 = nbasis, n2 = n1 * n1;
+        hb_opposite = make_heatbath(n2, n2, cutoff, [this, n1, n2](const long pq, const long rs) {
+            if (rs / n1 == pq / n1 || rs % n1 == pq % n1)
+                return 0.0;
+            return two_mo[pq * n2 + rs];
+        });
+    }
+    return *hb_opposite;
+}
+
 void SQuantOp::to_file(const std::string &filename, const long nelec, const long ms2,
                   const double tol) const {
     bool uhf = false;
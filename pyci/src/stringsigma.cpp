@@ -0,0 +1,210 @@
+/* This file is part of PyCI.
+ *
+ * PyCI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * PyCI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PyCI. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <pyci.h>
+
+namespace pyci {
+
+/* The determinants of a complete FullCI space are the direct product of the alpha and beta
+ * strings, so the coefficients form a (nstr_up, nstr_dn) matrix C indexed by the colex ranks of
+ * the strings, and
+ *
+ *     sigma = H_up C + C H_dn^T + sum_{pqrs} <pq|rs> E^up_pr C (E^dn_qs)^T,
+ *
+ * where H_up and H_dn are the same-spin Hamiltonians in string space and the last (opposite-spin)
+ * term runs over the single replacement lists of the strings, including p == r and q == s. */
+
+StringSigma::StringSigma(const SQuantOp &ham, const FullCIWfn &wfn)
+    : nbasis(wfn.nbasis), nstr_up(wfn.maxrank_up), nstr_dn(wfn.maxrank_dn) {
+    add_strings(ham, 0, wfn.nocc_up);
+    add_strings(ham, 1, wfn.nocc_dn);
+    // opposite-spin integrals, laid out so that integrals[(p * n + r) * n^2 + q * n + s] is
+    // <pq|rs> for alpha replacement r -> p and beta replacement s -> q
+    long n1 = nbasis, n2 = n1 * n1, n3 = n1 * n2;
+    integrals.resize(n2 * n2);
+    for (long p = 0; p < n1; ++p)
+        for (long q = 0; q < n1; ++q)
+            for (long r = 0; r < n1; ++r)
+                for (long s = 0; s < n1; ++s)
+                    integrals[(p * n1 + r) * n2 + q * n1 + s] =
+                        ham.two_mo[p * n3 + q * n2 + r * n1 + s];
+    // product-space address of each determinant, kept only if they are not already in order
+    bool ordered = true;
+    address.resize(wfn.ndet);
+    for (long i = 0; i < wfn.ndet; ++i) {
+        const ulong *det = wfn.det_ptr(i);
+        address[i] = rank_colex(nbasis, wfn.nocc_up, det) * nstr_dn +
+                     rank_colex(nbasis, wfn.nocc_dn, det + wfn.nword);
+        ordered = ordered && (address[i] == i);
+    }
+    if (ordered)
+        AlignedVector<long>().swap(address);
+}
+
+bool StringSigma::is_complete(const FullCIWfn &wfn) {
+    return wfn.ndet == wfn.maxrank_up * wfn.maxrank_dn;
+}
+
+void StringSigma::add_strings(const SQuantOp &ham, const long spin, const long nocc) {
+    long n1 = nbasis, n2 = n1 * n1, n3 = n1 * n2, nstr = spin ? nstr_dn : nstr_up;
+    long nvir = nbasis - nocc, nword = nword_det(nbasis), jstr, sign;
+    double val;
+    AlignedVector<long> occs(nocc + 1), virs(nvir);
+    AlignedVector<ulong> ref(nword), det(nword);
+    AlignedVector<long> &rptr = rep_ptr[spin], &rstr = rep_str[spin], &rpair = rep_pair[spin];
+    AlignedVector<double> &rsign = rep_sign[spin];
+    AlignedVector<long> &hptr = ham_ptr[spin], &hstr = ham_str[spin];
+    AlignedVector<double> &hval = ham_val[spin];
+    rptr.assign(1, 0);
+    hptr.assign(1, 0);
+    unrank_colex(nbasis, nocc, 0, &occs[0]);
+    occs[nocc] = nbasis + 1;
+    for (long istr = 0; istr < nstr; ++istr) {
+        std::fill(ref.begin(), ref.end(), 0UL);
+        fill_det(nocc, &occs[0], &ref[0]);
+        fill_virs(nword, nbasis, &ref[0], &virs[0]);
+        det = ref;
+        // diagonal element
+        val = 0.0;
+        for (long i = 0, ii, koffset; i < nocc; ++i) {
+            ii = occs[i];
+            val += ham.one_mo[(n1 + 1) * ii];
+            for (long k = i + 1, kk; k < nocc; ++k) {
+                kk = occs[k];
+                koffset = n3 * ii + n2 * kk;
+                val += ham.two_mo[koffset + n1 * ii + kk] - ham.two_mo[koffset + n1 * kk + ii];
+            }
+        }
+        hstr.push_back(istr);
+        hval.push_back(val);
+        for (long i = 0, ii, ioffset; i < nocc; ++i) {
+            ii = occs[i];
+            ioffset = n3 * ii;
+            // replacement ii -> ii
+            rstr.push_back(istr);
+            rpair.push_back(ii * n1 + ii);
+            rsign.push_back(1.0);
+            for (long j = 0, jj; j < nvir; ++j) {
+                jj = virs[j];
+                // single replacement ii -> jj
+                excite_det(ii, jj, &det[0]);
+                jstr = rank_colex(nbasis, nocc, &det[0]);
+                sign = phase_single_det(nword, ii, jj, &ref[0]);
+                rstr.push_back(jstr);
+                rpair.push_back(ii * n1 + jj);
+                rsign.push_back(sign);
+                val = ham.one_mo[n1 * ii + jj];
+                for (long k = 0, kk, koffset; k < nocc; ++k) {
+                    kk = occs[k];
+                    koffset = ioffset + n2 * kk;
+                    val += ham.two_mo[koffset + n1 * jj + kk] - ham.two_mo[koffset + n1 * kk + jj];
+                }
+                hstr.push_back(jstr);
+                hval.push_back(sign * val);
+                // double replacements ii, kk -> jj, ll
+                for (long k = i + 1, kk, koffset; k < nocc; ++k) {
+                    kk = occs[k];
+                    koffset = ioffset + n2 * kk;
+                    for (long l = j + 1, ll; l < nvir; ++l) {
+                        ll = virs[l];
+                        excite_det(kk, ll, &det[0]);
+                        hstr.push_back(rank_colex(nbasis, nocc, &det[0]));
+                        hval.push_back(phase_double_det(nword, ii, kk, jj, ll, &ref[0]) *
+                                       (ham.two_mo[koffset + n1 * jj + ll] -
+                                        ham.two_mo[koffset + n1 * ll + jj]));
+                        excite_det(ll, kk, &det[0]);
+                    }
+                }
+                excite_det(jj, ii, &det[0]);
+            }
+        }
+        rptr.push_back(rstr.size());
+        hptr.push_back(hstr.size());
+        if (istr + 1 < nstr)
+            next_colex(&occs[0]);
+    }
+}
+
+void StringSigma::perform_op_thread(const double *x, double *y, const long start,
+                                    const long end) const {
+    long n2 = nbasis * nbasis;
+    double val, sign;
+    const double *xr, *xj, *w;
+    double *yr;
+    for (long ia = start; ia < end; ++ia) {
+        xr = x + ia * nstr_dn;
+        yr = y + ia * nstr_dn;
+        // alpha-alpha: rows of C combined with the same-spin alpha Hamiltonian
+        std::fill(yr, yr + nstr_dn, 0.0);
+        for (long k = ham_ptr[0][ia]; k < ham_ptr[0][ia + 1]; ++k) {
+            val = ham_val[0][k];
+            xj = x + ham_str[0][k] * nstr_dn;
+            for (long ib = 0; ib < nstr_dn; ++ib)
+                yr[ib] += val * xj[ib];
+        }
+        // beta-beta: each row of C times the same-spin beta Hamiltonian
+        for (long ib = 0; ib < nstr_dn; ++ib) {
+            val = 0.0;
+            for (long k = ham_ptr[1][ib]; k < ham_ptr[1][ib + 1]; ++k)
+                val += ham_val[1][k] * xr[ham_str[1][k]];
+            yr[ib] += val;
+        }
+        // alpha-beta: each alpha replacement applies a one-body beta operator to a row of C
+        for (long k = rep_ptr[0][ia]; k < rep_ptr[0][ia + 1]; ++k) {
+            sign = rep_sign[0][k];
+            w = &integrals[rep_pair[0][k] * n2];
+            xj = x + rep_str[0][k] * nstr_dn;
+            for (long ib = 0; ib < nstr_dn; ++ib) {
+                val = 0.0;
+                for (long l = rep_ptr[1][ib]; l < rep_ptr[1][ib + 1]; ++l)
+                    val += rep_sign[1][l] * w[rep_pair[1][l]] * xj[rep_str[1][l]];
+                yr[ib] += sign * val;
+            }
+        }
+    }
+}
+
+void StringSigma::perform_op(const double *x, double *y) const {
+    // work in product (alpha-major) order, permuting the determinants in and out if needed
+    AlignedVector<double> xp, yp;
+    const double *px = x;
+    double *py = y;
+    if (!address.empty()) {
+        xp.resize(address.size());
+        yp.resize(address.size());
+        for (std::size_t i = 0; i < address.size(); ++i)
+            xp[address[i]] = x[i];
+        px = &xp[0];
+        py = &yp[0];
+    }
+    long nthread = get_num_threads();
+    long chunksize = nstr_up / nthread + static_cast<bool>(nstr_up % nthread);
+    while (nthread > 1 && chunksize * nstr_dn < PYCI_CHUNKSIZE_MIN) {
+        nthread /= 2;
+        chunksize = nstr_up / nthread + static_cast<bool>(nstr_up % nthread);
+    }
+    if (nthread == 1) {
+        perform_op_thread(px, py, 0, nstr_up);
+    } else {
+        parallel_run(nthread, [&](const long i) {
+            perform_op_thread(px, py, std::min(i * chunksize, nstr_up),
+                              std::min((i + 1) * chunksize, nstr_up));
+        });
+    }
+    for (std::size_t i = 0; i < address.size(); ++i)
+        y[i] = yp[address[i]];
+}
+
+} // namespace pyci
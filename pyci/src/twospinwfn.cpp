@@ -20,7 +20,7 @@ namespace pyci {
 TwoSpinWfn::TwoSpinWfn(const TwoSpinWfn &wfn) : Wfn(wfn) {
 }
 
-TwoSpinWfn::TwoSpinWfn(TwoSpinWfn &&wfn) noexcept : Wfn(wfn) {
+TwoSpinWfn::TwoSpinWfn(TwoSpinWfn &&wfn) : Wfn(wfn) {
 }
 
 TwoSpinWfn::TwoSpinWfn(const std::string &filename) {
@@ -43,13 +43,13 @@ TwoSpinWfn::TwoSpinWfn(const std::string &filename) {
     if (failed)
         throw std::ios_base::failure("error in file");
     Wfn::init(nb, nu, nd);
+    nspin = 2;
     ndet = n;
-    dict.reserve(n);
-    for (long idet = 0; idet < ndet; ++idet)
-        dict[rank_det(&dets[nword2 * idet])] = idet;
+    hash_dets();
 }
 
 TwoSpinWfn::TwoSpinWfn(const long nb, const long nu, const long nd) : Wfn(nb, nu, nd) {
+    nspin = 2;
 }
 
 TwoSpinWfn::TwoSpinWfn(const long nb, const long nu, const long nd, const long n, const ulong *ptr)
@@ -57,8 +57,7 @@ TwoSpinWfn::TwoSpinWfn(const long nb, const long nu, const long nd, const long n
     ndet = n;
     dets.resize(n * nword2);
     std::memcpy(&dets[0], ptr, sizeof(ulong) * n * nword2);
-    for (long i = 0; i < n; ++i)
-        dict[rank_det(ptr + i * nword2)] = i;
+    hash_dets();
 }
 
 TwoSpinWfn::TwoSpinWfn(const long nb, const long nu, const long nd, const long n, const long *ptr)
@@ -74,8 +73,7 @@ TwoSpinWfn::TwoSpinWfn(const long nb, const long nu, const long nd, const long n
         j += nu;
         k += nword;
     }
-    for (long i = 0; i < n; ++i)
-        dict[rank_det(&dets[i * nword2])] = i;
+    hash_dets();
 }
 
 TwoSpinWfn::TwoSpinWfn(const long nb, const long nu, const long nd, const Array<ulong> array)
@@ -127,13 +125,65 @@ void TwoSpinWfn::to_occ_array(const long low, const long high, long *ptr) const
 }
 
 long TwoSpinWfn::index_det(const ulong *det) const {
-    const auto &search = dict.find(rank_det(det));
-    return (search == dict.end()) ? -1 : search->second;
+    if (complete) {
+        long rank_up = rank_complete(nocc_up, det), rank_dn = rank_complete(nocc_dn, det + nword);
+        return (rank_up == -1 || rank_dn == -1) ? -1 : rank_up * maxrank_dn + rank_dn;
+    } else if (addressed) {
+        long e_up, e_dn, rank_up = rank_excited(nocc_up, 0, det, e_up),
+                         rank_dn = rank_excited(nocc_dn, 1, det + nword, e_dn);
+        if (rank_up == -1 || rank_dn == -1)
+            return -1;
+        long offset = offsets[e_up * (nocc_dn + 1) + e_dn];
+        return (offset == -1) ? -1 : offset + rank_up * nexcited(nocc_dn, e_dn) + rank_dn;
+    }
+    return find_det(det, rank_det(det));
+}
+
+long TwoSpinWfn::index_det(const ulong *det, Hash &rank) const {
+    // a Zobrist rank is given on input; any other rank is only needed (and only computed for
+    // direct indexing) if det is not found
+    if (complete || addressed) {
+        long idet = index_det(det);
+        if (idet == -1 && !zobrist)
+            rank = rank_det(det);
+        return idet;
+    } else if (!zobrist)
+        rank = rank_det(det);
+    return find_det(det, rank);
+}
+
+long TwoSpinWfn::index_excited(const ulong *det, const Hash rank) const {
+    // rank is the Zobrist rank of det from excite_rank, and is unused otherwise
+    if (complete || addressed)
+        return index_det(det);
+    return find_det(det, zobrist ? rank : rank_det(det));
 }
 
 long TwoSpinWfn::index_det_from_rank(const Hash rank) const {
+    if (complete || addressed)
+        throw std::runtime_error("wavefunction is not indexed by hash rank");
+    else if (bloom && !test_filter(rank))
+        return -1;
     const auto &search = dict.find(rank);
-    return (search == dict.end()) ? -1 : search->second;
+    return (search == dict.end()) ? -1 : *search;
+}
+
+long TwoSpinWfn::index_det_with_rank(const ulong *det, const Hash rank) const {
+    // rank is the full rank of det, e.g. from prefetch_det
+    if (complete || addressed)
+        return index_det(det);
+    return find_det(det, rank);
+}
+
+Hash TwoSpinWfn::prefetch_det(const ulong *det, const Hash rank) const {
+    // complete the rank of det as in index_excited, and fetch its bucket of the hash index
+    Hash full = zobrist ? rank : rank_det(det);
+    if (!(complete || addressed)) {
+        if (bloom && !filter.empty())
+            __builtin_prefetch(&filter[filter_pos(full)]);
+        dict.prefetch(full);
+    }
+    return full;
 }
 
 void TwoSpinWfn::copy_det(const long i, ulong *det) const {
@@ -141,25 +191,15 @@ void TwoSpinWfn::copy_det(const long i, ulong *det) const {
 }
 
 Hash TwoSpinWfn::rank_det(const ulong *det) const {
-    return spookyhash(nword2, det);
+    return zobrist ? rank_zobrist(2, det) : spookyhash(nword2, det);
 }
 
 long TwoSpinWfn::add_det(const ulong *det) {
-    if (dict.insert(std::make_pair(rank_det(det), ndet)).second) {
-        dets.resize(dets.size() + nword2);
-        std::memcpy(&dets[nword2 * ndet], det, sizeof(ulong) * nword2);
-        return ndet++;
-    }
-    return -1;
+    return insert_det(det, rank_det(det));
 }
 
 long TwoSpinWfn::add_det_with_rank(const ulong *det, const Hash rank) {
-    if (dict.insert(std::make_pair(rank, ndet)).second) {
-        dets.resize(dets.size() + nword2);
-        std::memcpy(&dets[nword2 * ndet], det, sizeof(ulong) * nword2);
-        return ndet++;
-    }
-    return -1;
+    return insert_det(det, rank);
 }
 
 long TwoSpinWfn::add_det_from_occs(const long *occs) {
@@ -231,47 +271,94 @@ void TwoSpinWfn::add_all_dets(long nthread) {
     }
     std::fill(dets.begin(), dets.end(), 0UL);
     dets.resize(ndet * nword2);
-    dict.clear();
-    dict.reserve(ndet);
-    Vector<std::thread> v_threads;
-    v_threads.reserve(nthread);
-    for (long i = 0; i < nthread; ++i)
-        v_threads.emplace_back(twospinwfn_add_all_dets_thread, nword, nbasis, nocc_up, nocc_dn,
-                               maxrank_up, maxrank_dn, &dets[0], i, nthread);
-    for (auto &thread : v_threads)
-        thread.join();
-    for (long i = 0; i < ndet; ++i)
-        dict[rank_det(&dets[i * nword2])] = i;
+    parallel_run(nthread, [&](const long i) {
+        twospinwfn_add_all_dets_thread(nword, nbasis, nocc_up, nocc_dn, maxrank_up, maxrank_dn,
+                                       &dets[0], i, nthread);
+    });
+    set_complete();
 }
 
 void TwoSpinWfn::add_excited_dets(const ulong *rdet, const long e_up, const long e_dn) {
-    if ((e_up == 0) && (e_dn == 0)) {
-        add_det(rdet);
+    if (complete)
         return;
-    }
     OneSpinWfn wfn_up(nbasis, nocc_up, nocc_up);
     wfn_up.add_excited_dets(&rdet[0], e_up);
     OneSpinWfn wfn_dn(nbasis, nocc_dn, nocc_dn);
     wfn_dn.add_excited_dets(&rdet[nword], e_dn);
+    if (!(wfn_up.ndet && wfn_dn.ndet))
+        return;
+    // whole excitation blocks of the same reference are appended without hashing
+    if (!ndet && !addressed)
+        set_addressed(rdet, nword2, (nocc_up + 1) * (nocc_dn + 1));
+    bool direct = addressed && !std::memcmp(rdet, &ref[0], sizeof(ulong) * nword2);
+    if (direct) {
+        long &offset = offsets[e_up * (nocc_dn + 1) + e_dn];
+        if (offset != -1)
+            return;
+        offset = ndet;
+        dets.resize((ndet + wfn_up.ndet * wfn_dn.ndet) * nword2);
+    } else if (addressed)
+        hash_dets();
     AlignedVector<ulong> det(nword2);
     long j;
     for (long i = 0; i < wfn_up.ndet; ++i) {
         std::memcpy(&det[0], wfn_up.det_ptr(i), sizeof(ulong) * nword);
         for (j = 0; j < wfn_dn.ndet; ++j) {
             std::memcpy(&det[nword], wfn_dn.det_ptr(j), sizeof(ulong) * nword);
-            add_det(&det[0]);
+            if (direct)
+                std::memcpy(&dets[nword2 * ndet++], &det[0], sizeof(ulong) * nword2);
+            else
+                add_det(&det[0]);
         }
     }
 }
 
 void TwoSpinWfn::add_dets_from_wfn(const TwoSpinWfn &wfn) {
-    for (const auto &keyval : wfn.dict)
-        add_det_with_rank(&wfn.dets[keyval.second * nword2], keyval.first);
+    if (complete)
+        return;
+    for (long i = 0; i < wfn.ndet; ++i)
+        add_det(&wfn.dets[i * nword2]);
 }
 
 void TwoSpinWfn::reserve(const long n) {
     dets.reserve(n * nword2);
-    dict.reserve(n);
+    if (!complete && !addressed)
+        dict.reserve(n);
+}
+
+void TwoSpinWfn::set_zobrist(const bool z) {
+    if (z == zobrist)
+        return;
+    zobrist = z;
+    if (zobrist && zkeys.empty())
+        set_zkeys();
+    if (complete || addressed)
+        return;
+    clear_index();
+    hash_dets();
+}
+
+long TwoSpinWfn::insert_det(const ulong *det, const Hash rank) {
+    if (complete)
+        return -1;
+    else if (addressed) {
+        if (index_det(det) != -1)
+            return -1;
+        hash_dets();
+    }
+    // the index entry is only made if det is new, before det is appended to dets
+    bool added = false;
+    dict.lazy_emplace(DetKey{det, rank}, [&](const DetIndex::constructor &ctor) {
+        ctor(ndet);
+        added = true;
+    });
+    if (!added)
+        return -1;
+    dets.resize(dets.size() + nword2);
+    std::memcpy(&dets[nword2 * ndet], det, sizeof(ulong) * nword2);
+    if (bloom)
+        add_filter(rank);
+    return ndet++;
 }
 
 Array<ulong> TwoSpinWfn::py_getitem(const long index) const {
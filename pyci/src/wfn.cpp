@@ -17,24 +17,70 @@
 
 namespace pyci {
 
+namespace {
+
+inline ulong splitmix64(ulong &state) {
+    ulong z = (state += 0x9e3779b97f4a7c15UL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+    return z ^ (z >> 31);
+}
+
+// the Bloom filter sets one bit in each of the eight words of a (cache line) block per
+// determinant, picked from the first half of its rank by a multiply-shift with these salts
+constexpr ulong bloom_salts[8] = {0x47b6137b44974d91UL, 0x8824ad5ba2b7289dUL, 0x705495c72df1424bUL,
+                                  0x9efc49475c6bfb31UL, 0x9e3779b97f4a7c15UL, 0xbf58476d1ce4e5b9UL,
+                                  0x94d049bb133111ebUL, 0xc2b2ae3d27d4eb4fUL};
+
+// determinants per block before the filter is rebuilt at twice the size (8 bits each), so that
+// the filter is much smaller than the hash table and stays in cache
+constexpr long bloom_load = 64;
+
+inline ulong bloom_bit(const ulong h, const long w) {
+    return 1UL << ((h * bloom_salts[w]) >> 58);
+}
+
+} // namespace
+
 Wfn::Wfn(const Wfn &wfn)
     : nbasis(wfn.nbasis), nocc(wfn.nocc), nocc_up(wfn.nocc_up), nocc_dn(wfn.nocc_dn),
       nvir(wfn.nvir), nvir_up(wfn.nvir_up), nvir_dn(wfn.nvir_dn), ndet(wfn.ndet), nword(wfn.nword),
-      nword2(wfn.nword2), maxrank_up(wfn.maxrank_up), maxrank_dn(wfn.maxrank_dn), dets(wfn.dets),
-      dict(wfn.dict) {
+      nword2(wfn.nword2), maxrank_up(wfn.maxrank_up), maxrank_dn(wfn.maxrank_dn),
+      complete(wfn.complete), addressed(wfn.addressed), zobrist(wfn.zobrist), bloom(wfn.bloom),
+      nspin(wfn.nspin), dets(wfn.dets), dict(0, IndexHash(this), IndexEq(this)), nfilter(0),
+      filter_off(0), binoms(wfn.binoms), ref(wfn.ref), refpos(wfn.refpos), offsets(wfn.offsets),
+      zkeys(wfn.zkeys) {
+    // the index hashes through its own wave function, so it is rebuilt rather than copied, and so
+    // is the filter, whose blocks are aligned within its own storage
+    dict.reserve(wfn.dict.size());
+    for (long i : wfn.dict)
+        dict.insert(i);
+    if (!wfn.filter.empty())
+        fill_filter();
 }
 
-Wfn::Wfn(Wfn &&wfn) noexcept
+Wfn::Wfn(Wfn &&wfn)
     : nbasis(std::exchange(wfn.nbasis, 0)), nocc(std::exchange(wfn.nocc, 0)),
       nocc_up(std::exchange(wfn.nocc_up, 0)), nocc_dn(std::exchange(wfn.nocc_dn, 0)),
       nvir(std::exchange(wfn.nvir, 0)), nvir_up(std::exchange(wfn.nvir_up, 0)),
       nvir_dn(std::exchange(wfn.nvir_dn, 0)), ndet(std::exchange(wfn.ndet, 0)),
       nword(std::exchange(wfn.nword, 0)), nword2(std::exchange(wfn.nword2, 0)),
       maxrank_up(std::exchange(wfn.maxrank_up, 0)), maxrank_dn(std::exchange(wfn.maxrank_dn, 0)),
-      dets(std::move(wfn.dets)), dict(std::move(wfn.dict)) {
+      complete(std::exchange(wfn.complete, false)),
+      addressed(std::exchange(wfn.addressed, false)), zobrist(std::exchange(wfn.zobrist, false)),
+      bloom(std::exchange(wfn.bloom, false)), nspin(wfn.nspin), dets(std::move(wfn.dets)),
+      dict(0, IndexHash(this), IndexEq(this)), filter(std::move(wfn.filter)),
+      nfilter(std::exchange(wfn.nfilter, 0)), filter_off(wfn.filter_off),
+      binoms(std::move(wfn.binoms)), ref(std::move(wfn.ref)), refpos(std::move(wfn.refpos)),
+      offsets(std::move(wfn.offsets)), zkeys(std::move(wfn.zkeys)) {
+    dict.reserve(wfn.dict.size());
+    for (long i : wfn.dict)
+        dict.insert(i);
+    wfn.clear_index();
 }
 
-Wfn::Wfn(const long nb, const long nu, const long nd) {
+Wfn::Wfn(const long nb, const long nu, const long nd)
+    : nspin(1), dict(0, IndexHash(this), IndexEq(this)), nfilter(0), filter_off(0) {
     init(nb, nu, nd);
 }
 
@@ -46,7 +92,18 @@ void Wfn::squeeze(void) {
     dets.shrink_to_fit();
 }
 
-Wfn::Wfn(void){};
+Hash Wfn::excite_rank(Hash rank, const long p, const long q) const {
+    // a Zobrist rank is updated for the replacement p -> q by toggling their keys; any other rank
+    // is returned as is, and is recomputed from the determinant where needed
+    if (zobrist) {
+        rank.first ^= zkeys[p].first ^ zkeys[q].first;
+        rank.second ^= zkeys[p].second ^ zkeys[q].second;
+    }
+    return rank;
+}
+
+Wfn::Wfn(void) : nspin(1), dict(0, IndexHash(this), IndexEq(this)), nfilter(0), filter_off(0) {
+}
 
 void Wfn::init(const long nb, const long nu, const long nd) {
     if (nd < 0)
@@ -67,6 +124,208 @@ void Wfn::init(const long nb, const long nu, const long nd) {
     nword2 = nword * 2;
     maxrank_up = binomial(nb, nu);
     maxrank_dn = binomial(nb, nd);
+    complete = false;
+    addressed = false;
+    zobrist = false;
+    bloom = false;
+}
+
+void Wfn::set_binoms(void) {
+    // binoms[k * nbasis + p] is C(p, k + 1)
+    if (static_cast<long>(binoms.size()) == nocc_up * nbasis)
+        return;
+    binoms.resize(nocc_up * nbasis);
+    for (long k = 0; k < nocc_up; ++k)
+        for (long p = 0; p < nbasis; ++p)
+            binoms[k * nbasis + p] = binomial(p, k + 1);
+}
+
+void Wfn::set_complete(void) {
+    // the determinants are the whole space in colex order, so they are indexed by their colex
+    // rank instead of through the hash map
+    complete = true;
+    addressed = false;
+    clear_index();
+    set_binoms();
+}
+
+void Wfn::set_addressed(const ulong *rdet, const long n, const long nblock) {
+    // the determinants are added as whole excitation blocks of one reference, so they are indexed
+    // by the offset of their block and their hole/particle ranks instead of through the hash map
+    long nelec_up = 0, nelec_dn = 0;
+    for (long i = 0; i < nword; ++i)
+        nelec_up += Pop(rdet[i]);
+    for (long i = nword; i < n; ++i)
+        nelec_dn += Pop(rdet[i]);
+    if (nelec_up != nocc_up || (n > nword && nelec_dn != nocc_dn))
+        return;
+    addressed = true;
+    ref.assign(rdet, rdet + n);
+    offsets.assign(nblock, -1);
+    set_binoms();
+    // refpos[s * nbasis + p] is the position of orbital p among the occupied or the virtual
+    // orbitals of spin s of the reference
+    refpos.resize(n / nword * nbasis);
+    for (long s = 0, nr, p; s < n / nword; ++s) {
+        for (p = 0, nr = 0; p < nbasis; ++p) {
+            if (rdet[s * nword + p / Size<ulong>()] & (1UL << (p % Size<ulong>())))
+                refpos[s * nbasis + p] = nr++;
+            else
+                refpos[s * nbasis + p] = p - nr;
+        }
+    }
+}
+
+long Wfn::rank_complete(const long n, const ulong *det) const {
+    long rank = 0, k = 0;
+    ulong word;
+    for (long i = 0; i < nword; ++i) {
+        word = det[i];
+        while (word) {
+            if (k == n)
+                return -1;
+            rank += binoms[k++ * nbasis + Ctz(word) + i * Size<ulong>()];
+            word &= word - 1;
+        }
+    }
+    return (k == n) ? rank : -1;
+}
+
+long Wfn::rank_excited(const long n, const long spin, const ulong *det, long &e) const {
+    // the holes are ranked among the occupied orbitals of the reference and the particles among
+    // its virtual orbitals, in the order that add_excited_dets generates them
+    const ulong *rdet = &ref[spin * nword];
+    const long *pos = &refpos[spin * nbasis];
+    long rank_h = 0, rank_p = 0, nh = 0, np = 0;
+    ulong word;
+    for (long i = 0; i < nword; ++i) {
+        word = rdet[i] & ~det[i];
+        while (word) {
+            rank_h += binoms[nh++ * nbasis + pos[Ctz(word) + i * Size<ulong>()]];
+            word &= word - 1;
+        }
+        word = det[i] & ~rdet[i];
+        while (word) {
+            if (np == n)
+                return -1;
+            rank_p += binoms[np++ * nbasis + pos[Ctz(word) + i * Size<ulong>()]];
+            word &= word - 1;
+        }
+    }
+    if (nh != np)
+        return -1;
+    e = nh;
+    return nh ? rank_p * binoms[(nh - 1) * nbasis + n] + rank_h : 0;
+}
+
+void Wfn::set_zkeys(void) {
+    // fixed keys for each spin-orbital (alpha p, beta nbasis + p), so that wave functions of the
+    // same shape rank their determinants identically
+    ulong state = 0UL;
+    zkeys.resize(nbasis * 2);
+    for (auto &key : zkeys) {
+        key.first = splitmix64(state);
+        key.second = splitmix64(state);
+    }
+}
+
+Hash Wfn::rank_zobrist(const long nspin, const ulong *det) const {
+    Hash rank(0UL, 0UL);
+    ulong word;
+    for (long s = 0, p; s < nspin; ++s) {
+        for (long i = 0; i < nword; ++i) {
+            word = det[s * nword + i];
+            while (word) {
+                p = s * nbasis + i * Size<ulong>() + Ctz(word);
+                rank.first ^= zkeys[p].first;
+                rank.second ^= zkeys[p].second;
+                word &= word - 1;
+            }
+        }
+    }
+    return rank;
+}
+
+Hash Wfn::rank_index(const long i) const {
+    const ulong *det = index_ptr(i);
+    return zobrist ? rank_zobrist(nspin, det) : spookyhash(nspin * nword, det);
+}
+
+void Wfn::clear_index(void) {
+    DetIndex(0, IndexHash(this), IndexEq(this)).swap(dict);
+    Vector<ulong>().swap(filter);
+    nfilter = 0;
+}
+
+void Wfn::hash_dets(void) {
+    // the space is no longer made of whole excitation blocks, so index it through the hash set
+    addressed = false;
+    dict.reserve(ndet);
+    for (long i = 0; i < ndet; ++i)
+        dict.insert(i);
+    if (bloom)
+        fill_filter();
+}
+
+long Wfn::find_det(const ulong *det, const Hash rank) const {
+    if (bloom && !test_filter(rank))
+        return -1;
+    const auto &search = dict.find(DetKey{det, rank});
+    return (search == dict.end()) ? -1 : *search;
+}
+
+void Wfn::set_bloom(const bool b) {
+    if (b == bloom)
+        return;
+    bloom = b;
+    // the filter is kept only alongside the hash index
+    if (bloom && !(complete || addressed))
+        fill_filter();
+    else {
+        Vector<ulong>().swap(filter);
+        nfilter = 0;
+    }
+}
+
+void Wfn::fill_filter(void) {
+    // size the filter at 16 to 32 bits per determinant (including one more to be added), with
+    // its blocks aligned to cache lines in the storage
+    nfilter = 1;
+    while (nfilter * bloom_load < (ndet + 1) * 2)
+        nfilter *= 2;
+    filter.assign(nfilter * 8 + 7, 0UL);
+    filter_off = (-(reinterpret_cast<std::uintptr_t>(filter.data()) / sizeof(ulong))) & 7;
+    for (long i = 0; i < ndet; ++i) {
+        Hash rank = rank_index(i);
+        ulong *block = &filter[filter_pos(rank)];
+        for (long w = 0; w < 8; ++w)
+            block[w] |= bloom_bit(rank.first, w);
+    }
+}
+
+void Wfn::add_filter(const Hash rank) {
+    // rank is that of the determinant about to be appended to dets
+    if (filter.empty() || ndet >= nfilter * bloom_load)
+        fill_filter();
+    ulong *block = &filter[filter_pos(rank)];
+    for (long w = 0; w < 8; ++w)
+        block[w] |= bloom_bit(rank.first, w);
+}
+
+bool Wfn::test_filter(const Hash rank) const {
+    // false only if no determinant of the wave function has this rank
+    if (filter.empty())
+        return true;
+    const ulong *block = &filter[filter_pos(rank)];
+    ulong miss = 0UL;
+    for (long w = 0; w < 8; ++w)
+        miss |= bloom_bit(rank.first, w) & ~block[w];
+    return !miss;
+}
+
+long Wfn::nexcited(const long n, const long e) const {
+    // C(n, e) * C(nbasis - n, e) determinants are e-fold excitations of an n-electron reference
+    return e ? binoms[(e - 1) * nbasis + n] * binoms[(e - 1) * nbasis + nbasis - n] : 1;
 }
 
 } // namespace pyci
@@ -17,6 +17,8 @@ r"""PyCI test module."""
 
 from os import path
 
+import pytest
+
 
 __all__ = [
     "datafile",
@@ -30,6 +32,8 @@ def datafile(name):
     r"""
     Return the full path of a PyCI test data file.
 
+    The calling test is skipped if the file is not in the test data directory.
+
     Parameters
     ----------
     name : str
@@ -41,4 +45,7 @@ def datafile(name):
         Path to file.
 
     """
-    return path.abspath(path.join(DATAPATH, name))
+    filename = path.abspath(path.join(DATAPATH, name))
+    if not path.isfile(filename):
+        pytest.skip("test data file {0:s} is not available".format(name))
+    return filename
@@ -34,6 +34,40 @@ def parity(p):
     return 1.0 if parity2(p) else -1.0
 
 
+def spinorbital_ham(ham):
+    # alpha spin-orbitals are 0..n-1 and beta spin-orbitals are n..2n-1
+    n = ham.nbasis
+    one_mo = np.zeros((2 * n, 2 * n))
+    two_mo = np.zeros((2 * n, 2 * n, 2 * n, 2 * n))
+    for a in (slice(0, n), slice(n, 2 * n)):
+        one_mo[a, a] = ham.one_mo
+        for b in (slice(0, n), slice(n, 2 * n)):
+            two_mo[a, b, a, b] = ham.two_mo
+    return pyci.secondquant_op(ham.ecore, one_mo, two_mo)
+
+
+def spinorbital_wfn(wfn):
+    # the same determinants, in the same order, as a GenCI wave function
+    occs = wfn.to_occ_array()
+    occs = np.hstack((occs[:, 0], occs[:, 1] + wfn.nbasis))
+    return pyci.genci_wfn(2 * wfn.nbasis, wfn.nocc, 0, occs)
+
+
+def enpt2_brute_force(ham, wfn, coeffs, energy):
+    # Epstein-Nesbet sum over every determinant of the full space that is not in wfn
+    full = type(wfn)(wfn.nbasis, wfn.nocc_up, wfn.nocc_dn)
+    full.add_all_dets()
+    op = pyci.sparse_op(ham, full, symmetric=False)
+    idx = [full.index_det(det) for det in wfn.to_det_array()]
+    x = np.zeros(len(full), dtype=pyci.c_double)
+    x[idx] = coeffs
+    ext = np.ones(len(full), dtype=bool)
+    ext[idx] = False
+    hx = op(x)[ext]
+    diag = np.array([op.get_element(i, i) for i in np.flatnonzero(ext)]) + ham.ecore
+    return energy + np.sum(hx * hx / (energy - diag))
+
+
 @pytest.mark.parametrize(
     "filename, wfn_type, occs, energy",
     [
@@ -54,6 +88,74 @@ def test_solve_sparse(filename, wfn_type, occs, energy):
     npt.assert_allclose(es[0], energy, rtol=0.0, atol=1.0e-9)
 
 
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs",
+    [
+        ("lih_sto6g", pyci.fullci_wfn, (2, 2)),
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2)),
+    ],
+)
+def test_solve_nonsymmetric(filename, wfn_type, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    es, _ = pyci.sparse_op(ham, wfn).solve(n=3, tol=1.0e-12)
+    # the fully stored operator has the same spectrum, with any number of threads
+    op = pyci.sparse_op(ham, wfn, symmetric=False)
+    nthread = pyci.get_num_threads()
+    try:
+        for n in (1, 4):
+            pyci.set_num_threads(n)
+            fs, _ = op.solve(n=3, tol=1.0e-12)
+            npt.assert_allclose(fs, es, rtol=0.0, atol=1.0e-9)
+    finally:
+        pyci.set_num_threads(nthread)
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs",
+    [
+        ("lih_sto6g", pyci.fullci_wfn, (2, 2)),
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2)),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2)),
+    ],
+)
+def test_solve_davidson(filename, wfn_type, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    op = pyci.sparse_op(ham, wfn)
+    es, _ = op.solve(n=3, ncv=30, tol=1.0e-6)
+    ds, ds_cs = op.solve(n=3, tol=1.0e-12, method="davidson")
+    npt.assert_allclose(ds, es, rtol=0.0, atol=1.0e-9)
+    for e, c in zip(ds, ds_cs):
+        npt.assert_allclose(op(c), (e - op.ecore) * c, rtol=0.0, atol=1.0e-5)
+    # restart from the converged eigenvectors
+    ds, _ = op.solve(n=3, c0=ds_cs, tol=1.0e-12, method="davidson")
+    npt.assert_allclose(ds, es, rtol=0.0, atol=1.0e-9)
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, nroot",
+    [
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), 3),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), 4),
+    ],
+)
+def test_solve_davidson_degenerate(filename, wfn_type, occs, nroot):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    pyci.add_excitations(wfn, 0, 1, 2)
+    op = pyci.sparse_op(ham, wfn)
+    es, _ = op.solve(n=nroot, tol=1.0e-12)
+    # the second and third roots are degenerate
+    npt.assert_allclose(es[1], es[2], rtol=0.0, atol=1.0e-9)
+    ds, ds_cs = op.solve(n=nroot, tol=1.0e-12, method="davidson")
+    npt.assert_allclose(ds, es, rtol=0.0, atol=1.0e-9)
+    ds, _ = op.solve(n=nroot, c0=ds_cs, tol=1.0e-12, method="davidson")
+    npt.assert_allclose(ds, es, rtol=0.0, atol=1.0e-9)
+
+
 @pytest.mark.parametrize(
     "filename, wfn_type, occs, energy",
     [
@@ -80,6 +182,247 @@ def test_sparse_rectangular(filename, wfn_type, occs, energy):
     npt.assert_allclose(y, z)
 
 
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs",
+    [
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5)),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2)),
+    ],
+)
+def test_sparse_threaded(filename, wfn_type, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    nthread = pyci.get_num_threads()
+    try:
+        pyci.set_num_threads(1)
+        op1 = pyci.sparse_op(ham, wfn)
+        pyci.set_num_threads(4)
+        op4 = pyci.sparse_op(ham, wfn)
+        opu = pyci.sparse_op(ham, wfn_type(ham.nbasis, *occs, wfn.to_det_array(len(wfn) // 3)))
+        opu.update(ham, wfn)
+    finally:
+        pyci.set_num_threads(nthread)
+    for op in (op4, opu):
+        npt.assert_array_equal(op.indptr(), op1.indptr())
+        npt.assert_array_equal(op.indices(), op1.indices())
+        npt.assert_array_equal(op.data(), op1.data())
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, nrow",
+    [
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), -1),
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), 1000),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), -1),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), 500),
+    ],
+)
+def test_sparse_update_columns(filename, wfn_type, occs, nrow):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    part = wfn_type(ham.nbasis, *occs, wfn.to_det_array(len(wfn) // 3))
+    op = pyci.sparse_op(ham, part, nrow, symmetric=False)
+    op.update(ham, wfn)
+    ref = pyci.sparse_op(ham, wfn, op.shape[0], symmetric=False)
+    assert op.shape == ref.shape
+    npt.assert_array_equal(op.indptr(), ref.indptr())
+    npt.assert_array_equal(op.indices(), ref.indices())
+    npt.assert_allclose(op.data(), ref.data(), rtol=0.0, atol=1.0e-12)
+
+
+def test_sparse_compact_indices():
+    ham = pyci.secondquant_op(datafile("be_ccpvdz.fcidump"))
+    wfn = pyci.fullci_wfn(ham.nbasis, 2, 2)
+    wfn.add_all_dets()
+    op = pyci.sparse_op(ham, wfn)
+    assert op.compact
+    assert op.indices().dtype == np.int32
+    assert op.indices().shape[0] == op.size
+    indptr, indices = op.indptr(), op.indices()
+    for i in range(0, op.shape[0], 97):
+        for j in indices[indptr[i] : indptr[i + 1]]:
+            assert op.get_element(i, j) != 0.0
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, symmetric",
+    [
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), True),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), False),
+    ],
+)
+def test_sparse_file(tmp_path, filename, wfn_type, occs, symmetric):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    op = pyci.sparse_op(ham, wfn, symmetric=symmetric)
+    op.to_file(str(tmp_path / "op.bin"))
+    op2 = pyci.sparse_op(str(tmp_path / "op.bin"))
+    assert op2.shape == op.shape
+    assert op2.size == op.size
+    assert op2.ecore == op.ecore
+    assert op2.symmetric == op.symmetric
+    assert op2.compact == op.compact
+    npt.assert_array_equal(op2.data(), op.data())
+    npt.assert_array_equal(op2.indices(), op.indices())
+    npt.assert_array_equal(op2.indptr(), op.indptr())
+    x = np.sin(np.arange(op.shape[1], dtype=pyci.c_double))
+    npt.assert_array_equal(op2(x), op(x))
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, symmetric",
+    [
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), True),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), True),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), False),
+    ],
+)
+def test_sparse_out_of_core(tmp_path, filename, wfn_type, occs, symmetric):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    op = pyci.sparse_op(ham, wfn, symmetric=symmetric)
+    try:
+        pyci.set_out_of_core(str(tmp_path), op.size // 5)
+        op2 = pyci.sparse_op(ham, wfn, symmetric=symmetric)
+    finally:
+        pyci.set_out_of_core("")
+    assert op2.size == op.size
+    npt.assert_array_equal(op2.data(), op.data())
+    npt.assert_array_equal(op2.indices(), op.indices())
+    npt.assert_array_equal(op2.indptr(), op.indptr())
+    x = np.sin(np.arange(op.shape[1], dtype=pyci.c_double))
+    npt.assert_allclose(op2(x), op(x), rtol=0.0, atol=1.0e-12)
+    xs = np.stack([x, np.cos(x)], axis=1)
+    npt.assert_allclose(op2.matmat(xs), op.matmat(xs), rtol=0.0, atol=1.0e-12)
+    if symmetric:
+        es, _ = op.solve(n=1, tol=1.0e-9)
+        es2, _ = op2.solve(n=1, tol=1.0e-9)
+        npt.assert_allclose(es2, es, rtol=0.0, atol=1.0e-9)
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, symmetric",
+    [
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), True),
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), False),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), True),
+    ],
+)
+def test_sparse_matvec_threaded(filename, wfn_type, occs, symmetric):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    op = pyci.sparse_op(ham, wfn, symmetric=symmetric)
+    x = np.sin(np.arange(op.shape[1], dtype=pyci.c_double))
+    nthread = pyci.get_num_threads()
+    try:
+        pyci.set_num_threads(1)
+        y1 = op(x)
+        pyci.set_num_threads(4)
+        y4 = op(x)
+    finally:
+        pyci.set_num_threads(nthread)
+    npt.assert_allclose(y4, y1, rtol=0.0, atol=1.0e-10)
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, symmetric",
+    [
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), True),
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), False),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), True),
+    ],
+)
+def test_sparse_matmat(filename, wfn_type, occs, symmetric):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    nrow = len(wfn) if symmetric else len(wfn) // 2
+    op = pyci.sparse_op(ham, wfn, nrow, symmetric=symmetric)
+    x = np.sin(np.arange(op.shape[1] * 5, dtype=pyci.c_double)).reshape(op.shape[1], 5)
+    y = op.matmat(x)
+    assert y.shape == (op.shape[0], 5)
+    for j in range(5):
+        npt.assert_allclose(y[:, j], op(np.ascontiguousarray(x[:, j])), rtol=0.0, atol=1.0e-10)
+    out = np.empty_like(y)
+    npt.assert_allclose(op.matmat(x, out), y, rtol=0.0, atol=0.0)
+    # arrays that do not match the shape of the operator are rejected
+    with pytest.raises(ValueError):
+        op.matmat(x[:-1])
+    with pytest.raises(ValueError):
+        op.matmat(x, out[:, :4])
+    with pytest.raises(ValueError):
+        op.matmat(x, np.empty((op.shape[0] + 1, 5), dtype=pyci.c_double))
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs, energy",
+    [
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2), -14.600556994),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), -14.617409507),
+    ],
+)
+def test_direct_op(filename, wfn_type, occs, energy):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    op = pyci.direct_op(ham, wfn)
+    assert op.shape == (len(wfn), len(wfn))
+    x = np.sin(np.arange(op.shape[1], dtype=pyci.c_double))
+    npt.assert_allclose(op(x), pyci.sparse_op(ham, wfn, symmetric=False)(x), rtol=0.0, atol=1.0e-10)
+    es, _ = op.solve(n=1, ncv=30, tol=1.0e-6)
+    npt.assert_allclose(es[0], energy, rtol=0.0, atol=1.0e-9)
+
+
+@pytest.mark.parametrize(
+    "filename, occs",
+    [
+        ("be_ccpvdz", (2, 1)),
+        ("h6_sto_3g", (3, 3)),
+    ],
+)
+def test_direct_op_fullci_order(filename, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = pyci.fullci_wfn(ham.nbasis, *occs)
+    wfn.add_all_dets()
+    dets = np.ascontiguousarray(wfn.to_det_array()[::-1])
+    wfn = pyci.fullci_wfn(ham.nbasis, *occs, dets)
+    op = pyci.direct_op(ham, wfn)
+    x = np.sin(np.arange(op.shape[1], dtype=pyci.c_double))
+    npt.assert_allclose(op(x), pyci.sparse_op(ham, wfn, symmetric=False)(x), rtol=0.0, atol=1.0e-10)
+
+
+@pytest.mark.parametrize(
+    "filename, occs",
+    [
+        ("be_ccpvdz", (2, 2)),
+        ("h6_sto_3g", (3, 3)),
+    ],
+)
+def test_connected_dets_fullci(filename, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    full = pyci.fullci_wfn(ham.nbasis, *occs)
+    full.add_all_dets()
+    wfn = pyci.fullci_wfn(ham.nbasis, *occs)
+    pyci.add_excitations(wfn, 0, 1, 2)
+    idx = np.array([full.index_det(det) for det in wfn.to_det_array()])
+    x = np.zeros(len(full), dtype=pyci.c_double)
+    x[idx] = np.sin(np.arange(len(wfn), dtype=pyci.c_double))
+    x /= np.linalg.norm(x)
+    y = pyci.sparse_op(ham, full)(x)[idx]
+    npt.assert_allclose(pyci.sparse_op(ham, wfn)(x[idx]), y, rtol=0.0, atol=1.0e-10)
+    npt.assert_allclose(
+        pyci.sparse_op(ham, wfn, symmetric=False)(x[idx]), y, rtol=0.0, atol=1.0e-10
+    )
+    npt.assert_allclose(pyci.direct_op(ham, wfn)(x[idx]), y, rtol=0.0, atol=1.0e-10)
+    for rdm, ref in zip(pyci.compute_rdms(wfn, x[idx]), pyci.compute_rdms(full, x)):
+        npt.assert_allclose(rdm, ref, rtol=0.0, atol=1.0e-12)
+
+
 @pytest.mark.parametrize(
     "filename, wfn_type, occs, energy",
     [
@@ -313,12 +656,10 @@ def test_run_hci(filename, wfn_type, occs, energy):
 @pytest.mark.parametrize(
     "filename, wfn_type, occs, energy",
     [
-        ("he_ccpvqz", pyci.fullci_wfn, (1, 1), -2.964248588),
-        ("li2_ccpvdz", pyci.doci_wfn, (3, 3), -14.881173703),
-        ("be_ccpvdz", pyci.doci_wfn, (2, 2), -14.603138756),
-        ("he_ccpvqz", pyci.doci_wfn, (1, 1), -2.964248588),
-        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), -14.617423859),
-        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), -75.784506748),
+        ("li2_ccpvdz", pyci.doci_wfn, (3, 3), -14.900429524),
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2), -14.619206122),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2), -14.617403460),
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5), -76.042273765),
     ],
 )
 def test_enpt2(filename, wfn_type, occs, energy):
@@ -329,6 +670,200 @@ def test_enpt2(filename, wfn_type, occs, energy):
     es, cs = op.solve()
     e = pyci.compute_enpt2(ham, wfn, cs[0], es[0], 1.0e-4)
     npt.assert_allclose(e, energy)
+    # Zobrist ranks of the excitations give the same result through the hash table
+    wfn = wfn_type(ham.nbasis, *occs, wfn.to_det_array())
+    wfn.set_zobrist(True)
+    e = pyci.compute_enpt2(ham, wfn, cs[0], es[0], 1.0e-4)
+    npt.assert_allclose(e, energy)
+    # so do the lookups prefiltered by a Bloom filter
+    wfn.set_bloom(True)
+    e = pyci.compute_enpt2(ham, wfn, cs[0], es[0], 1.0e-4)
+    npt.assert_allclose(e, energy)
+    # and the sum over a hash partition of the external determinants
+    e = pyci.compute_enpt2(ham, wfn, cs[0], es[0], 1.0e-4, npart=3)
+    npt.assert_allclose(e, energy)
+
+
+@pytest.mark.parametrize(
+    "filename, occs",
+    [
+        ("be_ccpvdz", (2, 2)),
+        ("lih_sto6g", (2, 2)),
+    ],
+)
+def test_genci_fullci(filename, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = pyci.fullci_wfn(ham.nbasis, *occs)
+    pyci.add_excitations(wfn, 0, 1, 2)
+    es, _ = pyci.sparse_op(ham, wfn).solve(n=1, tol=1.0e-9)
+    # GenCI on the spin-orbital Hamiltonian spans the same space
+    op = pyci.sparse_op(spinorbital_ham(ham), spinorbital_wfn(wfn))
+    ges, _ = op.solve(n=1, tol=1.0e-9)
+    npt.assert_allclose(ges[0], es[0], rtol=0.0, atol=1.0e-9)
+
+
+@pytest.mark.parametrize(
+    "filename, occs",
+    [
+        ("h4_sto3g", (2, 2)),
+        ("lih_sto6g", (2, 2)),
+    ],
+)
+def test_genci_rdms(filename, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = pyci.fullci_wfn(ham.nbasis, *occs)
+    pyci.add_excitations(wfn, 0, 1, 2)
+    _, cs = pyci.sparse_op(ham, wfn).solve(n=1, tol=1.0e-9)
+    rdm1, rdm2 = pyci.spinize_rdms(*pyci.compute_rdms(wfn, cs[0]))
+    # GenCI RDMs of the same determinants are the spinized FullCI RDMs, with any number of threads
+    gwfn = spinorbital_wfn(wfn)
+    nthread = pyci.get_num_threads()
+    try:
+        for n in (1, 4):
+            pyci.set_num_threads(n)
+            grdm1, grdm2 = pyci.compute_rdms(gwfn, cs[0])
+            npt.assert_allclose(grdm1, rdm1, rtol=0.0, atol=1.0e-12)
+            npt.assert_allclose(grdm2, rdm2, rtol=0.0, atol=1.0e-12)
+    finally:
+        pyci.set_num_threads(nthread)
+
+
+@pytest.mark.parametrize(
+    "filename, occs",
+    [
+        ("h4_sto3g", (2, 2)),
+        ("lih_sto6g", (2, 2)),
+    ],
+)
+def test_genci_enpt2(filename, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = pyci.fullci_wfn(ham.nbasis, *occs)
+    pyci.add_excitations(wfn, 0, 1)
+    es, cs = pyci.sparse_op(ham, wfn).solve(n=1, tol=1.0e-9)
+    ham = spinorbital_ham(ham)
+    wfn = spinorbital_wfn(wfn)
+    e = pyci.compute_enpt2(ham, wfn, cs[0], es[0], 0.0)
+    npt.assert_allclose(e, enpt2_brute_force(ham, wfn, cs[0], es[0]), rtol=0.0, atol=1.0e-9)
+
+
+@pytest.mark.parametrize(
+    "filename, occs",
+    [
+        ("h4_sto3g", (2, 2)),
+        ("lih_sto6g", (2, 2)),
+    ],
+)
+def test_enpt2_brute_force(filename, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = pyci.fullci_wfn(ham.nbasis, *occs)
+    pyci.add_excitations(wfn, 0, 1)
+    es, cs = pyci.sparse_op(ham, wfn).solve(n=1, tol=1.0e-9)
+    energy = enpt2_brute_force(ham, wfn, cs[0], es[0])
+    # the diagonal elements of the 1-1 excitations do not depend on the other excitations
+    # kept before them, nor on how the determinants are split over the threads
+    nthread = pyci.get_num_threads()
+    try:
+        for n in (1, 4):
+            pyci.set_num_threads(n)
+            e = pyci.compute_enpt2(ham, wfn, cs[0], es[0], 0.0)
+            npt.assert_allclose(e, energy, rtol=0.0, atol=1.0e-9)
+    finally:
+        pyci.set_num_threads(nthread)
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs",
+    [
+        ("be_ccpvdz", pyci.doci_wfn, (2, 2)),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2)),
+        ("li2_ccpvdz", pyci.doci_wfn, (3, 3)),
+    ],
+)
+def test_enpt2_semistochastic(filename, wfn_type, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = wfn_type(ham.nbasis, *occs)
+    pyci.add_excitations(wfn, *range(0, max(wfn.nocc - 1, 1)))
+    op = pyci.sparse_op(ham, wfn)
+    es, cs = op.solve()
+    energy = pyci.compute_enpt2(ham, wfn, cs[0], es[0], 1.0e-6)
+    e, err = pyci.compute_enpt2(
+        ham, wfn, cs[0], es[0], 1.0e-6, mode="semistochastic", eps_det=1.0e-4, nsamples=64, seed=1
+    )
+    assert err > 0
+    assert abs(e - energy) < 4 * err
+    # the samples do not depend on the number of threads
+    e1, err1 = pyci.compute_enpt2(
+        ham, wfn, cs[0], es[0], 1.0e-6, nthread=1, mode="semistochastic", nsamples=64, seed=1
+    )
+    npt.assert_allclose(e1, e, rtol=1.0e-12)
+    npt.assert_allclose(err1, err, rtol=1.0e-12)
+    # with no stochastic part, the deterministic energy is recovered
+    e, err = pyci.compute_enpt2(ham, wfn, cs[0], es[0], 1.0e-4, mode="semistochastic")
+    npt.assert_allclose(e, pyci.compute_enpt2(ham, wfn, cs[0], es[0], 1.0e-4))
+    assert err == 0
+
+
+@pytest.mark.parametrize(
+    "filename, occs",
+    [
+        ("be_ccpvdz", (2, 2)),
+    ],
+)
+def test_genci_hci(filename, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    wfn = pyci.fullci_wfn(ham.nbasis, *occs)
+    pyci.add_excitations(wfn, 0, 1)
+    gham = spinorbital_ham(ham)
+    gwfn = spinorbital_wfn(wfn)
+    es, cs = pyci.sparse_op(ham, wfn).solve(n=1, tol=1.0e-9)
+    # GenCI on the spin-orbital Hamiltonian selects the same determinants as FullCI
+    nadd = pyci.add_hci(ham, wfn, cs[0], eps=1.0e-4)
+    assert nadd > 0
+    assert pyci.add_hci(gham, gwfn, cs[0], eps=1.0e-4) == nadd
+    occs = spinorbital_wfn(wfn).to_occ_array()
+    assert set(map(tuple, gwfn.to_occ_array())) == set(map(tuple, occs))
+
+
+@pytest.mark.parametrize(
+    "filename, wfn_type, occs",
+    [
+        ("h2o_ccpvdz", pyci.doci_wfn, (5, 5)),
+        ("be_ccpvdz", pyci.fullci_wfn, (2, 2)),
+    ],
+)
+def test_thread_pool(filename, wfn_type, occs):
+    ham = pyci.secondquant_op(datafile("{0:s}.fcidump".format(filename)))
+    results = []
+    nthread = pyci.get_num_threads()
+    try:
+        for n, pin in ((1, False), (4, True), (4, False)):
+            pyci.set_num_threads(n, pin=pin)
+            pyci.reset_busy_times()
+            wfn = wfn_type(ham.nbasis, *occs)
+            pyci.add_excitations(wfn, 0, 1)
+            op = pyci.sparse_op(ham, wfn)
+            es, cs = op.solve(n=1, tol=1.0e-9)
+            pyci.add_hci(ham, wfn, cs[0], eps=1.0e-4)
+            full = wfn_type(ham.nbasis, *occs)
+            full.add_all_dets()
+            times = pyci.get_busy_times()
+            assert 1 <= len(times) <= n
+            assert np.all(times >= 0)
+            results.append(
+                (
+                    wfn.to_det_array(),
+                    pyci.compute_enpt2(ham, wfn, np.ones(len(wfn)), es[0], 1.0e-4),
+                    pyci.compute_overlap(wfn, full, np.ones(len(wfn)), np.ones(len(full))),
+                    full.to_det_array(),
+                )
+            )
+    finally:
+        pyci.set_num_threads(nthread)
+    for result in results[1:]:
+        npt.assert_array_equal(result[0], results[0][0])
+        npt.assert_allclose(result[1], results[0][1], rtol=1.0e-12)
+        npt.assert_allclose(result[2], len(results[0][0]))
+        npt.assert_array_equal(result[3], results[0][3])
 
 
 def test_compute_rdm_two_particles_one_up_one_dn():
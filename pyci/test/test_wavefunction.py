@@ -88,9 +88,12 @@ def test_doci_copy(nbasis, nocc):
 def test_doci_add_all_dets(nbasis, nocc):
     wfn = pyci.doci_wfn(nbasis, nocc, nocc)
     wfn.add_all_dets()
-    for det in wfn.to_det_array():
+    assert wfn.complete
+    for i, det in enumerate(wfn.to_det_array()):
         assert pyci.popcnt(det) == wfn.nocc_up == wfn.nocc_dn == wfn.nocc // 2
+        assert wfn.index_det(det) == i
     assert len(wfn) == comb(wfn.nbasis, wfn.nocc_up, exact=True)
+    assert wfn.add_det(wfn[0]) == -1
 
 
 @pytest.mark.parametrize("nbasis, nocc", [(16, 8), (64, 1), (64, 4), (65, 1), (65, 4), (129, 3)])
@@ -103,6 +106,9 @@ def test_doci_add_excited_dets(nbasis, nocc):
         wfn.add_excited_dets(i)
         assert len(wfn) == length
     assert len(wfn) == comb(wfn.nbasis, wfn.nocc_up, exact=True)
+    assert wfn.addressed
+    for i, det in enumerate(wfn.to_det_array()):
+        assert wfn.index_det(det) == i
 
 
 @pytest.mark.parametrize(
@@ -155,6 +161,50 @@ def test_fullci_copy(nbasis, nocc_up, nocc_dn):
     det1 = wfn1.to_det_array()
     det2 = wfn2.to_det_array()
     npt.assert_allclose(det1, det2)
+    # the hash index of a copy looks up the copy's own determinants
+    wfn1 = pyci.fullci_wfn(nbasis, nocc_up, nocc_dn, det1[::-1])
+    wfn2 = wfn1.__class__(wfn1)
+    del wfn1
+    for i, det in enumerate(det1[::-1]):
+        assert wfn2.index_det(det) == i
+
+
+@pytest.mark.parametrize(
+    "nbasis, nocc_up, nocc_dn", [(8, 3, 3), (64, 1, 1), (64, 2, 1), (65, 2, 1), (129, 2, 1)]
+)
+def test_fullci_zobrist(nbasis, nocc_up, nocc_dn):
+    wfn1 = pyci.fullci_wfn(nbasis, nocc_up, nocc_dn)
+    wfn1.add_all_dets()
+    wfn2 = pyci.fullci_wfn(nbasis, nocc_up, nocc_dn, wfn1.to_det_array())
+    wfn2.set_zobrist(True)
+    assert wfn2.zobrist
+    for i, det in enumerate(wfn1.to_det_array()):
+        assert wfn2.index_det(det) == i
+    assert wfn2.add_det(wfn1[0]) == -1
+
+
+@pytest.mark.parametrize("nbasis, nocc_up, nocc_dn", [(8, 3, 3), (64, 1, 1), (65, 2, 1)])
+def test_fullci_bloom(nbasis, nocc_up, nocc_dn):
+    wfn1 = pyci.fullci_wfn(nbasis, nocc_up, nocc_dn)
+    wfn1.add_all_dets()
+    dets = wfn1.to_det_array()
+    wfn2 = pyci.fullci_wfn(nbasis, nocc_up, nocc_dn)
+    wfn2.set_bloom(True)
+    assert wfn2.bloom
+    # the filter grows with the determinants added one at a time
+    for det in dets[::2]:
+        wfn2.add_det(det)
+    for i, det in enumerate(dets):
+        assert wfn2.index_det(det) == (-1 if i % 2 else i // 2)
+    wfn2.add_dets_from_wfn(wfn1)
+    assert len(wfn2) == len(wfn1)
+    wfn3 = wfn2.__class__(wfn2)
+    assert wfn3.bloom
+    for wfn in (wfn2, wfn3):
+        for det in dets:
+            assert wfn.index_det(det) != -1
+            assert wfn.index_det_from_rank(wfn.rank_det(det)) == wfn.index_det(det)
+        assert wfn.add_det(dets[0]) == -1
 
 
 @pytest.mark.parametrize(
@@ -164,10 +214,13 @@ def test_fullci_add_all_dets(nbasis, nocc_up, nocc_dn):
     ndet = comb(nbasis, nocc_up, exact=True) * comb(nbasis, nocc_dn, exact=True)
     wfn = pyci.fullci_wfn(nbasis, nocc_up, nocc_dn)
     wfn.add_all_dets()
-    for det in wfn.to_det_array():
+    assert wfn.complete
+    for i, det in enumerate(wfn.to_det_array()):
         assert pyci.popcnt(det[0]) == wfn.nocc_up
         assert pyci.popcnt(det[1]) == wfn.nocc_dn
+        assert wfn.index_det(det) == i
     assert len(wfn) == ndet
+    assert wfn.add_det(wfn[0]) == -1
 
 
 @pytest.mark.parametrize(
@@ -180,3 +233,14 @@ def test_fullci_add_excited_dets(nbasis, nocc_up, nocc_dn):
     for i in range(wfn.nocc_up + wfn.nocc_dn + 1):
         wfn.add_excited_dets(i)
     assert len(wfn) == ndet
+    assert wfn.addressed
+    for i, det in enumerate(wfn.to_det_array()):
+        assert wfn.index_det(det) == i
+    # adding a determinant outside of the excitation blocks moves the index to the hash table
+    wfn = pyci.fullci_wfn(nbasis, nocc_up, nocc_dn)
+    wfn.add_excited_dets(1)
+    assert wfn.addressed
+    wfn.add_excited_dets(1, ref=wfn[len(wfn) - 1])
+    assert not wfn.addressed
+    for i, det in enumerate(wfn.to_det_array()):
+        assert wfn.index_det(det) == i
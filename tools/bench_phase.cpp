@@ -0,0 +1,119 @@
+/* This file is part of PyCI.
+ *
+ * PyCI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * PyCI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PyCI. If not, see <http://www.gnu.org/licenses/>. */
+
+/* Microbenchmark of the excitation phase kernels: the phases of all single and double
+ * excitations of random determinants, from masked popcounts over the words of each determinant
+ * and from its prefix parity table. It uses only the inline kernels of pyci.h, so it is built
+ * without the library objects. Run with `make bench`. */
+
+#include <pyci.h>
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace pyci;
+
+namespace {
+
+double seconds(void) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+template<long NW>
+void bench_phase(const long nbasis, const long nocc, const long ndet) {
+    long nword = (nbasis + Size<ulong>() - 1) / Size<ulong>(), nvir = nbasis - nocc;
+    std::mt19937_64 rng(1);
+    AlignedVector<ulong> dets(ndet * nword, 0UL);
+    AlignedVector<long> orbs(nbasis), occs(nocc), virs(nvir), parity(nbasis + 1);
+    for (long idet = 0; idet < ndet; ++idet) {
+        std::iota(orbs.begin(), orbs.end(), 0);
+        std::shuffle(orbs.begin(), orbs.end(), rng);
+        for (long i = 0; i < nocc; ++i)
+            dets[idet * nword + orbs[i] / Size<ulong>()] |= 1UL << (orbs[i] % Size<ulong>());
+    }
+    long nsingle = 0, ndouble = 0, sum_mask = 0, sum_table = 0;
+    double t_mask[2], t_table[2], t;
+    // masked popcounts
+    t = seconds();
+    for (long idet = 0; idet < ndet; ++idet) {
+        const ulong *det = &dets[idet * nword];
+        fill_occs<NW>(nword, det, &occs[0]);
+        fill_virs<NW>(nword, nbasis, det, &virs[0]);
+        for (long i = 0; i < nocc; ++i)
+            for (long j = 0; j < nvir; ++j)
+                sum_mask += phase_single_det<NW>(nword, occs[i], virs[j], det);
+    }
+    t_mask[0] = seconds() - t;
+    t = seconds();
+    for (long idet = 0; idet < ndet; ++idet) {
+        const ulong *det = &dets[idet * nword];
+        fill_occs<NW>(nword, det, &occs[0]);
+        fill_virs<NW>(nword, nbasis, det, &virs[0]);
+        for (long i = 0; i < nocc; ++i)
+            for (long j = 0; j < nvir; ++j)
+                for (long k = i + 1; k < nocc; ++k)
+                    for (long l = j + 1; l < nvir; ++l)
+                        sum_mask += phase_double_det<NW>(nword, occs[i], occs[k], virs[j],
+                                                         virs[l], det);
+    }
+    t_mask[1] = seconds() - t;
+    // prefix parity table
+    t = seconds();
+    for (long idet = 0; idet < ndet; ++idet) {
+        const ulong *det = &dets[idet * nword];
+        fill_occs<NW>(nword, det, &occs[0]);
+        fill_virs<NW>(nword, nbasis, det, &virs[0]);
+        fill_parity<NW>(nword, nbasis, det, &parity[0]);
+        for (long i = 0; i < nocc; ++i)
+            for (long j = 0; j < nvir; ++j) {
+                sum_table += phase_single_det(&parity[0], occs[i], virs[j]);
+                ++nsingle;
+            }
+    }
+    t_table[0] = seconds() - t;
+    t = seconds();
+    for (long idet = 0; idet < ndet; ++idet) {
+        const ulong *det = &dets[idet * nword];
+        fill_occs<NW>(nword, det, &occs[0]);
+        fill_virs<NW>(nword, nbasis, det, &virs[0]);
+        fill_parity<NW>(nword, nbasis, det, &parity[0]);
+        for (long i = 0; i < nocc; ++i)
+            for (long j = 0; j < nvir; ++j)
+                for (long k = i + 1; k < nocc; ++k)
+                    for (long l = j + 1; l < nvir; ++l) {
+                        sum_table += phase_double_det(&parity[0], occs[i], occs[k], virs[j],
+                                                      virs[l]);
+                        ++ndouble;
+                    }
+    }
+    t_table[1] = seconds() - t;
+    std::printf("nword %2ld nbasis %4ld nocc %2ld | single: mask %6.2f ns, table %6.2f ns | "
+                "double: mask %6.2f ns, table %6.2f ns | %s\n",
+                nword, nbasis, nocc, t_mask[0] / nsingle * 1e9, t_table[0] / nsingle * 1e9,
+                t_mask[1] / ndouble * 1e9, t_table[1] / ndouble * 1e9,
+                (sum_mask == sum_table) ? "ok" : "MISMATCH");
+}
+
+} // namespace
+
+int main(void) {
+    bench_phase<1>(48, 8, 2000);
+    bench_phase<2>(120, 8, 2000);
+    bench_phase<4>(250, 6, 2000);
+    bench_phase<0>(400, 5, 2000);
+    return 0;
+}